@@ -13,6 +13,11 @@ long *_tls_tpurcode();
 char *tpstrerror(int err);
 
 char *tpalloc(char *type, char *subtype, long size);
+/* Fuxedo extension: TPSHAREDMEM allocates the buffer in shared memory of the
+ * domain if there is room. tpreturn and tpforward hand such buffers to the
+ * receiver without copying. */
+#define TPSHAREDMEM 0x00000001
+char *tpallocx(char *type, char *subtype, long size, long flags);
 char *tprealloc(char *ptr, long size);
 void tpfree(char *ptr);
 long tptypes(char *ptr, char *type, char *subtype);
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "atmidefs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Read-only copy of MIB counters for monitors that poll often. Taking it does
+ * not go through ATMI, does not take the data lock and does not allocate.
+ */
+
+/* Changes whenever the layout below changes */
+#define FUXMETRICS_VERSION 1
+
+struct fuxmetrics_counters {
+  uint64_t done;
+  uint64_t load;
+  uint64_t failed;
+  int64_t inflight;
+  /* p50, p99 and p999 in microseconds */
+  uint64_t wait[3];
+  uint64_t service[3];
+  uint64_t cpu[3];
+};
+
+struct fuxmetrics_server {
+  char name[128];
+  char rqaddr[32];
+  uint16_t grpno;
+  uint16_t srvid;
+  int32_t pid;
+  char state[4];
+  struct fuxmetrics_counters c;
+};
+
+struct fuxmetrics_service {
+  char name[XATMI_SERVICE_NAME_LENGTH];
+  char state[4];
+  struct fuxmetrics_counters c;
+};
+
+/* Followed by servers and services entries */
+struct fuxmetrics_header {
+  uint32_t version;
+  uint32_t servers;
+  uint32_t services;
+  /* Sequence number of MIB changes the copy is consistent with */
+  uint64_t seq;
+  /* Wall clock in microseconds */
+  uint64_t time;
+};
+
+static inline struct fuxmetrics_server *fuxmetrics_servers(
+    struct fuxmetrics_header *h) {
+  return (struct fuxmetrics_server *)(h + 1);
+}
+static inline struct fuxmetrics_service *fuxmetrics_services(
+    struct fuxmetrics_header *h) {
+  return (struct fuxmetrics_service *)(fuxmetrics_servers(h) + h->servers);
+}
+
+/* Copies counters of all servers and services of the application in
+ * TUXCONFIG into buf. Returns the size needed, the copy is done only if it
+ * fits. Returns -1 if the MIB kept changing while copying or could not be
+ * attached.
+ */
+ssize_t fuxmetrics_snapshot(void *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
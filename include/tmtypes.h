@@ -0,0 +1,51 @@
+#pragma once
+// Buffer type switch modelled after tmtype_sw_t(5) of Oracle Tuxedo
+// https://docs.oracle.com/cd/E72452_01/tuxedo/docs1222/rf5/rf5.html
+
+#define TMTYPELEN 8
+#define TMSTYPELEN 16
+
+/* encdec operations */
+#define TMENCODE 1
+#define TMDECODE 2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct tmtype_sw_t {
+  char type[TMTYPELEN];     /* type of buffer */
+  char subtype[TMSTYPELEN]; /* sub-type of buffer, "*" for any */
+  long dfltsize;            /* default size of buffer */
+
+  /* All hooks are optional, NULL means "nothing to do" */
+
+  /* return 1 on success, -1 on failure */
+  int (*initbuf)(char *ptr, long mdlen);
+  int (*reinitbuf)(char *ptr, long mdlen);
+  int (*uninitbuf)(char *ptr, long mdlen);
+
+  /* number of bytes to send (-1 on failure), default is dlen or mdlen */
+  long (*presend)(char *ptr, long dlen, long mdlen);
+  /* called after the buffer has been sent */
+  void (*postsend)(char *ptr, long dlen, long mdlen);
+  /* called after the buffer has been received, returns length or -1 */
+  long (*postrecv)(char *ptr, long dlen, long mdlen);
+
+  /* TMENCODE: encode olen bytes of obj into encobj of elen bytes.
+   * TMDECODE: decode elen bytes of encobj into obj of olen bytes.
+   * Returns the number of bytes needed for the output, output is written
+   * only if it fits. Returns -1 on failure. Without encdec the memory
+   * image of the buffer is sent as is.
+   */
+  long (*encdec)(int op, char *encobj, long elen, char *obj, long olen);
+};
+
+/* Makes an application buffer type available to tpalloc() and the IPC layer
+ * of this process. Both sender and receiver must register the type.
+ */
+int tpregistertype(struct tmtype_sw_t *typesw);
+
+#ifdef __cplusplus
+}
+#endif
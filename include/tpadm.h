@@ -28,9 +28,11 @@ int tpadmcall(FBFR32 *inbuf, FBFR32 **outbuf, long flags);
 // TAOK the operation was successfully performed. No updates were made to the
 // application. TAUPDATED an update was successfully made to the application.
 // TAPARTIAL a partial update was successfully made to the application.
+// TAEINVAL an attribute value is invalid.
 #define TAOK 0
 #define TAUPDATED 1
 #define TAPARTIAL 2
+#define TAEINVAL -3
 #define TA_SRVGRP ((FLDID32)83886191)    // TA_SRVGRP	111	string	     -
 #define TA_GRPNO ((FLDID32)16777328)     // TA_GRPNO	112	long	       -
 #define TA_LMID ((FLDID32)83886193)      // TA_LMID	113	string	     -
@@ -149,3 +151,24 @@ int tpadmcall(FBFR32 *inbuf, FBFR32 **outbuf, long flags);
   ((FLDID32)16777414)                  // TA_NUMDISPATCHTHREADS	198	long
 #define TA_XAFUNC ((FLDID32)16777416)  // TA_XAFUNC	200	long
 #define TA_XARET ((FLDID32)16777417)   // TA_XARET	201	long
+#define TA_BUFSUBTYPE ((FLDID32)83886282)  // TA_BUFSUBTYPE	202	string
+#define TA_CURBUFFERS ((FLDID32)16777419)  // TA_CURBUFFERS	203	long
+#define TA_HWBUFFERS ((FLDID32)16777420)   // TA_HWBUFFERS	204	long
+#define TA_RQSHARDS ((FLDID32)16777421)    // TA_RQSHARDS	205	long
+#define TA_NSTOLEN ((FLDID32)16777422)     // TA_NSTOLEN	206	long
+#define TA_PID ((FLDID32)16777423)         // TA_PID	207	long
+#define TA_TMTRACE ((FLDID32)83886288)     // TA_TMTRACE	208	string
+#define TA_TOTREQC ((FLDID32)16777425)     // TA_TOTREQC	209	long
+#define TA_TOTWORKL ((FLDID32)16777426)    // TA_TOTWORKL	210	long
+#define TA_NFAILED ((FLDID32)16777427)     // TA_NFAILED	211	long
+#define TA_CURREQ ((FLDID32)16777428)      // TA_CURREQ	212	long
+#define TA_WAITP50 ((FLDID32)16777429)     // TA_WAITP50	213	long
+#define TA_WAITP99 ((FLDID32)16777430)     // TA_WAITP99	214	long
+#define TA_WAITP999 ((FLDID32)16777431)    // TA_WAITP999	215	long
+#define TA_SVCP50 ((FLDID32)16777432)      // TA_SVCP50	216	long
+#define TA_SVCP99 ((FLDID32)16777433)      // TA_SVCP99	217	long
+#define TA_SVCP999 ((FLDID32)16777434)     // TA_SVCP999	218	long
+#define TA_CPUP50 ((FLDID32)16777435)      // TA_CPUP50	219	long
+#define TA_CPUP99 ((FLDID32)16777436)      // TA_CPUP99	220	long
+#define TA_CPUP999 ((FLDID32)16777437)     // TA_CPUP999	221	long
+#define TA_RESET ((FLDID32)16777438)       // TA_RESET	222	long
@@ -6,6 +6,10 @@ extern "C" {
 
 extern char *proc_name;
 int userlog(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+/* Writes the message before returning, for messages that must not be lost
+ * when the process crashes. userlog() is buffered unless ULOGSYNC=y.
+ */
+int userlog_sync(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,32 @@
+#include <assert.h>
+#include <atmi.h>
+#include <fuxmetrics.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Keeps the single SLOW server busy for several seconds
+int main(int argc, char *argv[]) {
+  char *buf = tpalloc("STRING", NULL, 10);
+  assert(buf != NULL);
+  for (int i = 0; i < 60; i++) {
+    assert(tpacall("SLOW", buf, 0, TPNOREPLY) != -1);
+  }
+  tpfree(buf);
+
+  ssize_t size = fuxmetrics_snapshot(NULL, 0);
+  assert(size > (ssize_t)sizeof(struct fuxmetrics_header));
+  struct fuxmetrics_header *h = malloc(size);
+  assert(fuxmetrics_snapshot(h, size) == size);
+  assert(h->version == FUXMETRICS_VERSION);
+  int found = 0;
+  for (uint32_t i = 0; i < h->services; i++) {
+    if (strcmp(fuxmetrics_services(h)[i].name, "SLOW") == 0) {
+      found = 1;
+    }
+  }
+  assert(found);
+  free(h);
+
+  tpterm();
+  return 0;
+}
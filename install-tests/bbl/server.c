@@ -1,4 +1,5 @@
 #include <atmi.h>
+#include <unistd.h>
 #include <userlog.h>
 
 int tpsvrinit(int argc, char **argv) {
@@ -15,3 +16,11 @@ void SERVICE(TPSVCINFO *svcinfo) {
   userlog(":TEST: %s called", __func__);
   tpreturn(TPSUCCESS, 0, svcinfo->data, 0, 0);
 }
+void SLOW(TPSVCINFO *svcinfo) {
+  usleep(100000);
+  tpreturn(TPSUCCESS, 0, svcinfo->data, 0, 0);
+}
+void STALL(TPSVCINFO *svcinfo) {
+  usleep(1100000);
+  tpreturn(TPSUCCESS, 0, svcinfo->data, 0, 0);
+}
@@ -0,0 +1,78 @@
+#include <assert.h>
+#include <atmi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CALLS 20000
+#define CLIENTS 4
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void calls(char *svc, int n, long size, long flags) {
+  char *buf = tpallocx("STRING", NULL, size, flags);
+  assert(buf != NULL);
+  memset(buf, 'x', size - 1);
+  buf[size - 1] = '\0';
+
+  long len;
+  for (int i = 0; i < n; i++) {
+    if (tpcall(svc, buf, 0, &buf, &len, 0) == -1) {
+      fprintf(stderr, "%s: %s\n", svc, tpstrerror(tperrno));
+      exit(1);
+    }
+    assert(strlen(buf) == size - 1);
+  }
+  tpfree(buf);
+}
+
+// tpcall latency from one client and throughput of several clients
+static void bench(char *svc, long size, long flags) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    calls(svc, 100, size, flags);
+    double start = now();
+    calls(svc, CALLS, size, flags);
+    double elapsed = now() - start;
+    printf("%s %ld bytes%s: latency %.1f us\n", svc, size,
+           flags ? " shared" : "", elapsed / CALLS * 1e6);
+    tpterm();
+    exit(0);
+  }
+  assert(waitpid(pid, NULL, 0) == pid);
+
+  fflush(stdout);
+  double start = now();
+  for (int i = 0; i < CLIENTS; i++) {
+    if (fork() == 0) {
+      calls(svc, CALLS, size, flags);
+      tpterm();
+      exit(0);
+    }
+  }
+  for (int i = 0; i < CLIENTS; i++) {
+    int status;
+    assert(wait(&status) != -1);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  double elapsed = now() - start;
+  printf("%s %ld bytes%s: %d clients %.0f calls/s\n", svc, size,
+         flags ? " shared" : "", CLIENTS, CLIENTS * CALLS / elapsed);
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    bench(argv[i], 100, 0);
+    bench(argv[i], 64 * 1024, 0);
+    bench(argv[i], 64 * 1024, TPSHAREDMEM);
+  }
+  return 0;
+}
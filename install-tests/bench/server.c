@@ -0,0 +1,3 @@
+#include <atmi.h>
+
+void ECHO(TPSVCINFO *svcinfo) { tpreturn(TPSUCCESS, 0, svcinfo->data, 0, 0); }
@@ -21,6 +21,7 @@ int main(int argc, char *argv[]) {
   assert(tpurcode == 1);
 
   assert(strcmp(rcvbuf, "HELLO") == 0);
+  assert(rcvlen == 6);
 
   memset(rcvbuf, 0, rcvlen);
 
@@ -31,6 +32,15 @@ int main(int argc, char *argv[]) {
 
   assert(strcmp(rcvbuf, "HELLO") == 0);
 
+  char *carray = tpalloc("CARRAY", NULL, 100);
+  assert(carray != NULL);
+  memset(carray, 'x', 100);
+  ret = tpcall("SERVICE_LEN", carray, 100, &carray, &rcvlen, 0);
+  assert(ret != -1);
+  assert(tpurcode == 100);
+  assert(rcvlen == 100);
+  tpfree(carray);
+
   tpfree(sndbuf);
   tpfree(rcvbuf);
   return 0;
@@ -6,6 +6,10 @@ void SERVICE_TPSUCCESS(TPSVCINFO *svcinfo) {
   tpreturn(TPSUCCESS, 1, svcinfo->data, 0, 0);
 }
 
+void SERVICE_LEN(TPSVCINFO *svcinfo) {
+  tpreturn(TPSUCCESS, svcinfo->len, svcinfo->data, svcinfo->len, 0);
+}
+
 void SERVICE_TPFAIL(TPSVCINFO *svcinfo) {
   userlog(":TEST: %s called", __func__);
   tpreturn(TPFAIL, 2, svcinfo->data, 0, 0);
@@ -3,9 +3,16 @@
 
 #include <xa.h>
 #include <algorithm>
+#include <map>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "fux.h"
+#include "metrics.h"
 #include "mib.h"
+#include "trace.h"
 
 #include <atmi.h>
 #include <stdio.h>
@@ -53,9 +60,12 @@ static void handle_blocktime() {
     if (acc.rpid_timeout < now) {
       fux::ipc::msg req;
       req->cat = fux::ipc::unblock;
-      userlog("Sending unblock message to client=%d queue=%0x", int(i),
-              acc.rpid);
+      FUXTRACE(ipc, "Sending unblock message to client=%d queue=%0x", int(i),
+               acc.rpid);
       fux::ipc::qsend(acc.rpid, req, 0, fux::ipc::flags::notime);
+      if (acc.mailbox != -1) {
+        fux::ipc::mbnotify(acc.mailbox);
+      }
     }
   }
 }
@@ -64,6 +74,10 @@ static void monitor_servers() {
   mib &m = getmib();
   auto servers = m.servers();
 
+  // Servers started by scale_servers()
+  while (waitpid(-1, nullptr, WNOHANG) > 0) {
+  }
+
   for (int i = servers->len - 1; i >= 0; i--) {
     auto &server = servers[i];
     if (server.pid == 0) {
@@ -90,17 +104,118 @@ static void monitor_clients() {
         fux::ipc::qdelete(accesser.rpid);
         accesser.rpid = 0;
       }
+      if (accesser.mailbox != -1) {
+        fux::ipc::mbdelete(accesser.mailbox);
+        accesser.mailbox = -1;
+      }
+    }
+  }
+}
+
+int tpacall_queue(int msqid, const char *svc, char *data, long len, long flags);
+
+static void stop_server(mib &m, server &srv) {
+  srv.suspend();
+  fux::fml32buf buf;
+  buf.put(TA_SRVID, 0, srv.srvid);
+  buf.put(TA_GRPNO, 0, srv.grpno);
+  if (tpacall_queue(m.queues().at(srv.rqaddr).msqid, ".stop",
+                    reinterpret_cast<char *>(*buf.ptrptr()), 0,
+                    TPNOTRAN | TPNOREPLY) == -1) {
+    userlog("Failed to stop %s -g %d -i %d: %s", srv.servername, srv.grpno,
+            srv.srvid, tpstrerror(tperrno));
+  }
+}
+
+// Servers of a queue that tmboot did not start (MAX above MIN) are started
+// when more requests than running servers wait for scale_up seconds in a row.
+// Such servers are stopped again after the queue has been empty for
+// scale_down seconds.
+static constexpr int scale_up = 3;
+static constexpr int scale_down = 30;
+
+struct queue_load {
+  int backlog = 0;
+  int idle = 0;
+};
+
+static void scale_servers() {
+  static std::map<size_t, queue_load> loads;
+  mib &m = getmib();
+  auto servers = m.servers();
+  auto queues = m.queues();
+
+  for (size_t q = 0; q < queues->len; q++) {
+    auto &queue = queues[q];
+    std::vector<server *> running, spare;
+    bool busy = false;
+    for (size_t i = 0; i < servers->len; i++) {
+      auto &srv = servers[i];
+      if (srv.rqaddr != q) {
+        continue;
+      }
+      // Starting, stopping or shutting down
+      if (srv.state == state_t::SUSpended ||
+          (srv.pid != 0 && srv.state != state_t::ACTive)) {
+        busy = true;
+      }
+      if (srv.pid != 0) {
+        running.push_back(&srv);
+      } else if (!srv.autostart) {
+        spare.push_back(&srv);
+      }
+    }
+    if (queue.msqid == -1 || running.empty() || busy) {
+      loads.erase(q);
+      continue;
+    }
+
+    auto &load = loads[q];
+    auto queued = fux::ipc::qdepth(queue.msqid);
+    load.backlog = queued > running.size() ? load.backlog + 1 : 0;
+    load.idle = queued == 0 ? load.idle + 1 : 0;
+
+    if (load.backlog >= scale_up && !spare.empty()) {
+      auto &srv = *spare.front();
+      userlog("Starting %s -g %d -i %d, %zu requests queued on %s for %zu "
+              "servers",
+              srv.servername, srv.grpno, srv.srvid, queued, queue.rqaddr,
+              running.size());
+      if (start_server(m, srv) == -1) {
+        userlog("Failed to start %s -g %d -i %d: %s", srv.servername,
+                srv.grpno, srv.srvid, strerror(errno));
+      }
+      load.backlog = 0;
+    }
+
+    if (load.idle >= scale_down) {
+      auto extra = std::find_if(running.rbegin(), running.rend(),
+                                [](server *srv) { return !srv->autostart; });
+      if (extra != running.rend()) {
+        auto &srv = **extra;
+        userlog("Stopping %s -g %d -i %d, %s has been idle for %d seconds",
+                srv.servername, srv.grpno, srv.srvid, queue.rqaddr,
+                load.idle);
+        stop_server(m, srv);
+      }
+      load.idle = 0;
     }
   }
 }
 
 static void run_watchdog() {
+  auto metrics = fux::util::getenv("FUXMETRICS", "");
   while (true) {
     std::this_thread::sleep_for(std::chrono::seconds(1));
 
     handle_blocktime();
     monitor_servers();
     monitor_clients();
+    scale_servers();
+    fux::ipc::blobreclaim();
+    if (!metrics.empty()) {
+      fux::metrics::dump(getmib(), metrics);
+    }
   }
 }
 
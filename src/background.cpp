@@ -0,0 +1,42 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include "background.h"
+
+#include <signal.h>
+
+namespace fux {
+
+void background_thread::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+  cv_.notify_all();
+  if (started_) {
+    pthread_join(thread_, nullptr);
+    started_ = false;
+  }
+}
+
+bool background_thread::start() {
+  if (started_ || stopped_) {
+    return started_;
+  }
+  // Signals are for the threads of the application
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  started_ = pthread_create(&thread_, nullptr, &main, this) == 0;
+  pthread_sigmask(SIG_SETMASK, &old, nullptr);
+  return started_;
+}
+
+void *background_thread::main(void *self) {
+  auto &t = *static_cast<background_thread *>(self);
+  std::unique_lock<std::mutex> lock(t.mutex_);
+  t.run(lock);
+  return nullptr;
+}
+
+}  // namespace fux
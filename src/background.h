@@ -0,0 +1,78 @@
+#pragma once
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+
+namespace fux {
+
+// Thread that writes what other threads of the process produce. It is
+// started by the first piece of work and stopped at exit. A forked child does
+// not inherit the thread, it starts its own one when needed.
+class background_thread {
+ public:
+  background_thread() : started_(false), stopped_(false) {}
+  virtual ~background_thread() = default;
+
+  // Lets the thread finish its work and waits for it
+  virtual void stop();
+
+  // Work of the parent stays with the parent
+  void before_fork() {
+    mutex_.lock();
+    prepare_fork();
+  }
+  void after_fork_parent() { mutex_.unlock(); }
+  void after_fork_child() {
+    new (&mutex_) std::mutex();
+    new (&cv_) std::condition_variable();
+    started_ = false;
+    forked();
+  }
+
+ protected:
+  // Starts the thread unless stopped, mutex_ must be held. Returns false if it
+  // could not be started.
+  bool start();
+
+  // Body of the thread, called with lock of mutex_ held. Returns when
+  // stopped_ is set.
+  virtual void run(std::unique_lock<std::mutex> &lock) = 0;
+  // Called with mutex_ held before fork()
+  virtual void prepare_fork() {}
+  // Called in the child after fork(), other threads are gone
+  virtual void forked() {}
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::atomic<bool> started_;
+  bool stopped_;
+
+ private:
+  static void *main(void *self);
+
+  pthread_t thread_;
+};
+
+// Never destroyed, it may be used from static destructors. Fork handlers and
+// stopping at exit are set up together with it.
+template <typename T>
+T &background_instance() {
+  static T *instance = [] {
+    auto p = new T();
+    pthread_atfork([] { background_instance<T>().before_fork(); },
+                   [] { background_instance<T>().after_fork_parent(); },
+                   [] { background_instance<T>().after_fork_child(); });
+    atexit([] { background_instance<T>().stop(); });
+    return p;
+  }();
+  return *instance;
+}
+
+}  // namespace fux
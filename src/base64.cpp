@@ -5,6 +5,231 @@
 #include <string.h>
 #include <stdexcept>
 
+#include "misc.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define BASE64_SIMD 1
+#endif
+
+// Vectorized kernels handle the bulk of input and return the number of input
+// bytes consumed, scalar code finishes the rest and handles padding. Kernels
+// never consume the last block of base64 input.
+typedef size_t (*base64encoder)(const uint8_t *ibuf, size_t ilen, char *obuf);
+typedef size_t (*base64decoder)(const uint8_t *ibuf, size_t ilen,
+                                uint8_t *obuf, size_t olen);
+
+static size_t encode_none(const uint8_t *, size_t, char *) { return 0; }
+static size_t decode_none(const uint8_t *, size_t, uint8_t *, size_t) {
+  return 0;
+}
+
+#if defined(BASE64_SIMD)
+// Vectorized base64 by Wojciech Muła and Daniel Lemire
+// http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html
+// http://0x80.pl/notesen/2016-01-17-sse-base64-decoding.html
+
+__attribute__((target("sse4.1"))) static inline __m128i encode_sse41(
+    __m128i in) {
+  // 12 input bytes into 16 6-bit indices
+  in = _mm_shuffle_epi8(
+      in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  auto t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  auto t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  auto t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  auto t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  auto indices = _mm_or_si128(t1, t3);
+
+  // Offset from index to ASCII character
+  auto result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  auto less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+  result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+  const auto offsets =
+      _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                    '/' - 63, 'A', 0, 0);
+  return _mm_add_epi8(_mm_shuffle_epi8(offsets, result), indices);
+}
+
+__attribute__((target("sse4.1"))) static size_t encode_sse41(
+    const uint8_t *ibuf, size_t ilen, char *obuf) {
+  size_t ipos = 0;
+  // 16 bytes are loaded, 12 used
+  for (; ipos + 16 <= ilen; ipos += 12, obuf += 16) {
+    auto in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ibuf + ipos));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(obuf), encode_sse41(in));
+  }
+  return ipos;
+}
+
+__attribute__((target("avx2"))) static size_t encode_avx2(const uint8_t *ibuf,
+                                                          size_t ilen,
+                                                          char *obuf) {
+  size_t ipos = 0;
+  for (; ipos + 28 <= ilen; ipos += 24, obuf += 32) {
+    auto lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ibuf + ipos));
+    auto hi =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(ibuf + ipos + 12));
+    auto in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+    in = _mm256_shuffle_epi8(
+        in, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                            10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    auto t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    auto t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    auto t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    auto t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    auto indices = _mm256_or_si256(t1, t3);
+
+    auto result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+    auto less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+    result =
+        _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+    const auto offsets = _mm256_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    result = _mm256_add_epi8(_mm256_shuffle_epi8(offsets, result), indices);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(obuf), result);
+  }
+  return ipos;
+}
+
+// Returns false if input contains characters outside of base64 alphabet
+__attribute__((target("sse4.1"))) static inline bool decode_sse41(__m128i in,
+                                                                  __m128i *out) {
+  auto hi = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+  auto lo = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+
+  const auto shifts =
+      _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const auto masks = _mm_setr_epi8(
+      char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+      char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf0), 0x54, 0x50,
+      0x50, 0x50, 0x54);
+  const auto bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, char(128), 0, 0, 0,
+                                  0, 0, 0, 0, 0);
+
+  auto valid = _mm_and_si128(_mm_shuffle_epi8(masks, lo),
+                             _mm_shuffle_epi8(bits, hi));
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(valid, _mm_setzero_si128())) != 0) {
+    return false;
+  }
+  auto shift = _mm_blendv_epi8(_mm_shuffle_epi8(shifts, hi), _mm_set1_epi8(16),
+                               _mm_cmpeq_epi8(in, _mm_set1_epi8('/')));
+  auto values = _mm_add_epi8(in, shift);
+
+  // 16 6-bit values into 12 bytes
+  auto merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+  merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+  *out = _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14,
+                                                13, 12, -1, -1, -1, -1));
+  return true;
+}
+
+__attribute__((target("sse4.1"))) static size_t decode_sse41(
+    const uint8_t *ibuf, size_t ilen, uint8_t *obuf, size_t olen) {
+  size_t ipos = 0, opos = 0;
+  // 16 bytes are stored, 12 used
+  for (; ipos + 16 < ilen && opos + 16 <= olen; ipos += 16, opos += 12) {
+    __m128i out;
+    if (!decode_sse41(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(ibuf + ipos)),
+            &out)) {
+      break;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(obuf + opos), out);
+  }
+  return ipos;
+}
+
+__attribute__((target("avx2"))) static size_t decode_avx2(const uint8_t *ibuf,
+                                                          size_t ilen,
+                                                          uint8_t *obuf,
+                                                          size_t olen) {
+  size_t ipos = 0, opos = 0;
+  // 32 bytes are stored, 24 used
+  for (; ipos + 32 < ilen && opos + 32 <= olen; ipos += 32, opos += 24) {
+    auto in = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ibuf + ipos));
+    auto hi = _mm256_and_si256(_mm256_srli_epi32(in, 4), _mm256_set1_epi8(0x0f));
+    auto lo = _mm256_and_si256(in, _mm256_set1_epi8(0x0f));
+
+    const auto shifts = _mm256_setr_epi8(
+        0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 19, 4,
+        -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const auto masks = _mm256_setr_epi8(
+        char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+        char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf0), 0x54, 0x50,
+        0x50, 0x50, 0x54, char(0xa8), char(0xf8), char(0xf8), char(0xf8),
+        char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+        char(0xf0), 0x54, 0x50, 0x50, 0x50, 0x54);
+    const auto bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, char(128), 0, 0,
+                                       0, 0, 0, 0, 0, 0, 1, 2, 4, 8, 16, 32, 64,
+                                       char(128), 0, 0, 0, 0, 0, 0, 0, 0);
+
+    auto valid = _mm256_and_si256(_mm256_shuffle_epi8(masks, lo),
+                                  _mm256_shuffle_epi8(bits, hi));
+    if (_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(valid, _mm256_setzero_si256())) != 0) {
+      break;
+    }
+    auto shift = _mm256_blendv_epi8(
+        _mm256_shuffle_epi8(shifts, hi), _mm256_set1_epi8(16),
+        _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/')));
+    auto values = _mm256_add_epi8(in, shift);
+
+    auto merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+    merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+    merged = _mm256_shuffle_epi8(
+        merged, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1,
+                                 -1, -1, 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13,
+                                 12, -1, -1, -1, -1));
+    // 12 bytes from each lane next to each other
+    merged = _mm256_permutevar8x32_epi32(
+        merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(obuf + opos), merged);
+  }
+  return ipos;
+}
+#endif
+
+static base64encoder encode_bulk = encode_none;
+static base64decoder decode_bulk = decode_none;
+
+bool base64use(base64isa isa) {
+  switch (isa) {
+    case base64isa::scalar:
+      encode_bulk = encode_none;
+      decode_bulk = decode_none;
+      return true;
+#if defined(BASE64_SIMD)
+    case base64isa::sse41:
+      if (__builtin_cpu_supports("sse4.1")) {
+        encode_bulk = encode_sse41;
+        decode_bulk = decode_sse41;
+        return true;
+      }
+      break;
+    case base64isa::avx2:
+      if (__builtin_cpu_supports("avx2")) {
+        encode_bulk = encode_avx2;
+        decode_bulk = decode_avx2;
+        return true;
+      }
+      break;
+#endif
+    default:
+      break;
+  }
+  return false;
+}
+
+// Best implementation supported by CPU
+static bool base64dispatch =
+    base64use(base64isa::avx2) || base64use(base64isa::sse41) ||
+    base64use(base64isa::scalar);
+
 size_t base64encode(const void *ibuf, size_t ilen, char *obuf, size_t olen) {
   static const char encoding[] =
       "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
@@ -17,9 +242,10 @@ size_t base64encode(const void *ibuf, size_t ilen, char *obuf, size_t olen) {
   }
 
   auto *bytes = reinterpret_cast<const uint8_t *>(ibuf);
-  size_t ipos = 0, opos = 0;
+  size_t ipos = encode_bulk(bytes, ilen, obuf);
+  size_t opos = ipos / 3 * 4;
 
-  for (size_t i = 0; i < blocks; i++) {
+  for (size_t i = ipos / 3; i < blocks; i++) {
     auto n = ((uint32_t)bytes[ipos++]) << 16;
     n += ((uint32_t)bytes[ipos++]) << 8;
     n += bytes[ipos++];
@@ -81,11 +307,12 @@ size_t base64decode(const char *ibuf, size_t ilen, void *obuf, size_t olen) {
 
   const auto *ibytes = reinterpret_cast<const uint8_t *>(ibuf);
   auto *obytes = reinterpret_cast<uint8_t *>(obuf);
-  size_t ipos = 0, opos = 0;
+  size_t ipos = decode_bulk(ibytes, ilen, obytes, olen);
+  size_t opos = ipos / 4 * 3;
   uint8_t c0, c1, c2, c3, err = 0;
 
   // All blocks except the last one
-  for (size_t i = 1; i < blocks; i++) {
+  for (size_t i = ipos / 4 + 1; i < blocks; i++) {
     err |= c0 = decoding[ibytes[ipos++]];
     err |= c1 = decoding[ibytes[ipos++]];
     err |= c2 = decoding[ibytes[ipos++]];
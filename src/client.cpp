@@ -13,9 +13,12 @@
 #include <memory>
 #include <vector>
 
+#include "flight.h"
 #include "ipc.h"
 #include "mib.h"
 #include "misc.h"
+#include "probes.h"
+#include "trace.h"
 #include "trx.h"
 
 #include "resp.h"
@@ -50,23 +53,34 @@ class client {
     auto lock = mibcon_.data_lock();
     client_ = mibcon_.make_accesser(getpid());
     rpid = mibcon_.accessers().at(client_).rpid = fux::ipc::qcreate();
+    mailbox = mibcon_.accessers().at(client_).mailbox = fux::ipc::mbcreate();
   }
 
   ~client() {
     auto lock = mibcon_.data_lock();
     fux::ipc::qdelete(mibcon_.accessers().at(client_).rpid);
+    fux::ipc::mbdelete(mibcon_.accessers().at(client_).mailbox);
     mibcon_.accessers().at(client_).invalidate();
   }
 
   int tpacall_group(int grpno, const char *svc, char *data, long len,
                     long flags) try {
-    int msqid = repo_.get_queue(grpno, svc);
-    return tpacall_queue(msqid, svc, data, len, flags);
+    if (data != nullptr) {
+      if (tptypes(data, nullptr, nullptr) == -1) {
+        return -1;
+      }
+    }
+    fux::trace::poll(mibcon_);
+    rq.set_data(data, len);
+    int msqid = repo_.get_queue(grpno, svc, rq);
+    rq->cat = fux::ipc::application;
+    return send(svc, msqid, flags);
   } catch (const std::out_of_range &e) {
     TPERROR(TPENOENT, "Service %s does not exist", svc);
     return -1;
   }
 
+  // Admin requests like .stop go to a queue and not to a service
   int tpacall_queue(int msqid, const char *svc, char *data, long len,
                     long flags) {
     if (data != nullptr) {
@@ -74,42 +88,11 @@ class client {
         return -1;
       }
     }
-
     rq.set_data(data, len);
-    checked_copy(svc, rq->servicename);
-    if (flags & TPNOREPLY) {
-      rq->replyq = -1;
-      rq->cd = 0;
-    } else {
-      rq->replyq = rpid;
-      rq->cd = cds.allocate();
-      if (rq->cd == -1) {
-        return -1;
-      }
-    }
-    if (!(flags & TPNOTRAN) && fux::tx::transactional()) {
-      rq->flags |= TPTRAN;
-      rq->gttid = fux::tx::gttid();
-    } else {
-      rq->flags = 0;
-      rq->gttid = fux::bad_gttid;
-    }
-
-    if (fux::ipc::qsend(msqid, rq, next_blocktime(), to_flags(flags))) {
-      fux::atmi::reset_tperrno();
-      return rq->cd;
-    }
-
-    if (flags & TPNOBLOCK) {
-      TPERROR(TPEBLOCK, "Request queue is full");
-    } else {
-      TPERROR(TPETIME, "Failed to send within timeout");
-    }
-
-    if (rq->cd != 0) {
-      cds.release(rq->cd);
-    }
-    return -1;
+    rq->service = fux::ipc::badservice;
+    rq->generation = 0;
+    rq->cat = fux::ipc::admin;
+    return send(svc, msqid, flags);
   }
 
   int tpgetrply(int *cd, char **data, long *len, long flags) {
@@ -145,16 +128,16 @@ class client {
         mibcon_.accessers().at(client_).rpid_timeout =
             std::chrono::steady_clock::now() +
             std::chrono::milliseconds(next_blocktime());
-        fux::ipc::qrecv(rpid, res, 0, 0);
+        recv(res);
         mibcon_.accessers().at(client_).rpid_timeout = INVALID_TIME;
-        userlog("%s received on %0x", __func__, rpid);
+        FUXTRACE(ipc, "%s received on %0x", __func__, rpid);
       }
 
       if (res->cat == fux::ipc::unblock) {
         if (flags & TPGETANY) {
           *cd = 0;
         } else {
-          userlog("Received time-out for cd=%d", res->cd);
+          FUXTRACE(atmi, "Received time-out for cd=%d", res->cd);
         }
         TPERROR(TPETIME, "Timeout message received");
         return -1;
@@ -168,12 +151,14 @@ class client {
         }
       }
 
-      res.get_data(data);
+      auto datalen = res.get_data(data);
       tpurcode = res->rcode;
       *cd = res->cd;
       cds.release(*cd);
+      FUXFLIGHT(reply, nullptr, *cd, res->rval, res->corrid);
+      FUXPROBE(tpgetrply, *cd, res.size(), res->rval);
       if (len != nullptr) {
-        *len = res.size_data();
+        *len = datalen;
       }
       if (res->rval == TPMINVAL) {
         fux::atmi::reset_tperrno();
@@ -263,9 +248,67 @@ class client {
     return blocktime;
   }
 
-  int get_queue(const char *svc) { return repo_.get_queue(-1, svc); }
+  int get_queue(const char *svc, fux::ipc::msg &req) {
+    return repo_.get_queue(-1, svc, req);
+  }
 
  private:
+  // Sends rq after the caller has set its data and address
+  int send(const char *svc, int msqid, long flags) {
+    if (flags & TPNOREPLY) {
+      rq->replyq = -1;
+      rq->replybox = -1;
+      rq->cd = 0;
+    } else {
+      rq->replyq = rpid;
+      rq->replybox = mailbox;
+      rq->cd = cds.allocate();
+      if (rq->cd == -1) {
+        return -1;
+      }
+    }
+    if (!(flags & TPNOTRAN) && fux::tx::transactional()) {
+      rq->flags |= TPTRAN;
+      rq->gttid = fux::tx::gttid();
+    } else {
+      rq->flags = 0;
+      rq->gttid = fux::bad_gttid;
+    }
+
+    // Nested calls of a service continue its request
+    rq->corrid = fux::flight::corrid != 0 ? fux::flight::corrid
+                                          : fux::flight::next_corrid();
+    FUXFLIGHT(enqueue, svc, rq->cd, rq.size_data(), rq->corrid);
+    FUXPROBE(tpacall, svc, rq->cd, rq.size(), rq->gttid);
+    rq->enqueued = fux::ipc::now_us();
+    if (fux::ipc::qsend(msqid, rq, next_blocktime(), to_flags(flags))) {
+      fux::atmi::reset_tperrno();
+      return rq->cd;
+    }
+
+    if (flags & TPNOBLOCK) {
+      TPERROR(TPEBLOCK, "Request queue is full");
+    } else {
+      TPERROR(TPETIME, "Failed to send within timeout");
+    }
+
+    if (rq->cd != 0) {
+      cds.release(rq->cd);
+    }
+    return -1;
+  }
+
+  // Next reply from mailbox or from reply queue when the mailbox says so
+  void recv(fux::ipc::msg &res) {
+    while (queued_taken == queued_seen) {
+      if (fux::ipc::mbrecv(mailbox, res, queued_seen)) {
+        return;
+      }
+    }
+    fux::ipc::qrecv(rpid, res, 0, 0);
+    queued_taken++;
+  }
+
   fux::ipc::flags to_flags(long flags) {
     if (flags & TPNOTIME) {
       return fux::ipc::flags::notime;
@@ -281,6 +324,9 @@ class client {
   service_repository repo_;
   fux::ipc::msg rq;
   int rpid;
+  int mailbox;
+  uint32_t queued_seen = 0;
+  uint32_t queued_taken = 0;
   long blocktime_next;
   long blocktime_all;
   responses cds;
@@ -386,4 +432,6 @@ int tpgblktime(long flags) {
       [&] { return getclient().tpgblktime(flags); }, -1);
 }
 
-int get_queue(const char *svc) { return getclient().get_queue(svc); }
+int get_queue(const char *svc, fux::ipc::msg &req) {
+  return getclient().get_queue(svc, req);
+}
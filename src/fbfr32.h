@@ -913,14 +913,20 @@ struct Fbfr32 {
 
 // Hooks for buffer type below
 
-void fml32init(void *mem, size_t size) {
-  reinterpret_cast<Fbfr32 *>(mem)->init(size);
+int fml32init(char *ptr, long mdlen) {
+  return reinterpret_cast<Fbfr32 *>(ptr)->init(mdlen) == -1 ? -1 : 1;
 }
 
-void fml32reinit(void *mem, size_t size) {
-  reinterpret_cast<Fbfr32 *>(mem)->reinit(size);
+int fml32reinit(char *ptr, long mdlen) {
+  reinterpret_cast<Fbfr32 *>(ptr)->reinit(mdlen);
+  return 1;
 }
 
-void fml32finit(void *mem) { reinterpret_cast<Fbfr32 *>(mem)->finit(); }
+int fml32uninit(char *ptr, long) {
+  reinterpret_cast<Fbfr32 *>(ptr)->finit();
+  return 1;
+}
 
-size_t fml32used(void *mem) { return reinterpret_cast<Fbfr32 *>(mem)->used(); }
+long fml32presend(char *ptr, long, long) {
+  return reinterpret_cast<Fbfr32 *>(ptr)->used();
+}
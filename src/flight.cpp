@@ -0,0 +1,283 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include "flight.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <userlog.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+
+#include "ipc.h"
+#include "misc.h"
+
+// FIXME: Linux only
+extern const char *__progname;
+
+namespace fux::flight {
+
+constexpr uint32_t magic = 0x46555846;  // "FUXF"
+constexpr char prefix[] = "fuxflight.";
+
+static pid_t pid = 0;
+static std::atomic<uint32_t> counter(0);
+
+std::string ring_name(pid_t pid) {
+  return std::string("/") + prefix + std::to_string(pid);
+}
+
+static size_t ring_size(uint32_t events) {
+  return sizeof(ring) + events * sizeof(event);
+}
+
+static ring *create(unsigned long events) {
+  if (events == 0) {
+    return nullptr;
+  }
+  // Power of two to find the slot with a mask
+  uint32_t size = 1;
+  while (size < events && size < (1u << 24)) {
+    size <<= 1;
+  }
+
+  auto name = ring_name(pid);
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    userlog("Failed to create flight recorder %s: %s", name.c_str(),
+            strerror(errno));
+    return nullptr;
+  }
+  void *p = MAP_FAILED;
+  if (ftruncate(fd, ring_size(size)) == 0) {
+    p = mmap(nullptr, ring_size(size), PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+             0);
+  }
+  close(fd);
+  if (p == MAP_FAILED) {
+    userlog("Failed to map flight recorder %s: %s", name.c_str(),
+            strerror(errno));
+    shm_unlink(name.c_str());
+    return nullptr;
+  }
+
+  // Fresh pages are zeroed, seq of 0 means an empty slot
+  auto r = static_cast<ring *>(p);
+  r->size = size;
+  r->pid = pid;
+  strncpy(r->progname, __progname, sizeof(r->progname) - 1);
+  r->next = 0;
+  std::atomic_thread_fence(std::memory_order_release);
+  r->magic = magic;
+  return r;
+}
+
+// Nothing is set up before the first use, other static initializers may
+// record events or take correlation ids
+static ring placeholder;
+std::atomic<ring *> current(&placeholder);
+thread_local uint64_t corrid = 0;
+
+static std::mutex setup_mutex;
+// Ring of the parent mapped in a forked child until the child creates its own
+static ring *inherited = nullptr;
+
+// Child of fork() gets its own ring with its first event, the parent keeps
+// writing to the old one. Only async-signal-safe work is done in the handler.
+static void after_fork_child() {
+  new (&setup_mutex) std::mutex();
+  pid = getpid();
+  counter = 0;
+  auto r = current.load(std::memory_order_relaxed);
+  if (r != nullptr && r != &placeholder) {
+    inherited = r;
+    current.store(&placeholder, std::memory_order_relaxed);
+  }
+}
+
+// setup_mutex must be held
+static void watch_fork() {
+  if (pid == 0) {
+    pid = getpid();
+    pthread_atfork(nullptr, nullptr, after_fork_child);
+  }
+}
+
+// setup_mutex must be held
+static void drop_inherited() {
+  if (inherited != nullptr) {
+    munmap(inherited, ring_size(inherited->size));
+    inherited = nullptr;
+  }
+}
+
+// Rings are filled in before they are published, setup_mutex must be held
+static void publish(ring *r) { current.store(r, std::memory_order_release); }
+
+static ring *setup() {
+  std::lock_guard<std::mutex> lock(setup_mutex);
+  watch_fork();
+  if (current.load(std::memory_order_relaxed) == &placeholder) {
+    unsigned long events =
+        inherited != nullptr
+            ? inherited->size
+            : std::strtoul(fux::util::getenv("FUXFLIGHT", "0").c_str(),
+                           nullptr, 10);
+    drop_inherited();
+    publish(create(events));
+  }
+  return current.load(std::memory_order_relaxed);
+}
+
+void start(uint32_t events) {
+  if (setup() != nullptr) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(setup_mutex);
+  if (current.load(std::memory_order_relaxed) == nullptr) {
+    publish(create(events));
+  }
+}
+
+void stop() {
+  std::lock_guard<std::mutex> lock(setup_mutex);
+  drop_inherited();
+  auto r = current.load(std::memory_order_relaxed);
+  publish(nullptr);
+  if (r != nullptr && r != &placeholder) {
+    auto name = ring_name(r->pid);
+    munmap(r, ring_size(r->size));
+    shm_unlink(name.c_str());
+  }
+}
+
+uint64_t next_corrid() {
+  if (__builtin_expect(pid == 0, 0)) {
+    std::lock_guard<std::mutex> lock(setup_mutex);
+    watch_fork();
+  }
+  return (uint64_t(pid) << 32) |
+         (counter.fetch_add(1, std::memory_order_relaxed) + 1);
+}
+
+void record(event_type type, const char *name, int cd, int value,
+            uint64_t id) {
+  static thread_local uint32_t tid = syscall(SYS_gettid);
+  auto r = current.load(std::memory_order_acquire);
+  if (r == &placeholder) {
+    r = setup();
+  }
+  if (r == nullptr) {
+    return;
+  }
+  auto pos = r->next.fetch_add(1, std::memory_order_relaxed);
+  auto &e = r->events[pos & (r->size - 1)];
+  // Readers skip the slot while it is being overwritten
+  e.seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  e.time = fux::ipc::now_us();
+  e.corrid = id;
+  e.tid = tid;
+  e.type = type;
+  e.cd = cd;
+  e.value = value;
+  strncpy(e.name, name != nullptr ? name : "", sizeof(e.name) - 1);
+  e.name[sizeof(e.name) - 1] = '\0';
+  e.seq.store(pos + 1, std::memory_order_release);
+}
+
+std::vector<std::string> rings() {
+  std::vector<std::string> names;
+  auto dir = opendir("/dev/shm");
+  if (dir == nullptr) {
+    return names;
+  }
+  while (auto ent = readdir(dir)) {
+    if (strncmp(ent->d_name, prefix, sizeof(prefix) - 1) == 0) {
+      names.push_back(std::string("/") + ent->d_name);
+    }
+  }
+  closedir(dir);
+  return names;
+}
+
+std::vector<entry> read(const std::string &name) {
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd == -1) {
+    throw std::system_error(errno, std::system_category(), "shm_open");
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    throw std::system_error(errno, std::system_category(), "fstat");
+  }
+  if (size_t(st.st_size) < sizeof(ring)) {
+    close(fd);
+    throw std::system_error(EINVAL, std::system_category(), name);
+  }
+  void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    throw std::system_error(errno, std::system_category(), "mmap");
+  }
+
+  std::vector<entry> entries;
+  auto r = static_cast<const ring *>(p);
+  if (r->magic == magic && ring_size(r->size) <= size_t(st.st_size)) {
+    auto next = r->next.load(std::memory_order_acquire);
+    auto first = next > r->size ? next - r->size : 0;
+    for (auto pos = first; pos < next; pos++) {
+      auto &e = r->events[pos & (r->size - 1)];
+      if (e.seq.load(std::memory_order_acquire) != pos + 1) {
+        continue;
+      }
+      entry en;
+      en.time = e.time;
+      en.corrid = e.corrid;
+      en.pid = r->pid;
+      en.tid = e.tid;
+      en.type = static_cast<event_type>(e.type);
+      en.cd = e.cd;
+      en.value = e.value;
+      en.name.assign(e.name, strnlen(e.name, sizeof(e.name)));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (e.seq.load(std::memory_order_relaxed) != pos + 1) {
+        continue;
+      }
+      en.progname.assign(r->progname,
+                         strnlen(r->progname, sizeof(r->progname)));
+      entries.push_back(std::move(en));
+    }
+  }
+  munmap(p, st.st_size);
+  return entries;
+}
+
+const char *to_string(event_type type) {
+  switch (type) {
+    case enqueue:
+      return "enqueue";
+    case dequeue:
+      return "dequeue";
+    case tpreturn:
+      return "tpreturn";
+    case tpforward:
+      return "tpforward";
+    case reply:
+      return "reply";
+    case xa:
+      return "xa";
+  }
+  return "?";
+}
+
+}  // namespace fux::flight
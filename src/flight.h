@@ -0,0 +1,102 @@
+#pragma once
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Flight recorder keeps the latest request events of each process in a ring
+// of fixed-size records in POSIX shared memory. Rings survive the process and
+// tmflight merges them into a single timeline. Enabled with FUXFLIGHT=<events>.
+namespace fux::flight {
+
+enum event_type : uint16_t {
+  enqueue = 1,  // request sent, value is the message size
+  dequeue,      // request received by a server, value is the data length
+  tpreturn,     // reply sent, value is the rval
+  tpforward,    // request forwarded, value is the message size
+  reply,        // reply received by the caller, value is the rval
+  xa,           // XA call, cd is the resource manager and value the result
+};
+
+constexpr size_t name_size = 24;
+
+struct event {
+  // Position of the record in the ring + 1, stored last
+  std::atomic<uint64_t> seq;
+  // Monotonic time in microseconds
+  uint64_t time;
+  uint64_t corrid;
+  uint32_t tid;
+  uint16_t type;
+  uint16_t reserved;
+  int32_t cd;
+  int32_t value;
+  char name[name_size];
+};
+static_assert(sizeof(event) == 64, "event must fit into a cache line");
+
+struct ring {
+  uint32_t magic;
+  uint32_t size;
+  pid_t pid;
+  char progname[32];
+  alignas(64) std::atomic<uint64_t> next;
+  alignas(64) event events[0];
+};
+
+// Ring of this process or nullptr when disabled. The ring is created by the
+// first event, until then current points to a placeholder. Rings are
+// published with release, record() loads current with acquire.
+extern std::atomic<ring *> current;
+inline bool enabled() {
+  return current.load(std::memory_order_relaxed) != nullptr;
+}
+// Starts recording into a ring of at least events records unless already on
+void start(uint32_t events);
+// Stops recording and removes the ring, no thread may be recording events
+void stop();
+
+// Correlation id of the request served by this thread, 0 outside of services.
+// Requests sent by the thread carry it on.
+extern thread_local uint64_t corrid;
+// Unique within the host: process id in the upper half
+uint64_t next_corrid();
+
+void record(event_type type, const char *name, int cd, int value,
+            uint64_t id = corrid);
+
+// Copy of one event together with the process that recorded it
+struct entry {
+  uint64_t time;
+  uint64_t corrid;
+  pid_t pid;
+  uint32_t tid;
+  event_type type;
+  int cd;
+  int value;
+  std::string name;
+  std::string progname;
+};
+
+// Shared memory object name of the ring of a process
+std::string ring_name(pid_t pid);
+// Names of all rings on this host
+std::vector<std::string> rings();
+// Events of a ring from the oldest to the newest, throws std::system_error
+std::vector<entry> read(const std::string &name);
+const char *to_string(event_type type);
+
+}  // namespace fux::flight
+
+// Records nothing and evaluates no arguments until the recorder is started
+#define FUXFLIGHT(type, args...)                                         \
+  do {                                                                   \
+    if (__builtin_expect(fux::flight::enabled(), 0)) {                   \
+      fux::flight::record(fux::flight::type, ##args);                    \
+    }                                                                    \
+  } while (0)
@@ -1,22 +1,37 @@
 // This file is part of Fuxedo
 // Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
 
+#include <linux/futex.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
+#include <sys/shm.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include <atmi.h>
+#include <userlog.h>
 
 #include "ipc.h"
 #include "misc.h"
+#include "probes.h"
 
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <iostream>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 
 namespace fux::ipc {
 
@@ -123,6 +138,34 @@ namespace fux::ipc {
         std::string(__FILE__) + ":" + std::to_string(__LINE__)); \
   }
 
+static void wake_handler(int) {}
+
+// Real-time signals wake threads blocked in system calls: an empty handler
+// without SA_RESTART makes the call fail with EINTR. Signals the application
+// handles or ignores are left alone and the next free one is taken instead.
+static int claim_signal(int preferred) {
+  static std::mutex mutex;
+  std::lock_guard<std::mutex> lock(mutex);
+  for (int signo = preferred; signo <= SIGRTMAX; signo++) {
+    struct sigaction old;
+    if (sigaction(signo, nullptr, &old) == -1 ||
+        (old.sa_flags & SA_SIGINFO) || old.sa_handler != SIG_DFL) {
+      continue;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = wake_handler;
+    sigemptyset(&sa.sa_mask);
+    fail_if(sigaction(signo, &sa, nullptr) == -1);
+    if (signo != preferred) {
+      userlog("Signal SIGRTMIN+%d is in use, using SIGRTMIN+%d",
+              preferred - SIGRTMIN, signo - SIGRTMIN);
+    }
+    return signo;
+  }
+  throw std::runtime_error("No free real-time signal");
+}
+
 int qcreate() {
   int msqid = msgget(IPC_PRIVATE, 0600 | IPC_CREAT);
   if (msqid == -1) {
@@ -134,8 +177,807 @@ int qcreate() {
 
 static const size_t MAX_QUEUE_MSG_SIZE = 4000;
 
+// Multi-producer/multi-consumer queue of slot indices in shared memory
+// http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+template <uint32_t N>
+struct mpmc_index {
+  static_assert((N & (N - 1)) == 0, "N must be a power of 2");
+  struct cell {
+    std::atomic<uint64_t> seq;
+    uint32_t value;
+  };
+
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+  alignas(64) cell cells[N];
+
+  void init() {
+    head = tail = 0;
+    for (uint32_t i = 0; i < N; i++) {
+      cells[i].seq = i;
+    }
+  }
+
+  bool push(uint32_t value) {
+    auto pos = tail.load(std::memory_order_relaxed);
+    while (true) {
+      auto &c = cells[pos & (N - 1)];
+      auto seq = c.seq.load(std::memory_order_acquire);
+      auto dif = int64_t(seq) - int64_t(pos);
+      if (dif == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed)) {
+          c.value = value;
+          c.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Number of values, may be off while others push or pop
+  uint64_t size() const {
+    auto h = head.load(std::memory_order_relaxed);
+    auto t = tail.load(std::memory_order_relaxed);
+    return t > h ? t - h : 0;
+  }
+
+  bool pop(uint32_t &value) {
+    auto pos = head.load(std::memory_order_relaxed);
+    while (true) {
+      auto &c = cells[pos & (N - 1)];
+      auto seq = c.seq.load(std::memory_order_acquire);
+      auto dif = int64_t(seq) - int64_t(pos + 1);
+      if (dif == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed)) {
+          value = c.value;
+          c.seq.store(pos + N, std::memory_order_release);
+          return true;
+        }
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+};
+
+// Request queue in shared memory. Messages are copied into free slots and slot
+// indices are passed through one of the lanes. A lane per mtype keeps msgrcv
+// priorities for the first lanes-1 message types, larger types share the last
+// lane. Waiting is done on futexes and only when the queue is empty or full.
+//
+// A ring may be split into shards with their own free slots and lanes so that
+// threads of a server do not all contend on the same indices. Senders pick
+// shards round robin, a receiver takes from its own shard first and steals
+// from the others when it is empty. Priorities hold within a shard.
+struct ring {
+  static constexpr uint32_t slots = 256;
+  static constexpr size_t slot_size = 4096;
+  static constexpr int lanes = 8;
+  static constexpr uint32_t max_shards = 16;
+
+  alignas(64) std::atomic<uint32_t> posted;
+  std::atomic<uint32_t> receivers;
+  alignas(64) std::atomic<uint32_t> freed;
+  std::atomic<uint32_t> senders;
+  std::atomic<uint32_t> rotation;
+  std::atomic<bool> removed;
+  uint32_t nshards;
+
+  struct slot {
+    size_t len;
+    char data[slot_size - sizeof(size_t)];
+  } slot[slots];
+
+  struct shard {
+    mpmc_index<slots> free;
+    mpmc_index<slots> lane[lanes];
+    // Messages taken by receivers of other shards
+    alignas(64) std::atomic<uint64_t> stolen;
+  } shards[1];  // nshards
+
+  static int lane_of(long mtype) {
+    return std::min(std::max(mtype, 1L), long(lanes)) - 1;
+  }
+
+  static size_t size(uint32_t n) {
+    return sizeof(ring) + (n - 1) * sizeof(ring::shard);
+  }
+
+  void init(uint32_t n) {
+    posted = receivers = freed = senders = rotation = 0;
+    removed = false;
+    nshards = n;
+    for (uint32_t i = 0; i < nshards; i++) {
+      shards[i].free.init();
+      for (auto &l : shards[i].lane) {
+        l.init();
+      }
+      shards[i].stolen = 0;
+    }
+    for (uint32_t i = 0; i < slots; i++) {
+      shards[i % nshards].free.push(i);
+    }
+  }
+};
+
+// Shard a thread sends to next and the one it receives from first
+static thread_local uint32_t send_shard = syscall(SYS_gettid);
+static thread_local uint32_t home_shard = 0;
+
+void qshard(size_t n) { home_shard = n; }
+
+static const size_t MAX_RING_MSG_SIZE = sizeof(ring::slot::data);
+
+static bool is_ring(int qid) { return qid < -1; }
+static int ring_qid(int shmid) { return -(shmid + 2); }
+static int ring_shmid(int qid) { return -qid - 2; }
+
+static int futex(std::atomic<uint32_t> *addr, int op, uint32_t val,
+                 const struct timespec *timeout) {
+  return syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), op, val,
+                 timeout, nullptr, 0);
+}
+
+// Waits until *addr changes from seen. Returns 0, ETIMEDOUT or EINTR.
+static int futex_wait(std::atomic<uint32_t> *addr, uint32_t seen,
+                      const struct timespec *timeout) {
+  if (futex(addr, FUTEX_WAIT, seen, timeout) == -1) {
+    if (errno == ETIMEDOUT || errno == EINTR) {
+      return errno;
+    }
+    if (errno != EAGAIN) {
+      throw std::system_error(errno, std::system_category(), "FUTEX_WAIT");
+    }
+  }
+  return 0;
+}
+
+static void futex_wake(std::atomic<uint32_t> *addr, int n) {
+  futex(addr, FUTEX_WAKE, n, nullptr);
+}
+
+static ring *ring_attach(int qid) {
+  static std::mutex mutex;
+  static std::map<int, ring *> attached;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = attached.find(qid);
+  if (it != attached.end()) {
+    return it->second;
+  }
+  auto ptr = shmat(ring_shmid(qid), nullptr, 0);
+  if (ptr == reinterpret_cast<void *>(-1)) {
+    throw std::system_error(errno, std::system_category(), "shmat failed");
+  }
+  return attached[qid] = reinterpret_cast<ring *>(ptr);
+}
+
+int qcreate(bool shm, size_t shards) {
+  if (!shm) {
+    return qcreate();
+  }
+  if (shards < 1 || shards > ring::max_shards) {
+    throw std::invalid_argument("Invalid number of queue shards");
+  }
+  int shmid = shmget(IPC_PRIVATE, ring::size(shards), 0600 | IPC_CREAT);
+  if (shmid == -1) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to create shared memory queue");
+  }
+  ring_attach(ring_qid(shmid))->init(shards);
+  return ring_qid(shmid);
+}
+
+static std::chrono::steady_clock::time_point deadline(long msec) {
+  return std::chrono::steady_clock::now() + std::chrono::milliseconds(msec);
+}
+
+// Time left until deadline, false if it has passed
+static bool remaining(std::chrono::steady_clock::time_point until,
+                      struct timespec *ts) {
+  auto left = until - std::chrono::steady_clock::now();
+  if (left <= std::chrono::steady_clock::duration::zero()) {
+    return false;
+  }
+  auto nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(left);
+  ts->tv_sec = nsec.count() / 1000000000;
+  ts->tv_nsec = nsec.count() % 1000000000;
+  return true;
+}
+
+static bool ringsnd_timed(ring *r, void *ptr, size_t len, enum flags flag,
+                          long msec) {
+  auto until = deadline(msec);
+  uint32_t idx, s;
+  auto freepop = [&] {
+    auto first = send_shard++;
+    for (uint32_t i = 0; i < r->nshards; i++) {
+      s = (first + i) % r->nshards;
+      if (r->shards[s].free.pop(idx)) {
+        return true;
+      }
+    }
+    return false;
+  };
+  while (!freepop()) {
+    if (flag == fux::ipc::noblock) {
+      return false;
+    }
+    auto seen = r->freed.load();
+    r->senders++;
+    if (freepop()) {
+      r->senders--;
+      break;
+    }
+    struct timespec ts;
+    bool waited = false;
+    if (flag == fux::ipc::notime) {
+      waited = futex_wait(&r->freed, seen, nullptr) != ETIMEDOUT;
+    } else if (remaining(until, &ts)) {
+      waited = futex_wait(&r->freed, seen, &ts) != ETIMEDOUT;
+    }
+    r->senders--;
+    if (r->removed) {
+      throw std::system_error(EIDRM, std::system_category());
+    }
+    if (!waited) {
+      return false;
+    }
+  }
+
+  auto &slot = r->slot[idx];
+  slot.len = len;
+  std::copy_n(reinterpret_cast<char *>(ptr), len, slot.data);
+  r->shards[s].lane[ring::lane_of(*reinterpret_cast<long *>(ptr))].push(idx);
+
+  r->posted++;
+  if (r->receivers != 0) {
+    futex_wake(&r->posted, 1);
+  }
+  return true;
+}
+
+// Blocking receives of threads that called qinterruptible() are woken by a
+// claimed signal, SIGRTMIN+1 unless it is taken. It is blocked while the
+// thread runs anything else so that system calls of services are never
+// interrupted.
+static thread_local bool interruptible = false;
+
+static int interrupt_signal() {
+  static int signo = claim_signal(SIGRTMIN + 1);
+  return signo;
+}
+
+void qinterruptible() {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, interrupt_signal());
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+  interruptible = true;
+}
+
+void qinterrupt(pthread_t thread) { pthread_kill(thread, interrupt_signal()); }
+
+// Lets the interrupt signal in for the duration of a blocking receive
+class interrupt_window {
+ public:
+  explicit interrupt_window(int flags)
+      : open_(interruptible && !(flags & IPC_NOWAIT)) {
+    if (open_) {
+      sigset_t set;
+      sigemptyset(&set);
+      sigaddset(&set, interrupt_signal());
+      pthread_sigmask(SIG_UNBLOCK, &set, nullptr);
+    }
+  }
+  ~interrupt_window() {
+    if (open_) {
+      sigset_t set;
+      sigemptyset(&set);
+      sigaddset(&set, interrupt_signal());
+      pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    }
+  }
+
+ private:
+  bool open_;
+};
+
+// Same selection as msgrcv(2) but by lanes instead of exact message types
+static bool shardpop(ring *r, ring::shard &shard, long msgtype,
+                     uint32_t &idx) {
+  if (msgtype > 0) {
+    return shard.lane[ring::lane_of(msgtype)].pop(idx);
+  } else if (msgtype < 0) {
+    auto last = msgtype == std::numeric_limits<long>::min()
+                    ? ring::lanes - 1
+                    : ring::lane_of(-msgtype);
+    for (int i = 0; i <= last; i++) {
+      if (shard.lane[i].pop(idx)) {
+        return true;
+      }
+    }
+    return false;
+  } else {
+    // No order between lanes, rotate to avoid starving any
+    auto first = r->rotation++;
+    for (int i = 0; i < ring::lanes; i++) {
+      if (shard.lane[(first + i) % ring::lanes].pop(idx)) {
+        return true;
+      }
+    }
+    return false;
+  }
+}
+
+// Takes from the home shard of this thread first, then steals from others.
+// Slot goes back to the free list of shard s it came from.
+static bool ringpop(ring *r, long msgtype, uint32_t &idx, uint32_t &s) {
+  auto home = home_shard % r->nshards;
+  for (uint32_t i = 0; i < r->nshards; i++) {
+    s = (home + i) % r->nshards;
+    if (shardpop(r, r->shards[s], msgtype, idx)) {
+      if (i != 0) {
+        r->shards[s].stolen++;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+static size_t ringrcv(ring *r, void *ptr, size_t len, long msgtype,
+                      int flags) {
+  uint32_t idx, s;
+  while (!ringpop(r, msgtype, idx, s)) {
+    if (r->removed) {
+      throw std::system_error(EIDRM, std::system_category());
+    }
+    if (flags & IPC_NOWAIT) {
+      return 0;
+    }
+    auto seen = r->posted.load();
+    r->receivers++;
+    if (ringpop(r, msgtype, idx, s)) {
+      r->receivers--;
+      break;
+    }
+    auto rc = futex_wait(&r->posted, seen, nullptr);
+    r->receivers--;
+    if (rc == EINTR && interruptible) {
+      return 0;
+    }
+  }
+
+  auto &slot = r->slot[idx];
+  auto n = slot.len;
+  if (n > len) {
+    throw std::system_error(E2BIG, std::system_category());
+  }
+  std::copy_n(slot.data, n, reinterpret_cast<char *>(ptr));
+  r->shards[s].free.push(idx);
+
+  r->freed++;
+  if (r->senders != 0) {
+    futex_wake(&r->freed, 1);
+  }
+  return n;
+}
+
+// Reply slots of a client indexed by call descriptor. The server that owns a
+// free slot copies the reply in and wakes the client. Replies that do not fit
+// or find the slot busy go through the client's reply queue and only the
+// queued counter is incremented.
+struct mailbox {
+  static constexpr uint32_t slots = 32;
+  static constexpr size_t slot_size = 4096;
+
+  enum state : uint32_t { empty, writing, full };
+
+  alignas(64) std::atomic<uint32_t> posted;
+  std::atomic<uint32_t> waiting;
+  std::atomic<uint32_t> queued;
+
+  struct slot {
+    std::atomic<uint32_t> state;
+    uint32_t len;
+    char data[slot_size - 2 * sizeof(uint32_t)];
+  } slot[slots];
+
+  void post() {
+    posted++;
+    if (waiting != 0) {
+      futex_wake(&posted, 1);
+    }
+  }
+};
+
+static std::shared_ptr<mailbox> mailbox_attach(int mbid) {
+  // Servers talk to many short-lived clients, keep only recent ones attached
+  constexpr size_t max_attached = 64;
+  static std::mutex mutex;
+  static std::list<std::pair<int, std::shared_ptr<mailbox>>> attached;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto it = attached.begin(); it != attached.end(); ++it) {
+    if (it->first == mbid) {
+      attached.splice(attached.begin(), attached, it);
+      return it->second;
+    }
+  }
+  auto ptr = shmat(mbid, nullptr, 0);
+  if (ptr == reinterpret_cast<void *>(-1)) {
+    throw std::system_error(errno, std::system_category(), "shmat failed");
+  }
+  attached.emplace_front(
+      mbid, std::shared_ptr<mailbox>(reinterpret_cast<mailbox *>(ptr),
+                                     [](mailbox *p) { shmdt(p); }));
+  if (attached.size() > max_attached) {
+    attached.pop_back();
+  }
+  return attached.front().second;
+}
+
+int mbcreate() {
+  int mbid = shmget(IPC_PRIVATE, sizeof(mailbox), 0600 | IPC_CREAT);
+  if (mbid == -1) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to create reply mailbox");
+  }
+  return mbid;
+}
+
+void mbdelete(int mbid) { shmctl(mbid, IPC_RMID, NULL); }
+
+static msgblob handing(msg &data, int dest);
+
+bool mbsend(int mbid, msg &data) {
+  auto mb = mailbox_attach(mbid);
+  bool by_handle = data.handle() != -1;
+  if (!by_handle && data.size() > sizeof(mailbox::slot::data)) {
+    return false;
+  }
+  auto &slot = mb->slot[uint32_t(data->cd) % mailbox::slots];
+  uint32_t empty = mailbox::empty;
+  if (!slot.state.compare_exchange_strong(empty, mailbox::writing)) {
+    return false;
+  }
+  if (by_handle) {
+    auto handle = handing(data, ring_qid(mbid));
+    slot.len = sizeof(handle);
+    std::copy_n(reinterpret_cast<char *>(&handle), sizeof(handle), slot.data);
+    data.handed();
+  } else {
+    data->ttype = fux::ipc::queue;
+    slot.len = data.size();
+    std::copy_n(data.wire(), data.size(), slot.data);
+  }
+  slot.state.store(mailbox::full, std::memory_order_release);
+  mb->post();
+  return true;
+}
+
+void mbnotify(int mbid) {
+  auto mb = mailbox_attach(mbid);
+  mb->queued++;
+  mb->post();
+}
+
+bool mbrecv(int mbid, msg &data, uint32_t &queued) {
+  auto mb = mailbox_attach(mbid);
+  while (true) {
+    auto seen = mb->posted.load();
+    for (auto &slot : mb->slot) {
+      if (slot.state.load(std::memory_order_acquire) == mailbox::full) {
+        data.resize(slot.len);
+        std::copy_n(slot.data, slot.len, data.buf());
+        slot.state.store(mailbox::empty, std::memory_order_release);
+        data.received();
+        return true;
+      }
+    }
+    if (mb->queued != queued) {
+      queued = mb->queued;
+      return false;
+    }
+    mb->waiting++;
+    futex_wait(&mb->posted, seen, nullptr);
+    mb->waiting--;
+  }
+}
+
+// Arena is split into pages, a message takes consecutive pages. Page map is
+// protected by a robust mutex so that a crashed process does not block
+// others.
+struct blobarena {
+  static constexpr size_t page_size = 4096;
+  static constexpr uint32_t continued = std::numeric_limits<uint32_t>::max();
+
+  pthread_mutex_t mutex;
+  uint32_t pages;
+  uint32_t hint;
+  size_t data_off;
+  // Number of pages in the message starting at page, 0 for free pages
+  uint32_t run[];
+};
+
+struct blobhdr {
+  std::atomic<int32_t> refs;
+  // Process holding the message, 0 while it is in a queue
+  std::atomic<pid_t> owner;
+  int dest;
+  size_t size;
+  char data[];
+};
+
+static blobarena *arena = nullptr;
+
+class arena_lock {
+ public:
+  arena_lock() {
+    if (pthread_mutex_lock(&arena->mutex) == EOWNERDEAD) {
+      pthread_mutex_consistent(&arena->mutex);
+    }
+  }
+  ~arena_lock() { pthread_mutex_unlock(&arena->mutex); }
+};
+
+int blobcreate(size_t size) {
+  auto pages = size / blobarena::page_size;
+  auto data_off =
+      nearest64(sizeof(blobarena) + pages * sizeof(uint32_t) +
+                blobarena::page_size - 1) /
+      blobarena::page_size * blobarena::page_size;
+  int shmid = shmget(IPC_PRIVATE, data_off + pages * blobarena::page_size,
+                     0600 | IPC_CREAT);
+  if (shmid == -1) {
+    throw std::system_error(errno, std::system_category(),
+                            "Failed to create message arena");
+  }
+  auto a = reinterpret_cast<blobarena *>(shmat(shmid, nullptr, 0));
+  if (a == reinterpret_cast<void *>(-1)) {
+    throw std::system_error(errno, std::system_category(), "shmat failed");
+  }
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&a->mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+  a->pages = pages;
+  a->hint = 0;
+  a->data_off = data_off;
+  std::fill_n(a->run, pages, 0);
+  shmdt(a);
+  return shmid;
+}
+
+void blobattach(int shmid) {
+  if (shmid == -1) {
+    arena = nullptr;
+    return;
+  }
+  auto a = shmat(shmid, nullptr, 0);
+  if (a == reinterpret_cast<void *>(-1)) {
+    throw std::system_error(errno, std::system_category(), "shmat failed");
+  }
+  arena = reinterpret_cast<blobarena *>(a);
+}
+
+static char *blobbase() {
+  return reinterpret_cast<char *>(arena) + arena->data_off;
+}
+
+static blobhdr *blobptr(size_t page) {
+  return reinterpret_cast<blobhdr *>(blobbase() + page * blobarena::page_size);
+}
+
+// Page of the message that ptr points into
+static size_t blobpage(const void *ptr) {
+  return (reinterpret_cast<const char *>(ptr) - blobbase()) /
+         blobarena::page_size;
+}
+
+// Caller holds the lock
+static void blobfree(size_t page) {
+  std::fill_n(arena->run + page, arena->run[page], 0);
+  arena->hint = std::min(arena->hint, uint32_t(page));
+}
+
+// Allocates pages for size bytes, returns the first page or -1 if there is
+// no room. The header is set before the lock is released, blobreclaim() must
+// never see the owner of a previous message in it.
+static ssize_t blobnew(size_t size, pid_t owner, int dest) {
+  if (arena == nullptr) {
+    return -1;
+  }
+  uint32_t need =
+      (sizeof(blobhdr) + size + blobarena::page_size - 1) / blobarena::page_size;
+  ssize_t found = -1;
+  {
+    arena_lock lock;
+    uint32_t free = 0;
+    for (uint32_t i = arena->hint; i < arena->pages;) {
+      if (arena->run[i] != 0) {
+        free = 0;
+        i += arena->run[i];
+        continue;
+      }
+      if (++free == need) {
+        found = i + 1 - need;
+        break;
+      }
+      i++;
+    }
+    if (found == -1) {
+      return -1;
+    }
+    auto blob = blobptr(found);
+    blob->refs = 1;
+    blob->owner = owner;
+    blob->dest = dest;
+    blob->size = size;
+    arena->run[found] = need;
+    std::fill_n(arena->run + found + 1, need - 1, blobarena::continued);
+    if (found == arena->hint) {
+      arena->hint = found + need;
+    }
+  }
+  return found;
+}
+
+// Returns the first page or -1 if there is no room
+static ssize_t blobput(const char *data, size_t size, int dest) {
+  auto page = blobnew(size, getpid(), dest);
+  if (page == -1) {
+    return -1;
+  }
+  auto blob = blobptr(page);
+  std::copy_n(data, size, blob->data);
+  // Belongs to the queue from now on
+  blob->owner = 0;
+  return page;
+}
+
+void *blobmalloc(size_t size) {
+  auto page = blobnew(size, getpid(), -1);
+  if (page == -1) {
+    return nullptr;
+  }
+  return blobptr(page)->data;
+}
+
+static void blobrelease(size_t page) {
+  if (blobptr(page)->refs.fetch_sub(1) == 1) {
+    arena_lock lock;
+    blobfree(page);
+  }
+}
+
+void blobmfree(void *ptr) { blobrelease(blobpage(ptr)); }
+
+// Prepares the buffer of data to be handed over through dest, returns the
+// message to send instead
+static msgblob handing(msg &data, int dest) {
+  data->ttype = fux::ipc::handle;
+  auto start = data.wire();
+  msgblob handle;
+  handle.mtype = data->mtype;
+  handle.ttype = fux::ipc::handle;
+  handle.offset = data.handle();
+  handle.size = data.size_data();
+
+  auto blob = blobptr(blobpage(start));
+  blob->dest = dest;
+  blob->owner = 0;
+  return handle;
+}
+
+// Takes over the buffer of a received handle, returns the buffer and sets len
+// to the length of data
+static char *taking(const msgblob &handle, long *len) {
+  auto start = blobbase() + handle.offset;
+  blobptr(blobpage(start))->owner = getpid();
+  auto ptr = fux::mem::adopt(start, handle.size, len);
+  if (ptr == nullptr) {
+    blobmfree(start);
+    throw std::runtime_error("Unknown type of handed over buffer");
+  }
+  return ptr;
+}
+
+static bool queue_exists(int qid);
+
+void blobreclaim() {
+  if (arena == nullptr) {
+    return;
+  }
+  arena_lock lock;
+  for (uint32_t i = 0; i < arena->pages;) {
+    auto n = arena->run[i];
+    if (n == 0) {
+      i++;
+      continue;
+    }
+    auto blob = blobptr(i);
+    pid_t owner = blob->owner;
+    if (owner != 0 ? !alive(owner) : !queue_exists(blob->dest)) {
+      blobfree(i);
+    }
+    i += n;
+  }
+}
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// msgsnd(2) has no timeout of its own. A per-thread POSIX timer interrupts
+// the blocking call with a claimed signal, SIGRTMIN unless it is taken.
+// After the deadline the timer keeps firing every millisecond in case the
+// first signal arrived just before msgsnd started to wait.
+static int timer_signal() {
+  static int signo = claim_signal(SIGRTMIN);
+  return signo;
+}
+
+class send_timer {
+ public:
+  send_timer() {
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = timer_signal();
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    fail_if(timer_create(CLOCK_MONOTONIC, &sev, &timer_) == -1);
+  }
+  ~send_timer() { timer_delete(timer_); }
+
+  std::chrono::steady_clock::time_point arm(long msec) {
+    auto until = deadline(msec);
+    auto nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    until.time_since_epoch())
+                    .count();
+    struct itimerspec its;
+    its.it_value.tv_sec = nsec / 1000000000;
+    its.it_value.tv_nsec = nsec % 1000000000;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 1000000;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, timer_signal());
+    pthread_sigmask(SIG_UNBLOCK, &set, &saved_);
+    fail_if(timer_settime(timer_, TIMER_ABSTIME, &its, nullptr) == -1);
+    return until;
+  }
+
+  void disarm() {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    timer_settime(timer_, 0, &its, nullptr);
+    pthread_sigmask(SIG_SETMASK, &saved_, nullptr);
+  }
+
+ private:
+  timer_t timer_;
+  sigset_t saved_;
+};
+
 static bool msgsnd_timed(int msqid, void *ptr, size_t len, enum flags flag,
                          long msec) {
+  if (is_ring(msqid)) {
+    return ringsnd_timed(ring_attach(msqid), ptr, len, flag, msec);
+  }
   if (flag == fux::ipc::notime) {
     int n = msgsnd(msqid, ptr, len - sizeof(long), 0);
     if (n != -1) {
@@ -154,26 +996,31 @@ static bool msgsnd_timed(int msqid, void *ptr, size_t len, enum flags flag,
       throw std::system_error(errno, std::system_category());
     }
   } else {  // noflags
-    const long interval_msec = 100;
-    int times = msec / interval_msec + 2;
+    int n = msgsnd(msqid, ptr, len - sizeof(long), IPC_NOWAIT);
+    if (n != -1) {
+      return true;
+    } else if (errno != EAGAIN) {
+      throw std::system_error(errno, std::system_category());
+    }
+    if (msec <= 0) {
+      return false;
+    }
 
-    for (int i = 0; i < times; i++) {
-      int n = msgsnd(msqid, ptr, len - sizeof(long), IPC_NOWAIT);
+    thread_local send_timer timer;
+    auto until = timer.arm(msec);
+    while (true) {
+      n = msgsnd(msqid, ptr, len - sizeof(long), 0);
       if (n != -1) {
+        timer.disarm();
         return true;
-      } else if (errno != EAGAIN) {
-        fprintf(stderr, "ERROR %d %s\n", errno, strerror(errno));
+      } else if (errno != EINTR) {
+        timer.disarm();
         throw std::system_error(errno, std::system_category());
       }
-      if (i == 0) {
-        // Immediate retry
-        continue;
-      }
-
-      struct timespec req = {0, interval_msec * 1000000};
-      if (nanosleep(&req, nullptr) == -1) {
-        fprintf(stderr, "!!ERROR %d %s\n", errno, strerror(errno));
-        throw std::system_error(errno, std::system_category());
+      // Interrupted by the timer or by some unrelated signal
+      if (std::chrono::steady_clock::now() >= until) {
+        timer.disarm();
+        return false;
       }
     }
   }
@@ -181,14 +1028,54 @@ static bool msgsnd_timed(int msqid, void *ptr, size_t len, enum flags flag,
 }
 
 bool qsend(int msqid, msg &data, long timeout, enum flags flags) {
-  if (data.size() > MAX_QUEUE_MSG_SIZE) {
+  if (data.handle() != -1) {
+    auto handle = handing(data, msqid);
+    // Buffer is still ours if it was not sent, blobreclaim() must not free
+    // it because of the queue
+    auto keep = [&] {
+      auto blob = blobptr(blobpage(blobbase() + handle.offset));
+      blob->owner = getpid();
+      blob->dest = -1;
+    };
+    bool sent;
+    try {
+      sent = msgsnd_timed(msqid, &handle, sizeof(handle), flags, timeout);
+    } catch (...) {
+      keep();
+      throw;
+    }
+    if (!sent) {
+      keep();
+      return false;
+    }
+    data.handed();
+    return true;
+  }
+
+  auto max = is_ring(msqid) ? MAX_RING_MSG_SIZE : MAX_QUEUE_MSG_SIZE;
+  if (data.size() > max) {
+    auto page = blobput(data.wire() + sizeof(msgbase),
+                        data.size() - sizeof(msgbase), msqid);
+    if (page != -1) {
+      msgblob bmsg;
+      bmsg.mtype = data->mtype;
+      bmsg.ttype = fux::ipc::blob;
+      bmsg.offset = page;
+      if (!msgsnd_timed(msqid, &bmsg, sizeof(bmsg), flags, timeout)) {
+        blobrelease(page);
+        return false;
+      }
+      return true;
+    }
+
     char tmpname[] = "/tmp/msgbase-XXXXXX";
     int fd = mkstemp(tmpname);
     fail_if(fd == -1);
-    fail_if(write(fd, data.buf() + sizeof(msgbase),
+    fail_if(write(fd, data.wire() + sizeof(msgbase),
                   data.size() - sizeof(msgbase)) !=
             data.size() - sizeof(msgbase));
     fail_if(close(fd) == -1);
+    FUXPROBE(qsend__spill, tmpname, data->cd, data.size(), data->gttid);
 
     msgfile fmsg;
     fmsg.mtype = data->mtype;
@@ -203,52 +1090,269 @@ bool qsend(int msqid, msg &data, long timeout, enum flags flags) {
     return true;
   } else {
     data->ttype = fux::ipc::queue;
-    return msgsnd_timed(msqid, data.buf(), data.size(), flags, timeout);
+    return msgsnd_timed(msqid, data.wire(), data.size(), flags, timeout);
   }
 }
 
-// IPC_NOWAIT
-void qrecv(int msqid, msg &data, long msgtype, int flags) {
-  data.resize(MAX_QUEUE_MSG_SIZE);
-
-  // MSGMAX
-  ssize_t n = msgrcv(msqid, data.buf(), MAX_QUEUE_MSG_SIZE, msgtype, flags);
-  if (n == -1) {
-    throw std::system_error(errno, std::system_category());
+// Receives a message into memory returned by room(n). It provides space for
+// n bytes of the message and keeps the bytes received so far. Returns the
+// size of the message or 0 if there is none and flags have IPC_NOWAIT or the
+// wait was interrupted.
+template <typename Room>
+static size_t recv(int msqid, Room room, long msgtype, int flags) {
+  ssize_t n;
+  if (is_ring(msqid)) {
+    interrupt_window window(flags);
+    n = ringrcv(ring_attach(msqid), room(MAX_RING_MSG_SIZE), MAX_RING_MSG_SIZE,
+                msgtype, flags);
+    if (n == 0) {
+      return 0;
+    }
+  } else {
+    interrupt_window window(flags);
+    // MSGMAX
+    n = msgrcv(msqid, room(MAX_QUEUE_MSG_SIZE), MAX_QUEUE_MSG_SIZE, msgtype,
+               flags);
+    if (n == -1) {
+      if (errno == ENOMSG || (errno == EINTR && interruptible)) {
+        return 0;
+      }
+      throw std::system_error(errno, std::system_category());
+    }
+    n += sizeof(long);
   }
-  data.resize(n + sizeof(long));
-  if (data->ttype == fux::ipc::file) {
-    char filename[n];
-    strcpy(filename, data.as_msgfile().filename);
+
+  auto base = reinterpret_cast<msgbase *>(room(n));
+  if (base->ttype == fux::ipc::blob) {
+    auto page = reinterpret_cast<msgblob *>(base)->offset;
+    auto blob = blobptr(page);
+    blob->owner = getpid();
+    n = sizeof(msgbase) + blob->size;
+    std::copy_n(blob->data, blob->size, room(n) + sizeof(msgbase));
+    blobrelease(page);
+  } else if (base->ttype == fux::ipc::file) {
+    char filename[PATH_MAX];
+    strcpy(filename, reinterpret_cast<msgfile *>(base)->filename);
     struct stat st;
     fail_if(stat(filename, &st) == -1);
     int fd = open(filename, 0);
     fail_if(fd == -1);
-    data.resize(sizeof(msgbase) + st.st_size);
-    fail_if(read(fd, data.buf() + sizeof(msgbase), st.st_size) != st.st_size);
+    n = sizeof(msgbase) + st.st_size;
+    fail_if(read(fd, room(n) + sizeof(msgbase), st.st_size) != st.st_size);
     fail_if(close(fd) == -1);
     fail_if(unlink(filename) == -1);
   }
+  return n;
+}
+
+// IPC_NOWAIT
+void qrecv(int msqid, msg &data, long msgtype, int flags) {
+  auto n = recv(
+      msqid,
+      [&](size_t n) {
+        data.resize(n);
+        return data.buf();
+      },
+      msgtype, flags);
+  if (n == 0) {
+    throw std::system_error(ENOMSG, std::system_category());
+  }
+  data.resize(n);
+  data.received();
 }
 
-void qdelete(int msqid) { msgctl(msqid, IPC_RMID, NULL); }
+long qrecv(int msqid, msg &hdr, char **data, long msgtype, int flags) {
+  char *start = nullptr;
+  auto n = recv(
+      msqid,
+      [&](size_t n) {
+        auto image = n > sizeof(msgmem) ? n - sizeof(msgmem) : 0;
+        start = fux::mem::msgin(data, image);
+        if (start == nullptr) {
+          throw std::runtime_error("no room for message");
+        }
+        return start;
+      },
+      msgtype, flags);
+  if (n == 0) {
+    return -1;
+  }
+  if (reinterpret_cast<msgbase *>(start)->ttype == fux::ipc::handle) {
+    long len;
+    auto handle = *reinterpret_cast<msgblob *>(start);
+    auto ptr = taking(handle, &len);
+    hdr.resize(sizeof(msgmem));
+    std::copy_n(blobbase() + handle.offset, sizeof(msgmem), hdr.buf());
+    fux::mem::replace(data, ptr);
+    return len;
+  }
+  if (n < sizeof(msgmem)) {
+    throw std::runtime_error("message too short");
+  }
 
-void msg::set_data(char *data, long len) {
+  hdr.resize(sizeof(msgmem));
+  std::copy_n(start, sizeof(msgmem), hdr.buf());
+  auto len = fux::mem::msgimport(data, n - sizeof(msgmem));
+  if (len == -1) {
+    throw std::runtime_error("tpimport failed");
+  }
+  return len;
+}
+
+size_t qdepth(int msqid) { return qstats(msqid).queued; }
+
+uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+queue_stats qstats(int msqid) {
+  queue_stats stats;
+  stats.queued = 0;
+  stats.shards = 1;
+  stats.stolen = 0;
+  if (is_ring(msqid)) {
+    auto r = ring_attach(msqid);
+    stats.shards = r->nshards;
+    for (uint32_t i = 0; i < r->nshards; i++) {
+      for (auto &l : r->shards[i].lane) {
+        stats.queued += l.size();
+      }
+      stats.stolen += r->shards[i].stolen;
+    }
+    return stats;
+  }
+  struct msqid_ds ds;
+  if (msgctl(msqid, IPC_STAT, &ds) == -1) {
+    throw std::system_error(errno, std::system_category());
+  }
+  stats.queued = ds.msg_qnum;
+  return stats;
+}
+
+static bool queue_exists(int qid) {
+  if (is_ring(qid)) {
+    struct shmid_ds ds;
+    return shmctl(ring_shmid(qid), IPC_STAT, &ds) != -1 &&
+           !(ds.shm_perm.mode & SHM_DEST);
+  }
+  struct msqid_ds ds;
+  return msgctl(qid, IPC_STAT, &ds) != -1;
+}
+
+void qdelete(int msqid) {
+  if (is_ring(msqid)) {
+    // Segment stays mapped, wake everyone blocked so they see it is gone
+    auto r = ring_attach(msqid);
+    r->removed = true;
+    r->posted++;
+    r->freed++;
+    futex_wake(&r->posted, std::numeric_limits<int>::max());
+    futex_wake(&r->freed, std::numeric_limits<int>::max());
+    shmctl(ring_shmid(msqid), IPC_RMID, NULL);
+  } else {
+    msgctl(msqid, IPC_RMID, NULL);
+  }
+}
+
+char *msg::wire() {
+  if (inplace_ == nullptr) {
+    return buf();
+  }
+  std::copy_n(buf(), sizeof(msgmem), inplace_);
+  return inplace_;
+}
+
+static std::shared_ptr<char *> hold(char *ptr) {
+  return std::shared_ptr<char *>(new char *(ptr), [](char **p) {
+    if (*p != nullptr) {
+      tpfree(*p);
+    }
+    delete p;
+  });
+}
+
+void msg::set_data(char *data, long len, bool give) {
+  resize_data(0);
   if (data == nullptr) {
-    resize_data(0);
+    return;
+  }
+  long size;
+  bool shared;
+  if (auto wire = fux::mem::msgout(data, len, &size, &shared);
+      wire != nullptr) {
+    if (shared && give) {
+      fux::mem::handover(data);
+      given_ = true;
+      handle_ = wire - blobbase();
+    } else if (shared) {
+      if (auto dup = fux::mem::msgdup(data, len); dup != nullptr) {
+        owned_ = hold(dup);
+        owned_len_ = len;
+        wire = fux::mem::msgout(dup, len, &size, &shared);
+        handle_ = wire - blobbase();
+      }
+    }
+    inplace_ = wire;
+    inplace_size_ = size;
     return;
   }
   auto needed = fux::mem::bufsize(data, len);
   resize_data(needed);
   if (tpexport(data, len, (*this)->data, &needed, 0) == -1) {
-    throw std::runtime_error("tpexport failed");
+    // Encoded image of the buffer type may be larger than memory image
+    if (tperrno != TPELIMIT) {
+      throw std::runtime_error("tpexport failed");
+    }
+    resize_data(needed);
+    if (tpexport(data, len, (*this)->data, &needed, 0) == -1) {
+      throw std::runtime_error("tpexport failed");
+    }
   }
+  resize_data(needed);
+}
+
+void msg::handed() {
+  if (owned_) {
+    *owned_ = nullptr;
+  }
+}
+
+void msg::received() {
+  if ((*this)->ttype != fux::ipc::handle) {
+    return;
+  }
+  auto handle = *reinterpret_cast<msgblob *>(buf());
+  long len;
+  auto ptr = taking(handle, &len);
+  resize(sizeof(msgmem));
+  std::copy_n(blobbase() + handle.offset, sizeof(msgmem), buf());
+  inplace_ = blobbase() + handle.offset;
+  inplace_size_ = handle.size;
+  owned_ = hold(ptr);
+  owned_len_ = len;
 }
 
-void msg::get_data(char **data) {
-  if (tpimport((*this)->data, size_data(), data, 0, 0) == -1) {
+long msg::get_data(char **data) {
+  if (owned_ && *owned_ != nullptr) {
+    fux::mem::replace(data, *owned_);
+    *owned_ = nullptr;
+    return owned_len_;
+  }
+  // Same steps as a receive straight into the buffer
+  auto image = inplace_ != nullptr ? inplace_ + sizeof(msgmem) : (*this)->data;
+  auto size = size_data();
+  auto start = fux::mem::msgin(data, size);
+  if (start == nullptr) {
+    throw std::runtime_error("no room for message");
+  }
+  std::copy_n(image, size, start + sizeof(msgmem));
+  auto len = fux::mem::msgimport(data, size);
+  if (len == -1) {
     throw std::runtime_error("tpimport failed");
   }
+  return len;
 }
 
 }  // namespace fux::ipc
@@ -11,6 +11,9 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <cstdint>
+#include <limits>
+#include <memory>
 #include <system_error>
 #include <thread>
 #include <vector>
@@ -46,7 +49,7 @@ class scoped_semlock {
 
 namespace ipc {
 
-enum transport : char { queue, file };
+enum transport : char { queue, file, blob, handle };
 enum category : char { application, admin, unblock };
 enum flags : char { noflags = 0, noblock, notime };
 
@@ -60,12 +63,29 @@ struct msgfile : msgbase {
   char filename[PATH_MAX];
 };
 
+struct msgblob : msgbase {
+  size_t offset;
+  // Size of the image in a handed over buffer
+  size_t size;
+};
+
+// Service of a request is addressed by its index in the MIB services table.
+// Generation of the entry tells stale indices apart, admin messages have
+// badservice.
+constexpr uint32_t badservice = std::numeric_limits<uint32_t>::max();
+
 struct msgmem : msgbase {
-  char servicename[XATMI_SERVICE_NAME_LENGTH];
+  uint32_t service;
+  uint32_t generation;
+  // Monotonic time in microseconds when the request was sent
+  uint64_t enqueued;
+  // Shared by all requests made on behalf of the same client call
+  uint64_t corrid;
   fux::gttid gttid;
   long flags;
   int cd;
   int replyq;
+  int replybox;
   int rval;
   long rcode;
   char data[0];
@@ -73,7 +93,12 @@ struct msgmem : msgbase {
 
 class msg {
  public:
-  msg() {
+  msg()
+      : inplace_(nullptr),
+        inplace_size_(0),
+        handle_(-1),
+        given_(false),
+        owned_len_(0) {
     bytes_.resize(sizeof(msgmem));
     as_msgmem().mtype = 1;
   }
@@ -81,23 +106,104 @@ class msg {
   msgmem &as_msgmem() { return *reinterpret_cast<msgmem *>(buf()); }
   msgmem *operator->() { return reinterpret_cast<msgmem *>(buf()); }
   char *buf() { return &bytes_[0]; }
-  size_t size() { return bytes_.size(); }
-  void resize(size_t n) { bytes_.resize(n); }
-  void resize_data(size_t n) { bytes_.resize(n + sizeof(msgmem)); }
-  size_t size() const { return bytes_.size(); }
-  size_t size_data() const { return bytes_.size() - sizeof(msgmem); }
-
-  void set_data(char *data, long len);
-  void get_data(char **data);
+  void resize(size_t n) {
+    inplace_ = nullptr;
+    handle_ = -1;
+    given_ = false;
+    owned_.reset();
+    bytes_.resize(n);
+  }
+  void resize_data(size_t n) { resize(n + sizeof(msgmem)); }
+  size_t size() const { return bytes_.size() + inplace_size(); }
+  size_t size_data() const { return size() - sizeof(msgmem); }
+
+  // Whole message, the header is followed by data
+  char *wire();
+
+  // Data of typed buffers that do not need encoding is not copied, the
+  // message is sent from the buffer itself. It must stay unchanged until sent.
+  // Buffers in shared memory are passed by handle: with give the buffer
+  // itself goes to the receiver, otherwise a copy of it.
+  void set_data(char *data, long len, bool give = false);
+  // Returns the length of data, the same a receiving qrecv() reports
+  long get_data(char **data);
+
+  // Offset of the handed over buffer in the arena or -1
+  ssize_t handle() const { return handle_; }
+  // Receiver has got the handle
+  void handed();
+  // Data buffer passed to set_data() now belongs to the receiver
+  bool given() const { return given_; }
+  // Takes over the buffer of a received handle
+  void received();
 
  private:
+  size_t inplace_size() const { return inplace_ ? inplace_size_ : 0; }
+
   std::vector<char> bytes_;
+  char *inplace_;
+  long inplace_size_;
+  ssize_t handle_;
+  bool given_;
+  // Typed buffer held until it is handed over or taken by get_data()
+  std::shared_ptr<char *> owned_;
+  long owned_len_;
 };
 
 int qcreate();
+// Monotonic time in microseconds, comparable between processes
+uint64_t now_us();
+// Creates a request queue in shared memory when shm is true. Such queues have
+// ids below -1 and are used with the same functions as SysV message queues.
+// They can be split into shards, one per receiving thread.
+int qcreate(bool shm, size_t shards = 1);
+// Shard of sharded queues this thread receives from first
+void qshard(size_t n);
 bool qsend(int msqid, msg &data, long timeout, enum flags flags);
 void qrecv(int msqid, msg &data, long msgtype, int flags);
+// Receives data straight into typed buffer *data (it may move), only the
+// header is kept in hdr. Returns the length of data, -1 if flags have
+// IPC_NOWAIT and there is no message.
+long qrecv(int msqid, msg &hdr, char **data, long msgtype, int flags);
 void qdelete(int msqid);
+// Number of messages waiting in the queue
+size_t qdepth(int msqid);
+
+struct queue_stats {
+  size_t queued;
+  size_t shards;
+  // Messages taken from the shard of another thread
+  uint64_t stolen;
+};
+queue_stats qstats(int msqid);
+// Lets other threads wake this thread from blocking qrecv() with
+// qinterrupt(). The interrupted qrecv() returns as if the queue was empty and
+// IPC_NOWAIT was given.
+void qinterruptible();
+void qinterrupt(pthread_t thread);
+
+// Shared memory arena for messages too large for queues. Without an attached
+// arena or when it is full, messages are passed through files.
+int blobcreate(size_t size);
+// Arena used by this process, -1 for none
+void blobattach(int shmid);
+// Frees messages of dead processes and messages sent to removed queues
+void blobreclaim();
+// Memory for typed buffers owned by this process, nullptr if there is no
+// room. Such buffers are handed over to receivers by offset.
+void *blobmalloc(size_t size);
+void blobmfree(void *ptr);
+
+// Reply mailbox of a client in shared memory
+int mbcreate();
+void mbdelete(int mbid);
+// Places reply into the slot of data->cd, false if it must be queued instead
+bool mbsend(int mbid, msg &data);
+// Tells the client that a message was put into its reply queue
+void mbnotify(int mbid);
+// Waits for a reply. Returns false and updates queued if the reply queue has
+// new messages.
+bool mbrecv(int mbid, msg &data, uint32_t &queued);
 
 }  // namespace ipc
 }  // namespace fux
@@ -1,78 +1,349 @@
 // This file is part of Fuxedo
 // Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
 
+#include <tmtypes.h>
 #include <xatmi.h>
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstring>
+#include <mutex>
 
+#include "ipc.h"
+#include "mibtypes.h"
 #include "misc.h"
 
-void fml32init(void *, size_t);
-void fml32reinit(void *, size_t);
-void fml32finit(void *);
-size_t fml32used(void *);
+int fml32init(char *, long);
+int fml32reinit(char *, long);
+int fml32uninit(char *, long);
+long fml32presend(char *, long, long);
 
 namespace fux::mem {
 
-struct tptype {
-  char type[8];
-  char subtype[16];
-  int default_size;
-  void (*init)(void *mem, size_t size);
-  void (*reinit)(void *mem, size_t size);
-  void (*finit)(void *mem);
-  size_t (*used)(void *mem);
+static long strpresend(char *ptr, long, long) { return strlen(ptr) + 1; }
+
+// Built-in types first, application types are added by tpregistertype()
+constexpr size_t maxtptypes = 64;
+static tmtype_sw_t _tptypes[maxtptypes] = {
+    {"TPINIT", "*", TPINITNEED(0), nullptr, nullptr, nullptr, nullptr,
+     nullptr, nullptr, nullptr},
+    {"CARRAY", "*", 0, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+     nullptr},
+    {"STRING", "*", 512, nullptr, nullptr, nullptr, strpresend, nullptr,
+     nullptr, nullptr},
+    {"FML32", "*", 512, fml32init, fml32reinit, fml32uninit, fml32presend,
+     nullptr, nullptr, nullptr}};
+static std::atomic<size_t> ntptypes(4);
+static std::mutex tptypes_mutex;
+
+struct tpcounters {
+  std::atomic<long> outstanding;
+  std::atomic<long> peak;
 };
 
-size_t strused(void *ptr) { return strlen(reinterpret_cast<char *>(ptr)) + 1; }
+static tpcounters _tpcounters[maxtptypes];
+// Copy of the counters in the MIB entry of a server, protected by
+// tptypes_mutex when set
+static std::atomic<buffer_counters *> published(nullptr);
+static size_t npublished = 0;
 
-static tptype _tptypes[] = {
-    tptype{"TPINIT", "*", TPINITNEED(0), nullptr, nullptr, nullptr, nullptr},
-    tptype{"CARRAY", "*", 0, nullptr, nullptr, nullptr, nullptr},
-    tptype{"STRING", "*", 512, nullptr, nullptr, nullptr, strused},
-    tptype{"FML32", "*", 512, fml32init, fml32reinit, fml32finit, fml32used}};
+static_assert(sizeof(buffer_counters::type) == TMTYPELEN &&
+                  sizeof(buffer_counters::subtype) == TMSTYPELEN,
+              "MIB must fit buffer type names");
+
+static void name_slot(buffer_counters &slot, const tmtype_sw_t &t) {
+  memcpy(slot.type, t.type, TMTYPELEN);
+  memcpy(slot.subtype, t.subtype, TMSTYPELEN);
+}
 
 struct tpmem {
   long size;
   char **owner;
-  char type[8];
-  char subtype[16];
+  // 1-based index into _tptypes, 0 for memory not allocated by tpalloc
+  int type_id;
+  int size_class;
+  // Room for the IPC message header so that the exported image is sent and
+  // received in place
+  char msghdr[sizeof(fux::ipc::msgmem)];
+  char type[TMTYPELEN];
+  char subtype[TMSTYPELEN];
   char data[];
 };
 
+// Exported image is the type, subtype and data (or encoded data)
+constexpr size_t header_size = offsetof(tpmem, data) - offsetof(tpmem, type);
+
 static tpmem *memptr(char *ptr) {
   return (tpmem *)(ptr - offsetof(struct tpmem, data));
 }
 
-static const tptype *typeptr(const char *type, const char *subtype) {
+static bool matches(const tmtype_sw_t &t, const char *type,
+                    const char *subtype) {
+  return (strncmp(t.type, type, sizeof(t.type)) == 0 &&
+          (subtype == nullptr || subtype[0] == '\0' ||
+           strncmp(t.subtype, subtype, sizeof(t.subtype)) == 0));
+}
+
+static int typeid_of(const char *type, const char *subtype) {
+  auto begin = std::cbegin(_tptypes);
+  auto end = begin + ntptypes.load(std::memory_order_acquire);
   const auto &tptype = std::find_if(
-      std::cbegin(_tptypes), std::cend(_tptypes), [&](const auto &t) {
-        return (strncmp(t.type, type, sizeof(t.type)) == 0 &&
-                (subtype == nullptr || subtype[0] == '\0' ||
-                 strncmp(t.subtype, subtype, sizeof(t.subtype)) == 0));
-      });
-  if (tptype == std::end(_tptypes)) {
+      begin, end, [&](const auto &t) { return matches(t, type, subtype); });
+  if (tptype == end) {
     TPERROR(TPENOENT, "unknown type [%s] and subtype[%s]", type,
             subtype == nullptr ? "" : subtype);
+    return 0;
+  }
+  return std::distance(begin, tptype) + 1;
+}
+
+static const tmtype_sw_t *typeptr(const tpmem *mem) {
+  if (mem->type_id <= 0 || static_cast<size_t>(mem->type_id) > ntptypes) {
+    TPERROR(TPENOENT, "buffer not allocated by tpalloc");
     return nullptr;
   }
-  return &(*tptype);
+  return &_tptypes[mem->type_id - 1];
 }
 
-char *tpalloc(char *type, char *subtype, long size) {
+int tpregistertype(tmtype_sw_t *typesw) {
+  if (typesw == nullptr || typesw->type[0] == '\0') {
+    TPERROR(TPEINVAL, "typesw is NULL or has no type");
+    return -1;
+  }
+  if (typesw->dfltsize < 0) {
+    TPERROR(TPEINVAL, "invalid dfltsize %ld", typesw->dfltsize);
+    return -1;
+  }
+
+  std::lock_guard<std::mutex> lock(tptypes_mutex);
+  auto n = ntptypes.load();
+  for (size_t i = 0; i < n; i++) {
+    if (strncmp(_tptypes[i].type, typesw->type, TMTYPELEN) == 0 &&
+        strncmp(_tptypes[i].subtype, typesw->subtype, TMSTYPELEN) == 0) {
+      TPERROR(TPEMATCH, "type [%.*s] and subtype [%.*s] already registered",
+              TMTYPELEN, typesw->type, TMSTYPELEN, typesw->subtype);
+      return -1;
+    }
+  }
+  if (n == maxtptypes) {
+    TPERROR(TPELIMIT, "too many buffer types");
+    return -1;
+  }
+  _tptypes[n] = *typesw;
+  if (auto slots = published.load(std::memory_order_relaxed);
+      slots != nullptr && n < npublished) {
+    name_slot(slots[n], _tptypes[n]);
+  }
+  ntptypes.store(n + 1, std::memory_order_release);
+  return 0;
+}
+
+template <typename C>
+static void add_outstanding(C &c) {
+  auto n = c.outstanding.fetch_add(1, std::memory_order_relaxed) + 1;
+  auto peak = c.peak.load(std::memory_order_relaxed);
+  while (n > peak && !c.peak.compare_exchange_weak(peak, n,
+                                                   std::memory_order_relaxed)) {
+  }
+}
+
+static void count_alloc(int type_id) {
+  add_outstanding(_tpcounters[type_id - 1]);
+  auto slots = published.load(std::memory_order_acquire);
+  if (slots != nullptr && size_t(type_id) <= npublished) {
+    add_outstanding(slots[type_id - 1]);
+  }
+}
+
+static void count_free(int type_id) {
+  _tpcounters[type_id - 1].outstanding.fetch_sub(1, std::memory_order_relaxed);
+  auto slots = published.load(std::memory_order_acquire);
+  if (slots != nullptr && size_t(type_id) <= npublished) {
+    slots[type_id - 1].outstanding.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+// tpmem blocks (header included) are pooled in power-of-two size classes
+// from 256 bytes to 64KB, larger blocks go straight to malloc. Each thread
+// keeps a small cache of free blocks per class and exchanges batches with
+// a global free list so that buffers freed by other threads get reused.
+namespace pool {
+
+constexpr int nopool = -1;
+// Block in the shared memory arena, see fux::ipc::blobmalloc()
+constexpr int shared = -2;
+constexpr size_t min_shift = 8;
+constexpr size_t nclasses = 9;
+constexpr size_t thread_max = 32;
+constexpr size_t global_max = 1024;
+
+constexpr size_t class_size(int size_class) {
+  return size_t(1) << (min_shift + size_class);
+}
+
+static int size_class(size_t n) {
+  for (size_t c = 0; c < nclasses; c++) {
+    if (n <= class_size(c)) {
+      return c;
+    }
+  }
+  return nopool;
+}
+
+struct freeblock {
+  freeblock *next;
+};
+
+struct freelist {
+  freeblock *head = nullptr;
+  size_t count = 0;
+
+  void push(freeblock *b) {
+    b->next = head;
+    head = b;
+    count++;
+  }
+  freeblock *pop() {
+    auto b = head;
+    head = b->next;
+    count--;
+    return b;
+  }
+};
+
+struct global_pool {
+  std::mutex mutex;
+  freelist lists[nclasses];
+};
+
+static global_pool &global() {
+  // Never destroyed: thread caches may flush into it during exit
+  static auto *g = new global_pool();
+  return *g;
+}
+
+struct thread_cache {
+  freelist lists[nclasses];
+
+  ~thread_cache() {
+    for (size_t c = 0; c < nclasses; c++) {
+      drain(c, 0);
+    }
+  }
+
+  // Move blocks above `keep` to the global list, free what does not fit
+  void drain(int c, size_t keep) {
+    auto &g = global();
+    std::lock_guard<std::mutex> lock(g.mutex);
+    while (lists[c].count > keep) {
+      auto b = lists[c].pop();
+      if (g.lists[c].count < global_max) {
+        g.lists[c].push(b);
+      } else {
+        free(b);
+      }
+    }
+  }
+
+  void refill(int c) {
+    auto &g = global();
+    std::lock_guard<std::mutex> lock(g.mutex);
+    while (g.lists[c].count > 0 && lists[c].count < thread_max / 2) {
+      lists[c].push(g.lists[c].pop());
+    }
+  }
+};
+
+static thread_local thread_cache cache;
+
+static tpmem *allocate(size_t n) {
+  auto c = size_class(n);
+  if (c == nopool) {
+    auto mem = reinterpret_cast<tpmem *>(malloc(n));
+    if (mem != nullptr) {
+      mem->size_class = nopool;
+    }
+    return mem;
+  }
+
+  if (cache.lists[c].count == 0) {
+    cache.refill(c);
+  }
+  tpmem *mem;
+  if (cache.lists[c].count > 0) {
+    mem = reinterpret_cast<tpmem *>(cache.lists[c].pop());
+  } else {
+    mem = reinterpret_cast<tpmem *>(malloc(class_size(c)));
+    if (mem == nullptr) {
+      return nullptr;
+    }
+  }
+  mem->size_class = c;
+  return mem;
+}
+
+static tpmem *allocate_shared(size_t n) {
+  auto mem = reinterpret_cast<tpmem *>(fux::ipc::blobmalloc(n));
+  if (mem != nullptr) {
+    mem->size_class = shared;
+  }
+  return mem;
+}
+
+static void release(tpmem *mem) {
+  auto c = mem->size_class;
+  if (c == nopool) {
+    free(mem);
+    return;
+  } else if (c == shared) {
+    fux::ipc::blobmfree(mem);
+    return;
+  }
+  cache.lists[c].push(reinterpret_cast<freeblock *>(mem));
+  if (cache.lists[c].count > thread_max) {
+    cache.drain(c, thread_max / 2);
+  }
+}
+
+static bool fits(const tpmem *mem, size_t n) {
+  if (mem->size_class == shared) {
+    return n <= sizeof(tpmem) + mem->size;
+  }
+  return mem->size_class != nopool && n <= class_size(mem->size_class);
+}
+
+}  // namespace pool
+
+char *tpallocx(char *type, char *subtype, long size, long flags) {
+  if (flags & ~TPSHAREDMEM) {
+    TPERROR(TPEINVAL, "Invalid flags");
+    return nullptr;
+  }
   if (type == nullptr) {
     TPERROR(TPEINVAL, "type is nullptr");
     return nullptr;
   }
 
-  const auto tptype = typeptr(type, subtype);
-  if (tptype == nullptr) {
+  auto type_id = typeid_of(type, subtype);
+  if (type_id == 0) {
     return nullptr;
   }
+  const auto tptype = &_tptypes[type_id - 1];
 
-  size = size >= tptype->default_size ? size : tptype->default_size;
-  auto mem = (tpmem *)malloc(sizeof(tpmem) + size);
+  size = size >= tptype->dfltsize ? size : tptype->dfltsize;
+  tpmem *mem = nullptr;
+  if (flags & TPSHAREDMEM) {
+    // Private memory is used when the arena is full or missing
+    mem = pool::allocate_shared(sizeof(tpmem) + size);
+  }
+  if (mem == nullptr) {
+    mem = pool::allocate(sizeof(tpmem) + size);
+  }
+  if (mem == nullptr) {
+    TPERROR(TPEOS, "failed to allocate %ld bytes", size);
+    return nullptr;
+  }
+  mem->type_id = type_id;
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wstringop-truncation"
   strncpy(mem->type, type, sizeof(mem->type));
@@ -87,14 +358,62 @@ char *tpalloc(char *type, char *subtype, long size) {
   }
   mem->size = size;
   mem->owner = nullptr;
-  if (tptype->init != nullptr) {
-    tptype->init(mem->data, size);
+  if (tptype->initbuf != nullptr && tptype->initbuf(mem->data, size) == -1) {
+    TPERROR(TPESYSTEM, "initbuf failed for type [%s]", tptype->type);
+    pool::release(mem);
+    return nullptr;
   }
+  count_alloc(type_id);
 
   fux::atmi::reset_tperrno();
   return mem->data;
 }
 
+char *tpalloc(char *type, char *subtype, long size) {
+  return tpallocx(type, subtype, size, 0);
+}
+
+// Moves the buffer into a block with room for size bytes of data, keeps the
+// contents but does not reinitialize them
+static tpmem *resize(tpmem *mem, long size) {
+  if (mem->size_class == pool::nopool &&
+      pool::size_class(sizeof(tpmem) + size) == pool::nopool) {
+    auto grown = reinterpret_cast<tpmem *>(realloc(mem, sizeof(tpmem) + size));
+    if (grown == nullptr) {
+      TPERROR(TPEOS, "failed to allocate %ld bytes", size);
+      return nullptr;
+    }
+    mem = grown;
+  } else if (!pool::fits(mem, sizeof(tpmem) + size)) {
+    tpmem *grown = nullptr;
+    if (mem->size_class == pool::shared) {
+      grown = pool::allocate_shared(sizeof(tpmem) + size);
+    }
+    if (grown == nullptr) {
+      grown = pool::allocate(sizeof(tpmem) + size);
+    }
+    if (grown == nullptr) {
+      TPERROR(TPEOS, "failed to allocate %ld bytes", size);
+      return nullptr;
+    }
+    auto size_class = grown->size_class;
+    std::copy_n(reinterpret_cast<char *>(mem),
+                sizeof(tpmem) + std::min(mem->size, size),
+                reinterpret_cast<char *>(grown));
+    grown->size_class = size_class;
+    pool::release(mem);
+    mem = grown;
+  }
+  mem->size = size;
+  return mem;
+}
+
+static void moved(tpmem *mem, char *ptr) {
+  if (mem->owner != nullptr && *(mem->owner) == ptr) {
+    *(mem->owner) = mem->data;
+  }
+}
+
 char *tprealloc(char *ptr, long size) {
   if (ptr == nullptr) {
     TPERROR(TPEINVAL, "ptr is nullptr");
@@ -102,20 +421,22 @@ char *tprealloc(char *ptr, long size) {
   }
 
   auto mem = memptr(ptr);
-  const auto tptype = typeptr(mem->type, mem->subtype);
+  const auto tptype = typeptr(mem);
   if (tptype == nullptr) {
     return nullptr;
   }
 
-  size = (size >= tptype->default_size) ? size : tptype->default_size;
-  mem = (tpmem *)realloc(mem, sizeof(tpmem) + size);
-  if (tptype->reinit != nullptr) {
-    tptype->reinit(mem->data, size);
+  size = (size >= tptype->dfltsize) ? size : tptype->dfltsize;
+  mem = resize(mem, size);
+  if (mem == nullptr) {
+    return nullptr;
   }
-
-  if (mem->owner != nullptr && *(mem->owner) == ptr) {
-    *(mem->owner) = mem->data;
+  moved(mem, ptr);
+  if (tptype->reinitbuf != nullptr && tptype->reinitbuf(mem->data, size) == -1) {
+    TPERROR(TPESYSTEM, "reinitbuf failed for type [%s]", tptype->type);
+    return nullptr;
   }
+
   fux::atmi::reset_tperrno();
   return mem->data;
 }
@@ -123,17 +444,19 @@ void tpfree(char *ptr) {
   if (ptr != nullptr) {
     // Inside service routines do not free buffer passed into a service routine
     auto mem = memptr(ptr);
-    const auto tptype = typeptr(mem->type, mem->subtype);
+    const auto tptype = typeptr(mem);
     if (tptype == nullptr) {
       return;
     }
-    if (tptype->finit != nullptr) {
-      tptype->finit(ptr);
+    if (tptype->uninitbuf != nullptr) {
+      tptype->uninitbuf(ptr, mem->size);
     }
     if (mem->owner != nullptr && *(mem->owner) == ptr) {
       *(mem->owner) = nullptr;
     }
-    free(mem);
+    count_free(mem->type_id);
+    mem->type_id = 0;
+    pool::release(mem);
   }
   fux::atmi::reset_tperrno();
 }
@@ -145,7 +468,7 @@ long tptypes(char *ptr, char *type, char *subtype) {
   }
 
   auto mem = memptr(ptr);
-  const auto tptype = typeptr(mem->type, mem->subtype);
+  const auto tptype = typeptr(mem);
   if (tptype == nullptr) {
     TPERROR(TPEINVAL, "Buffer not fielded");
     return -1;
@@ -161,6 +484,73 @@ long tptypes(char *ptr, char *type, char *subtype) {
   return 0;
 }
 
+// Number of data bytes to send
+static long presend(tpmem *mem, const tmtype_sw_t *tptype, long len) {
+  if (tptype->presend != nullptr) {
+    auto n = tptype->presend(mem->data, len, mem->size);
+    if (n == -1) {
+      TPERROR(TPESYSTEM, "presend failed for type [%s]", tptype->type);
+    }
+    return n;
+  } else if (len != -1) {
+    return len;
+  } else {
+    return mem->size;
+  }
+}
+
+// Writes the image of the buffer into out if it fits into olen bytes.
+// Returns the size of image or -1
+static long encode(tpmem *mem, const tmtype_sw_t *tptype, long used,
+                   char *out, long olen) {
+  long n;
+  if (tptype->encdec != nullptr) {
+    n = tptype->encdec(TMENCODE, out + header_size,
+                       std::max(olen - long(header_size), 0L), mem->data, used);
+    if (n == -1) {
+      TPERROR(TPESYSTEM, "encode failed for type [%s]", tptype->type);
+      return -1;
+    }
+    n += header_size;
+    if (n <= olen) {
+      std::copy_n(mem->type, header_size, out);
+    }
+  } else {
+    n = used + header_size;
+    if (n <= olen) {
+      std::copy_n(mem->type, n, out);
+    }
+  }
+  return n;
+}
+
+// Turns the buffer into the type found in the header of an image
+static int header_typeid(const char *header) {
+  char type[TMTYPELEN + 1] = {0};
+  char subtype[TMSTYPELEN + 1] = {0};
+  std::copy_n(header, TMTYPELEN, type);
+  std::copy_n(header + TMTYPELEN, TMSTYPELEN, subtype);
+  return typeid_of(type, subtype);
+}
+
+static tpmem *retype(tpmem *mem, const char *header) {
+  auto type_id = header_typeid(header);
+  if (type_id == 0) {
+    return nullptr;
+  }
+  if (type_id != mem->type_id) {
+    if (mem->type_id != 0) {
+      count_free(mem->type_id);
+    }
+    count_alloc(type_id);
+    mem->type_id = type_id;
+  }
+  if (header != mem->type) {
+    std::copy_n(header, header_size, mem->type);
+  }
+  return mem;
+}
+
 int tpimport(char *istr, long ilen, char **obuf, long *olen, long flags) {
   if (istr == nullptr) {
     TPERROR(TPEINVAL, "istr is NULL");
@@ -175,40 +565,89 @@ int tpimport(char *istr, long ilen, char **obuf, long *olen, long flags) {
     flags |= TPEX_STRING;
   }
 
-  long needed = sizeof(tpmem);
+  const char *image = istr;
+  long len = ilen;
+  std::vector<char> decoded;
+  char header[header_size];
   if (flags & TPEX_STRING) {
-    ilen = strlen(istr);
-    if (ilen % 4) {
+    // Callers that know the length bound the scan for the terminator
+    ilen = ilen > 0 ? strnlen(istr, ilen) : strlen(istr);
+    if (ilen % 4 || ilen < long(base64chars(header_size))) {
       TPERROR(TPEPROTO, "Invalid base64 string");
       return -1;
     }
-    needed += ilen / 4 * 3;
-  } else {
-    needed += ilen;
+    // Header is exactly 32 base64 characters
+    base64decode(istr, base64chars(header_size), header, sizeof(header));
+    image = header;
+    len = ilen / 4 * 3;
+  } else if (ilen < long(header_size)) {
+    TPERROR(TPEPROTO, "Image too short");
+    return -1;
   }
 
-  auto omem = memptr(*obuf);
-  if (needed > omem->size) {
-    *obuf = tprealloc(*obuf, needed);
-    omem = memptr(*obuf);
+  auto ptr = *obuf;
+  auto omem = memptr(ptr);
+  // Buffer keeps its type until the image has been decoded
+  auto type_id = header_typeid(image);
+  if (type_id == 0) {
+    return -1;
   }
+  const auto tptype = &_tptypes[type_id - 1];
 
-  if (flags & TPEX_STRING) {
-    (void)base64decode(istr, ilen,
-                       reinterpret_cast<char *>(omem) + offsetof(tpmem, type),
-                       ilen);
+  long size;
+  if (tptype->encdec == nullptr) {
+    // Memory image is copied in place
+    if (len - long(header_size) > omem->size) {
+      omem = resize(omem, len - header_size);
+      if (omem == nullptr) {
+        return -1;
+      }
+    }
+    if (flags & TPEX_STRING) {
+      len = base64decode(istr, ilen,
+                         reinterpret_cast<char *>(omem) + offsetof(tpmem, type),
+                         header_size + omem->size);
+    } else {
+      std::copy_n(istr, ilen,
+                  reinterpret_cast<char *>(omem) + offsetof(tpmem, type));
+    }
+    size = len - header_size;
+    retype(omem, omem->type);
+    if (tptype->reinitbuf != nullptr &&
+        tptype->reinitbuf(omem->data, omem->size) == -1) {
+      TPERROR(TPESYSTEM, "reinitbuf failed for type [%s]", tptype->type);
+      return -1;
+    }
   } else {
-    std::copy_n(istr, ilen,
-                reinterpret_cast<char *>(omem) + offsetof(tpmem, type));
+    if (flags & TPEX_STRING) {
+      decoded.resize(len);
+      len = base64decode(istr, ilen, &decoded[0], decoded.size());
+      image = &decoded[0];
+    }
+    auto encoded = const_cast<char *>(image) + header_size;
+    auto elen = len - header_size;
+    size = tptype->encdec(TMDECODE, encoded, elen, omem->data, omem->size);
+    if (size > omem->size) {
+      omem = resize(omem, size);
+      if (omem == nullptr) {
+        return -1;
+      }
+      size = tptype->encdec(TMDECODE, encoded, elen, omem->data, omem->size);
+    }
+    if (size == -1) {
+      TPERROR(TPESYSTEM, "decode failed for type [%s]", tptype->type);
+      return -1;
+    }
+    retype(omem, image);
   }
+  moved(omem, ptr);
+  *obuf = omem->data;
 
-  const auto tptype = typeptr(omem->type, omem->subtype);
-  if (tptype == nullptr) {
+  if (tptype->postrecv != nullptr &&
+      tptype->postrecv(omem->data, size, omem->size) == -1) {
+    TPERROR(TPESYSTEM, "postrecv failed for type [%s]", tptype->type);
     return -1;
   }
-  if (tptype->reinit != nullptr) {
-    tptype->reinit(omem->data, omem->size);
-  }
 
   if (olen != nullptr) {
     *olen = ilen;
@@ -228,16 +667,40 @@ int tpexport(char *ibuf, long ilen, char *ostr, long *olen, long flags) {
   }
 
   auto mem = memptr(ibuf);
-  long used = fux::mem::bufsize(ibuf, ilen);
+  const auto tptype = typeptr(mem);
+  if (tptype == nullptr) {
+    return -1;
+  }
+  long used = presend(mem, tptype, ilen);
   if (used == -1) {
     return -1;
   }
 
   long needed;
+  std::vector<char> encoded;
   if (flags & TPEX_STRING) {
-    needed = base64chars(used) + 1;
+    long n;
+    if (tptype->encdec != nullptr) {
+      // Encode into a temporary image and base64 encode it
+      encoded.resize(header_size + used);
+      n = encode(mem, tptype, used, &encoded[0], encoded.size());
+      if (n > long(encoded.size())) {
+        encoded.resize(n);
+        n = encode(mem, tptype, used, &encoded[0], encoded.size());
+      }
+      if (n == -1) {
+        return -1;
+      }
+      encoded.resize(n);
+    } else {
+      n = header_size + used;
+    }
+    needed = base64chars(n) + 1;
   } else {
-    needed = used;
+    needed = encode(mem, tptype, used, ostr, *olen);
+    if (needed == -1) {
+      return -1;
+    }
   }
 
   if (*olen < needed) {
@@ -247,12 +710,17 @@ int tpexport(char *ibuf, long ilen, char *ostr, long *olen, long flags) {
   }
 
   if (flags & TPEX_STRING) {
-    auto n = base64encode(reinterpret_cast<char *>(mem) + offsetof(tpmem, type),
-                          used, ostr, *olen);
+    size_t n;
+    if (encoded.empty()) {
+      n = base64encode(mem->type, header_size + used, ostr, *olen);
+    } else {
+      n = base64encode(&encoded[0], encoded.size(), ostr, *olen);
+    }
     ostr[n] = '\0';
-  } else {
-    std::copy_n(reinterpret_cast<char *>(mem) + offsetof(tpmem, type), used,
-                ostr);
+  }
+
+  if (tptype->postsend != nullptr) {
+    tptype->postsend(mem->data, used, mem->size);
   }
 
   *olen = needed;
@@ -260,21 +728,186 @@ int tpexport(char *ibuf, long ilen, char *ostr, long *olen, long flags) {
   return 0;
 }
 
+char *msgout(char *ptr, long used, long *size, bool *shared) {
+  auto mem = memptr(ptr);
+  const auto tptype = typeptr(mem);
+  if (tptype == nullptr || tptype->encdec != nullptr) {
+    return nullptr;
+  }
+  auto n = presend(mem, tptype, used);
+  if (n == -1 || n > mem->size) {
+    return nullptr;
+  }
+  if (tptype->postsend != nullptr) {
+    tptype->postsend(mem->data, n, mem->size);
+  }
+  *size = header_size + n;
+  *shared = mem->size_class == pool::shared;
+  return mem->msghdr;
+}
+
+char *msgdup(char *ptr, long used) {
+  auto mem = memptr(ptr);
+  const auto tptype = typeptr(mem);
+  if (tptype == nullptr) {
+    return nullptr;
+  }
+  auto n = presend(mem, tptype, used);
+  if (n == -1) {
+    return nullptr;
+  }
+  auto dup = pool::allocate_shared(sizeof(tpmem) + mem->size);
+  if (dup == nullptr) {
+    return nullptr;
+  }
+  std::copy_n(reinterpret_cast<char *>(mem), sizeof(tpmem) + n,
+              reinterpret_cast<char *>(dup));
+  dup->size_class = pool::shared;
+  dup->owner = nullptr;
+  count_alloc(dup->type_id);
+  return dup->data;
+}
+
+void handover(char *ptr) {
+  auto mem = memptr(ptr);
+  if (mem->owner != nullptr && *(mem->owner) == ptr) {
+    *(mem->owner) = nullptr;
+  }
+  mem->owner = nullptr;
+  count_free(mem->type_id);
+}
+
+char *adopt(char *start, long size, long *len) {
+  auto mem = reinterpret_cast<tpmem *>(start - offsetof(tpmem, msghdr));
+  // Type ids of application types differ between processes
+  mem->type_id = 0;
+  if (retype(mem, mem->type) == nullptr) {
+    return nullptr;
+  }
+  mem->owner = nullptr;
+  *len = size - header_size;
+  return mem->data;
+}
+
+void replace(char **ptr, char *with) {
+  if (*ptr != nullptr && *ptr != with) {
+    auto mem = memptr(*ptr);
+    if (mem->owner == ptr) {
+      memptr(with)->owner = ptr;
+      mem->owner = nullptr;
+    }
+    tpfree(*ptr);
+  }
+  *ptr = with;
+}
+
+char *msgin(char **ptr, long size) {
+  auto mem = memptr(*ptr);
+  if (typeptr(mem) == nullptr) {
+    return nullptr;
+  }
+  if (size - long(header_size) > mem->size) {
+    mem = resize(mem, size - header_size);
+    if (mem == nullptr) {
+      return nullptr;
+    }
+    moved(mem, *ptr);
+    *ptr = mem->data;
+  }
+  return mem->msghdr;
+}
+
+long msgimport(char **ptr, long size) {
+  if (size == 0) {
+    // Message without data leaves the buffer as it was
+    return 0;
+  }
+  if (size < long(header_size)) {
+    TPERROR(TPEPROTO, "Image too short");
+    return -1;
+  }
+  auto mem = memptr(*ptr);
+  if (retype(mem, mem->type) == nullptr) {
+    return -1;
+  }
+  const auto tptype = &_tptypes[mem->type_id - 1];
+
+  long len = size - header_size;
+  if (tptype->encdec != nullptr) {
+    // Decoding can't be done in place, work from a copy of the image
+    std::vector<char> encoded(mem->data, mem->data + len);
+    len = tptype->encdec(TMDECODE, &encoded[0], encoded.size(), mem->data,
+                         mem->size);
+    if (len > mem->size) {
+      mem = resize(mem, len);
+      if (mem == nullptr) {
+        return -1;
+      }
+      moved(mem, *ptr);
+      *ptr = mem->data;
+      len = tptype->encdec(TMDECODE, &encoded[0], encoded.size(), mem->data,
+                           mem->size);
+    }
+    if (len == -1) {
+      TPERROR(TPESYSTEM, "decode failed for type [%s]", tptype->type);
+      return -1;
+    }
+  } else if (tptype->reinitbuf != nullptr &&
+             tptype->reinitbuf(mem->data, mem->size) == -1) {
+    TPERROR(TPESYSTEM, "reinitbuf failed for type [%s]", tptype->type);
+    return -1;
+  }
+
+  if (tptype->postrecv != nullptr &&
+      tptype->postrecv(mem->data, len, mem->size) == -1) {
+    TPERROR(TPESYSTEM, "postrecv failed for type [%s]", tptype->type);
+    return -1;
+  }
+  fux::atmi::reset_tperrno();
+  return len;
+}
+
 void setowner(char *ptr, char **owner) { memptr(ptr)->owner = owner; }
 
 long bufsize(char *ptr, long used) {
   auto mem = memptr(ptr);
-  const auto tptype = typeptr(mem->type, mem->subtype);
+  const auto tptype = typeptr(mem);
   if (tptype == nullptr) {
     return -1;
   }
-  if (tptype->used != nullptr) {
-    return tptype->used(mem->data) + sizeof(*mem) - offsetof(tpmem, type);
-  } else if (used != -1) {
-    return used + sizeof(*mem) - offsetof(tpmem, type);
-  } else {
-    return mem->size - offsetof(tpmem, type);
+  auto n = presend(mem, tptype, used);
+  if (n == -1) {
+    return -1;
+  }
+  return n + header_size;
+}
+
+void publish(buffer_counters *slots, size_t n) {
+  std::lock_guard<std::mutex> lock(tptypes_mutex);
+  auto ntypes = ntptypes.load();
+  for (size_t i = 0; i < n; i++) {
+    if (i < ntypes) {
+      name_slot(slots[i], _tptypes[i]);
+      slots[i].outstanding = _tpcounters[i].outstanding.load();
+      slots[i].peak = _tpcounters[i].peak.load();
+    } else {
+      memset(slots[i].type, 0, sizeof(slots[i].type));
+      slots[i].outstanding = 0;
+      slots[i].peak = 0;
+    }
+  }
+  npublished = n;
+  published.store(slots, std::memory_order_release);
+}
+
+std::vector<tpstats> stats() {
+  std::vector<tpstats> result;
+  for (size_t i = 0, n = ntptypes; i < n; i++) {
+    result.push_back({_tptypes[i].type, _tptypes[i].subtype,
+                      _tpcounters[i].outstanding.load(),
+                      _tpcounters[i].peak.load()});
   }
+  return result;
 }
 
 }  // namespace fux::mem
@@ -284,6 +917,11 @@ char *tpalloc(char *type, char *subtype, long size) {
       [&] { return fux::mem::tpalloc(type, subtype, size); }, nullptr);
 }
 
+char *tpallocx(char *type, char *subtype, long size, long flags) {
+  return fux::atmi::exception_boundary(
+      [&] { return fux::mem::tpallocx(type, subtype, size, flags); }, nullptr);
+}
+
 char *tprealloc(char *ptr, long size) {
   return fux::atmi::exception_boundary(
       [&] { return fux::mem::tprealloc(ptr, size); }, nullptr);
@@ -306,3 +944,8 @@ int tpexport(char *ibuf, long ilen, char *ostr, long *olen, long flags) {
   return fux::atmi::exception_boundary(
       [&] { return fux::mem::tpexport(ibuf, ilen, ostr, olen, flags); }, -1);
 }
+
+int tpregistertype(struct tmtype_sw_t *typesw) {
+  return fux::atmi::exception_boundary(
+      [&] { return fux::mem::tpregistertype(typesw); }, -1);
+}
@@ -0,0 +1,172 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include "metrics.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <userlog.h>
+
+#include <cstring>
+#include <vector>
+
+#include "mib.h"
+#include "misc.h"
+
+namespace fux::metrics {
+
+static constexpr int max_attempts = 100;
+
+template <size_t N>
+static void copy_str(const char *src, char (&dst)[N]) {
+  size_t n = strnlen(src, N - 1);
+  memcpy(dst, src, n);
+  dst[n] = '\0';
+}
+
+static void copy_counters(const request_counters &from, const latencies &lat,
+                          counters &to) {
+  to.done = from.done.load(std::memory_order_relaxed);
+  to.load = from.load.load(std::memory_order_relaxed);
+  to.failed = from.failed.load(std::memory_order_relaxed);
+  to.inflight = from.inflight.load(std::memory_order_relaxed);
+  const double p[] = {0.5, 0.99, 0.999};
+  for (int i = 0; i < 3; i++) {
+    to.wait[i] = lat.wait.percentile(p[i]);
+    to.service[i] = lat.service.percentile(p[i]);
+    to.cpu[i] = lat.cpu.percentile(p[i]);
+  }
+}
+
+ssize_t snapshot(::mib &m, void *buf, size_t size) {
+  for (int attempt = 0; attempt < max_attempts; attempt++) {
+    auto seq = m->seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      sched_yield();
+      continue;
+    }
+
+    auto servers = m.servers();
+    auto services = m.services();
+    size_t nservers = servers.length();
+    size_t nservices = services.length();
+    size_t needed = sizeof(header) + nservers * sizeof(server_entry) +
+                    nservices * sizeof(service_entry);
+    if (needed > size) {
+      return needed;
+    }
+
+    auto h = static_cast<header *>(buf);
+    h->servers = 0;
+    for (size_t i = 0; i < nservers; i++) {
+      auto &srv = servers.at(i);
+      if (srv.state == state_t::INValid) {
+        continue;
+      }
+      auto &e = fux::metrics::servers(h)[h->servers++];
+      copy_str(srv.servername, e.name);
+      copy_str(m.queues().at(srv.rqaddr).rqaddr, e.rqaddr);
+      e.grpno = srv.grpno;
+      e.srvid = srv.srvid;
+      e.pid = srv.pid;
+      copy_str(to_string(srv.state), e.state);
+      copy_counters(srv.counters, srv.latency, e.c);
+    }
+    h->services = 0;
+    for (size_t i = 0; i < nservices; i++) {
+      auto &svc = services.at(i);
+      if (svc.state == state_t::INValid) {
+        continue;
+      }
+      auto &e = fux::metrics::services(h)[h->services++];
+      copy_str(svc.servicename, e.name);
+      copy_str(to_string(svc.state), e.state);
+      copy_counters(svc.counters, svc.latency, e.c);
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (m->seq.load(std::memory_order_relaxed) != seq) {
+      continue;
+    }
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    h->version = version;
+    h->seq = seq;
+    h->time = uint64_t(tv.tv_sec) * 1000000 + tv.tv_usec;
+    return needed;
+  }
+  return -1;
+}
+
+static void format(std::string &out, const std::string &prefix,
+                   const counters &c) {
+  auto put = [&](const char *key, unsigned long long value) {
+    out += prefix + key + "=" + std::to_string(value) + "\n";
+  };
+  put("done", c.done);
+  put("load", c.load);
+  put("failed", c.failed);
+  out += prefix + "inflight=" + std::to_string(c.inflight) + "\n";
+  const char *p[] = {"p50", "p99", "p999"};
+  for (int i = 0; i < 3; i++) {
+    put((std::string("wait_") + p[i]).c_str(), c.wait[i]);
+    put((std::string("svc_") + p[i]).c_str(), c.service[i]);
+    put((std::string("cpu_") + p[i]).c_str(), c.cpu[i]);
+  }
+}
+
+std::string format(header *h) {
+  std::string out;
+  out += "version=" + std::to_string(h->version) + "\n";
+  out += "seq=" + std::to_string(h->seq) + "\n";
+  out += "time=" + std::to_string(h->time) + "\n";
+  for (uint32_t i = 0; i < h->servers; i++) {
+    auto &e = servers(h)[i];
+    auto prefix = "server." + std::to_string(e.grpno) + "." +
+                  std::to_string(e.srvid) + ".";
+    out += prefix + "name=" + e.name + "\n";
+    out += prefix + "rqaddr=" + e.rqaddr + "\n";
+    out += prefix + "pid=" + std::to_string(e.pid) + "\n";
+    out += prefix + "state=" + e.state + "\n";
+    format(out, prefix, e.c);
+  }
+  for (uint32_t i = 0; i < h->services; i++) {
+    auto &e = services(h)[i];
+    auto prefix = std::string("service.") + e.name + ".";
+    out += prefix + "state=" + e.state + "\n";
+    format(out, prefix, e.c);
+  }
+  return out;
+}
+
+void dump(::mib &m, const std::string &path) {
+  static thread_local std::vector<char> buf(64 * 1024);
+  ssize_t n;
+  while ((n = snapshot(m, buf.data(), buf.size())) > ssize_t(buf.size())) {
+    buf.resize(n);
+  }
+  if (n == -1) {
+    return;
+  }
+
+  // Readers never see a partly written file
+  auto text = format(reinterpret_cast<header *>(buf.data()));
+  auto tmp = path + ".tmp";
+  auto f = fopen(tmp.c_str(), "w");
+  if (f == nullptr) {
+    userlog("Failed to write %s: %s", tmp.c_str(), strerror(errno));
+    return;
+  }
+  fwrite(text.data(), 1, text.size(), f);
+  if (fclose(f) != 0 || rename(tmp.c_str(), path.c_str()) == -1) {
+    userlog("Failed to write %s: %s", path.c_str(), strerror(errno));
+  }
+}
+
+}  // namespace fux::metrics
+
+ssize_t fuxmetrics_snapshot(void *buf, size_t size) {
+  return fux::atmi::exception_boundary(
+      [&] { return fux::metrics::snapshot(getmib(), buf, size); }, -1);
+}
@@ -0,0 +1,34 @@
+#pragma once
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <fuxmetrics.h>
+
+#include <cstdint>
+#include <string>
+
+class mib;
+
+// C++ names of the layout in fuxmetrics.h
+namespace fux::metrics {
+
+constexpr uint32_t version = FUXMETRICS_VERSION;
+
+using counters = fuxmetrics_counters;
+using server_entry = fuxmetrics_server;
+using service_entry = fuxmetrics_service;
+using header = fuxmetrics_header;
+
+inline server_entry *servers(header *h) { return fuxmetrics_servers(h); }
+inline service_entry *services(header *h) { return fuxmetrics_services(h); }
+
+// Copies counters of all servers and services into buf. Returns the size
+// needed, the copy is done only if it fits. Returns -1 if the MIB kept
+// changing while copying.
+ssize_t snapshot(::mib &m, void *buf, size_t size);
+// One key=value line per counter
+std::string format(header *h);
+// Replaces the file with the current snapshot in format()
+void dump(::mib &m, const std::string &path);
+
+}  // namespace fux::metrics
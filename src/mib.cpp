@@ -11,7 +11,9 @@
 #include <stdexcept>
 #include <string>
 
+#include <fcntl.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <iterator>
@@ -99,29 +101,75 @@ size_t init(T &t, size_t size, size_t off) {
   return nearest64(t.size * sizeof(typename T::value_type));
 }
 
+size_t init(mibidx &t, size_t entries, size_t off) {
+  t.size = mibidxptr::slots(entries);
+  t.off = off;
+  return nearest64(t.size * sizeof(uint32_t));
+}
+
+// FNV-1a
+static uint64_t hash(const std::string_view &s) {
+  uint64_t h = 14695981039346656037ULL;
+  for (auto c : s) {
+    h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+  }
+  return h;
+}
+
+static uint64_t hash(const char *s) { return hash(std::string_view(s)); }
+
+static uint64_t hash(uint64_t v) {
+  v *= 0x9e3779b97f4a7c15ULL;
+  return v ^ (v >> 32);
+}
+
+static uint64_t hash(uint16_t srvid, uint16_t grpno) {
+  return hash((uint64_t(grpno) << 16) | srvid);
+}
+
 size_t mib::needed(const tuxconfig &cfg) {
   return nearest64(sizeof(mibmem)) +
          nearest64(cfg.maxservers * sizeof(server)) +
          nearest64(cfg.maxqueues * sizeof(queue)) +
          nearest64(cfg.maxservices * sizeof(service)) +
-         nearest64(cfg.maxservers * cfg.maxservices * sizeof(advertisement)) +
+         nearest64(maxadvertisements(cfg) * sizeof(advertisement)) +
          nearest64(cfg.maxgroups * sizeof(group)) +
          nearest64(cfg.maxaccessers * sizeof(accesser)) +
+         nearest64(mibidxptr::slots(cfg.maxgroups) * sizeof(uint32_t)) +
+         nearest64(mibidxptr::slots(cfg.maxgroups) * sizeof(uint32_t)) +
+         nearest64(mibidxptr::slots(cfg.maxservers) * sizeof(uint32_t)) +
+         nearest64(mibidxptr::slots(cfg.maxqueues) * sizeof(uint32_t)) +
+         nearest64(mibidxptr::slots(cfg.maxservices) * sizeof(uint32_t)) +
          nearest64(transaction_table::needed(100, cfg.maxgroups));
 }
 
 void mib::init_memory() {
+  mem_->seq = 0;
   auto off = nearest64(sizeof(mibmem));
   off += init(mem_->servers, cfg_.maxservers, off - offsetof(mibmem, servers));
   off += init(mem_->queues, cfg_.maxqueues, off - offsetof(mibmem, queues));
   off +=
       init(mem_->services, cfg_.maxservices, off - offsetof(mibmem, services));
   off += init(mem_->groups, cfg_.maxgroups, off - offsetof(mibmem, groups));
-  off += init(mem_->advertisements, cfg_.maxservers * cfg_.maxservices,
+  off += init(mem_->advertisements, maxadvertisements(cfg_),
               off - offsetof(mibmem, advertisements));
+  mem_->free_advertisements = badoff;
   off += init(mem_->accessers, cfg_.maxaccessers,
               off - offsetof(mibmem, accessers));
 
+  auto index = [&](mibidx &idx, size_t entries) {
+    auto start = off;
+    off += init(idx, entries,
+                start - (reinterpret_cast<char *>(&idx) -
+                         reinterpret_cast<char *>(mem_)));
+    memset(reinterpret_cast<char *>(mem_) + start, 0, off - start);
+  };
+  index(mem_->groups_index, cfg_.maxgroups);
+  index(mem_->srvgrps_index, cfg_.maxgroups);
+  index(mem_->servers_index, cfg_.maxservers);
+  index(mem_->queues_index, cfg_.maxqueues);
+  index(mem_->services_index, cfg_.maxservices);
+
   mem_->transactions_off = off;
   transactions().init(100, cfg_.maxgroups);
 
@@ -130,10 +178,10 @@ void mib::init_memory() {
 }
 
 size_t mib::find_advertisement(size_t service, size_t queue, size_t server) {
-  for (size_t i = 0; i < advertisements()->len; i++) {
+  for (auto i = services().at(service).advertisements; i != badoff;
+       i = advertisements().at(i).next) {
     auto &advertisement = advertisements().at(i);
-    if (advertisement.service == service && advertisement.queue == queue &&
-        advertisement.server == server) {
+    if (advertisement.queue == queue && advertisement.server == server) {
       return i;
     }
   }
@@ -151,23 +199,28 @@ void mib::advertise(const std::string &servicename, size_t queue,
     throw std::logic_error("Already advertised");
   }
 
-  auto i = find_advertisement(badoff, badoff, badoff);
+  auto i = mem_->free_advertisements;
   if (i == badoff) {
     i = advertisements()->len;
   }
 
   auto &advertisement = advertisements().at(i);
+  if (i == advertisements()->len) {
+    advertisements()->len++;
+  } else {
+    mem_->free_advertisements = advertisement.next;
+  }
 
+  auto &svc = services().at(service);
   advertisement.service = service;
   advertisement.queue = queue;
   advertisement.server = server;
   advertisement.state = state_t::ACTive;
+  advertisement.next = svc.advertisements;
+  svc.advertisements = i;
 
-  if (i == advertisements()->len) {
-    advertisements()->len++;
-  }
-  services().at(service).state = state_t::ACTive;
-  services().at(service).modified();
+  svc.state = state_t::ACTive;
+  svc.modified();
 }
 
 void mib::unadvertise(const std::string &servicename, size_t queue,
@@ -177,24 +230,34 @@ void mib::unadvertise(const std::string &servicename, size_t queue,
     throw std::logic_error("Unknown service");
   }
 
-  auto i = find_advertisement(service, queue, server);
-  if (i == badoff) {
+  auto &svc = services().at(service);
+  auto *link = &svc.advertisements;
+  while (*link != badoff) {
+    auto &advertisement = advertisements().at(*link);
+    if (advertisement.queue == queue && advertisement.server == server) {
+      break;
+    }
+    link = &advertisement.next;
+  }
+  if (*link == badoff) {
     throw std::logic_error("Service not advertised");
   }
+
+  auto i = *link;
   auto &advertisement = advertisements().at(i);
+  *link = advertisement.next;
   advertisement.state = state_t::INValid;
   advertisement.service = advertisement.queue = advertisement.server = badoff;
+  advertisement.next = mem_->free_advertisements;
+  mem_->free_advertisements = i;
 
-  services().at(service).modified();
+  svc.modified();
 }
 
 size_t mib::find_queue(const std::string &rqaddr) {
-  for (size_t i = 0; i < queues()->len; i++) {
-    if (rqaddr == queues().at(i).rqaddr) {
-      return i;
-    }
-  }
-  return badoff;
+  return index(mem_->queues_index).find(hash(rqaddr.c_str()), [&](size_t i) {
+    return rqaddr == queues().at(i).rqaddr;
+  });
 }
 
 size_t mib::make_queue(const std::string &rqaddr) {
@@ -205,29 +268,24 @@ size_t mib::make_queue(const std::string &rqaddr) {
   auto &queue = queues().at(queues()->len);
   checked_copy(rqaddr, queue.rqaddr);
   queue.msqid = -1;
+  queue.shm = false;
+  queue.shards = 1;
   queue.mtype = std::numeric_limits<long>::max();
 
+  index(mem_->queues_index).insert(hash(queue.rqaddr), queues()->len);
   return queues()->len++;
 }
 
 size_t mib::group_index(const std::string_view &srvgrp) {
-  for (size_t i = 0; i < groups()->len; i++) {
-    auto &group = groups().at(i);
-    if (group.srvgrp == srvgrp) {
-      return i;
-    }
-  }
-  return badoff;
+  return index(mem_->srvgrps_index).find(hash(srvgrp), [&](size_t i) {
+    return groups().at(i).srvgrp == srvgrp;
+  });
 }
 
 size_t mib::find_group(uint16_t grpno) {
-  for (size_t i = 0; i < groups()->len; i++) {
-    auto &group = groups().at(i);
-    if (group.grpno == grpno) {
-      return i;
-    }
-  }
-  return badoff;
+  return index(mem_->groups_index).find(hash(grpno), [&](size_t i) {
+    return groups().at(i).grpno == grpno;
+  });
 }
 
 size_t mib::make_group(uint16_t grpno, const std::string &srvgrp,
@@ -245,27 +303,20 @@ size_t mib::make_group(uint16_t grpno, const std::string &srvgrp,
   checked_copy(closeinfo, group.closeinfo);
   checked_copy(tmsname, group.tmsname);
 
+  index(mem_->groups_index).insert(hash(grpno), groups()->len);
+  index(mem_->srvgrps_index).insert(hash(group.srvgrp), groups()->len);
   return groups()->len++;
 }
 
 size_t mib::server_index(uint16_t srvid, size_t group_idx) {
-  for (size_t i = 0; i < servers()->len; i++) {
-    auto &server = servers().at(i);
-    if (server.srvid == srvid && server.group_idx == group_idx) {
-      return i;
-    }
-  }
-  return badoff;
+  return find_server(srvid, groups().at(group_idx).grpno);
 }
 
 size_t mib::find_server(uint16_t srvid, uint16_t grpno) {
-  for (size_t i = 0; i < servers()->len; i++) {
+  return index(mem_->servers_index).find(hash(srvid, grpno), [&](size_t i) {
     auto &server = servers().at(i);
-    if (server.srvid == srvid && server.grpno == grpno) {
-      return i;
-    }
-  }
-  return badoff;
+    return server.srvid == srvid && server.grpno == grpno;
+  });
 }
 
 size_t mib::make_server(uint16_t srvid, uint16_t grpno,
@@ -278,8 +329,12 @@ size_t mib::make_server(uint16_t srvid, uint16_t grpno,
   auto &server = servers().at(servers()->len);
   server.srvid = srvid;
   server.grpno = grpno;
+  if (auto group_idx = find_group(grpno); group_idx != badoff) {
+    server.group_idx = group_idx;
+  }
   checked_copy(servername, server.servername);
   checked_copy(clopt, server.clopt);
+  server.state = state_t::INActive;
 
   server.rqaddr = find_queue(rqaddr);
   if (server.rqaddr == badoff) {
@@ -289,16 +344,14 @@ size_t mib::make_server(uint16_t srvid, uint16_t grpno,
   // FIXME: only active
   queues().at(server.rqaddr).servercnt++;
   queues().at(server.rqaddr).server_idx = servers()->len;
+  index(mem_->servers_index).insert(hash(srvid, grpno), servers()->len);
   return servers()->len++;
 }
 
 size_t mib::find_service(const char *servicename) {
-  for (size_t i = 0; i < services()->len; i++) {
-    if (strcmp(servicename, services().at(i).servicename) == 0) {
-      return i;
-    }
-  }
-  return badoff;
+  return index(mem_->services_index).find(hash(servicename), [&](size_t i) {
+    return strcmp(servicename, services().at(i).servicename) == 0;
+  });
 }
 size_t mib::find_service(const std::string &servicename) {
   return find_service(servicename.c_str());
@@ -318,6 +371,7 @@ size_t mib::make_accesser(pid_t pid) {
   auto &accesser = accessers().at(at);
   accesser.rpid_timeout = INVALID_TIME;
   accesser.pid = pid;
+  accesser.mailbox = -1;
   return at;
 }
 
@@ -374,14 +428,18 @@ size_t mib::make_service(const std::string &servicename) {
   checked_copy("N", service.encryption_required);
   checked_copy("NOCONVERT", service.buftypeconv);
   checked_copy("", service.cachingname);
+  service.generation = genuid();
+  service.advertisements = badoff;
 
+  index(mem_->services_index).insert(hash(service.servicename),
+                                     services()->len);
   return services()->len++;
 }
 
 int mib::make_service_rqaddr(size_t server) {
   auto &queue = queues().at(servers().at(server).rqaddr);
   if (queue.msqid == -1) {
-    queue.msqid = fux::ipc::qcreate();
+    queue.msqid = fux::ipc::qcreate(queue.shm, queue.shards);
     if (queue.msqid == -1) {
       throw std::system_error(errno, std::system_category());
     }
@@ -408,15 +466,21 @@ void mib::collect(std::vector<int> &q, std::vector<int> &m,
     if (acc.rpid != -1) {
       q.push_back(acc.rpid);
     }
+    if (acc.mailbox != -1) {
+      m.push_back(acc.mailbox);
+    }
   }
   s.push_back(mem_->mainsem);
+  if (mem_->blobs != -1) {
+    m.push_back(mem_->blobs);
+  }
   m.push_back(shmid_);
 }
 
 void mib::remove(std::vector<int> &q, std::vector<int> &m,
                  std::vector<int> &s) {
   for (int i : q) {
-    msgctl(i, IPC_RMID, NULL);
+    fux::ipc::qdelete(i);
   }
   for (int i : s) {
     fux::ipc::semrm(i);
@@ -447,6 +511,49 @@ mib &getmib() {
   return *mibcon.get();
 }
 
+std::vector<std::string> server_argv(const server &srv) {
+  return {srv.servername,           "-g", std::to_string(srv.grpno), "-i",
+          std::to_string(srv.srvid), "-A"};
+}
+
+static void redirect(int fd, int target) {
+  if (fd == -1 || dup2(fd, target) == -1) {
+    _exit(-1);
+  }
+  if (fd != target) {
+    close(fd);
+  }
+}
+
+pid_t start_server(mib &m, server &srv) {
+  auto args = server_argv(srv);
+  std::vector<char *> argv;
+  for (auto &arg : args) {
+    argv.push_back(&arg[0]);
+  }
+  argv.push_back(nullptr);
+
+  {
+    auto lock = m.data_lock();
+    srv.state = state_t::INActive;
+  }
+  auto pid = fork();
+  if (pid == 0) {
+    // Callers may have other threads, only async-signal-safe calls until exec
+    redirect(open("/dev/null", O_RDONLY), STDIN_FILENO);
+    redirect(open("stdout", O_WRONLY | O_CREAT | O_APPEND, 0666),
+             STDOUT_FILENO);
+    redirect(open("stderr", O_WRONLY | O_CREAT | O_APPEND, 0666),
+             STDERR_FILENO);
+    execvp(argv[0], &argv[0]);
+    _exit(-1);
+  } else if (pid > 0) {
+    auto lock = m.data_lock();
+    srv.pid = pid;
+  }
+  return pid;
+}
+
 mib::mib(const tuxconfig &cfg) : cfg_(cfg) {
   shmid_ = shmget(cfg_.ipckey, needed(cfg_), 0600 | IPC_CREAT);
   if (shmid_ == -1) {
@@ -463,17 +570,24 @@ mib::mib(const tuxconfig &cfg) : cfg_(cfg) {
     mem_->mainsem = fux::ipc::seminit(IPC_PRIVATE, 1);
     mem_->conf = cfg_;
     init_memory();
+    mem_->blobs = cfg_.blobsize > 0
+                      ? fux::ipc::blobcreate(size_t(cfg_.blobsize) << 20)
+                      : -1;
     mem_->state = 2;
   }
 
   while (mem_->state != 2) {
     std::this_thread::yield();
   }
+  if (mem_->blobs != -1) {
+    fux::ipc::blobattach(mem_->blobs);
+  }
 }
 
 mib::mib(const tuxconfig &cfg, fux::mib::in_heap) : cfg_(cfg) {
   mem_ = reinterpret_cast<mibmem *>(calloc(1, needed(cfg_)));
   init_memory();
+  mem_->blobs = -1;
 }
 
 uint64_t mib::genuid() {
@@ -60,12 +60,65 @@ class mibarrptr {
   mibarr<T> *p_;
 };
 
+// Open addressing hash index of a mibarr with linear probing. Slots hold the
+// entry position + 1 and 0 marks an empty slot. Entries are never removed
+// from indexed arrays, so a lookup stops at the first empty slot. There are
+// at least twice as many slots as entries.
+struct mibidx {
+  size_t off;
+  size_t size;
+};
+
+class mibidxptr {
+ public:
+  mibidxptr(mibidx *p) : p_(p) {}
+
+  static size_t slots(size_t entries) {
+    size_t n = 2;
+    while (n < 2 * entries) {
+      n <<= 1;
+    }
+    return n;
+  }
+
+  template <typename Match>
+  size_t find(uint64_t hash, Match &&match) const {
+    auto slot = data();
+    for (size_t i = hash & (p_->size - 1);; i = (i + 1) & (p_->size - 1)) {
+      if (slot[i] == 0) {
+        return std::numeric_limits<size_t>::max();
+      }
+      if (match(slot[i] - 1)) {
+        return slot[i] - 1;
+      }
+    }
+  }
+  void insert(uint64_t hash, size_t pos) {
+    auto slot = data();
+    size_t i = hash & (p_->size - 1);
+    while (slot[i] != 0) {
+      i = (i + 1) & (p_->size - 1);
+    }
+    slot[i] = pos + 1;
+  }
+
+ private:
+  uint32_t *data() const {
+    return reinterpret_cast<uint32_t *>(reinterpret_cast<char *>(p_) +
+                                        p_->off);
+  }
+  mibidx *p_;
+};
+
 struct mibmem {
   std::atomic<int> state;
   int mainsem;
 
   uint32_t host;
   uint32_t counter __attribute__((aligned(64)));
+  // Odd while the data lock is held, snapshot readers retry until it is even
+  // and unchanged
+  std::atomic<uint64_t> seq __attribute__((aligned(64)));
 
   tuxconfig conf;
   t_domain domain;
@@ -77,6 +130,17 @@ struct mibmem {
   mibarr<service> services;
   mibarr<advertisement> advertisements;
   mibarr<accesser> accessers;
+  // Unadvertised entries reused before the array grows
+  size_t free_advertisements;
+
+  mibidx groups_index;
+  // Groups by SRVGRP name
+  mibidx srvgrps_index;
+  mibidx servers_index;
+  mibidx queues_index;
+  mibidx services_index;
+
+  int blobs;
 
   size_t transactions_off;
   char data[];
@@ -116,12 +180,37 @@ rhs) { return ptr_ != rhs.ptr_; } private: pointer ptr_;
         };
 */
 
+// Data lock that also marks the change for snapshot readers. Sequence left
+// odd by a process that died holding the lock is fixed by the next holder.
+class scoped_datalock {
+ public:
+  explicit scoped_datalock(mibmem *mem)
+      : lock_(mem->mainsem, 0),
+        seq_(mem->seq),
+        odd_(seq_.load(std::memory_order_relaxed) | 1) {
+    seq_.store(odd_, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+  ~scoped_datalock() { seq_.store(odd_ + 1, std::memory_order_release); }
+  scoped_datalock(scoped_datalock &&) = delete;
+  scoped_datalock &operator=(scoped_datalock &&) = delete;
+
+ private:
+  fux::ipc::scoped_semlock lock_;
+  std::atomic<uint64_t> &seq_;
+  const uint64_t odd_;
+};
+
 class mib {
  public:
   mib(const tuxconfig &cfg);
   mib(const tuxconfig &cfg, fux::mib::in_heap);
 
   static size_t needed(const tuxconfig &cfg);
+  static size_t maxadvertisements(const tuxconfig &cfg) {
+    return cfg.maxadvertisements != 0 ? cfg.maxadvertisements
+                                      : cfg.maxservices + 16 * cfg.maxservers;
+  }
 
   void validate();
   void remove();
@@ -180,9 +269,7 @@ class mib {
 
   int make_service_rqaddr(size_t server);
 
-  fux::ipc::scoped_semlock data_lock() {
-    return fux::ipc::scoped_semlock(mem_->mainsem, 0);
-  }
+  scoped_datalock data_lock() { return scoped_datalock(mem_); }
 
   constexpr static size_t badoff = std::numeric_limits<size_t>::max();
 
@@ -192,6 +279,7 @@ class mib {
  private:
   size_t find_advertisement(size_t service, size_t queue, size_t server);
   void init_memory();
+  static mibidxptr index(mibidx &idx) { return mibidxptr(&idx); }
 
   tuxconfig cfg_;
   int shmid_;
@@ -200,6 +288,13 @@ class mib {
 
 mib &getmib();
 std::string getubb();
+
+// Command line servers are started with
+std::vector<std::string> server_argv(const server &srv);
+// Forks and executes the server with stdin from /dev/null and output appended
+// to files stdout and stderr. State and pid are updated under the data lock.
+// Returns the pid or -1 with errno set.
+pid_t start_server(mib &m, server &srv);
 namespace fux::tx {
 extern uint16_t grpno;
 }
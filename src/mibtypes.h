@@ -2,8 +2,10 @@
 // This file is part of Fuxedo
 // Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cmath>
 #include <cstdint>
 #include <limits>
 #include <thread>
@@ -22,12 +24,14 @@ struct transaction_table;
 struct accesser {
   pid_t pid;
   int rpid;
+  int mailbox;
   std::chrono::steady_clock::time_point rpid_timeout;
 
   bool valid() const { return pid != 0; }
   void invalidate() {
     pid = 0;
     rpid = -1;
+    mailbox = -1;
   }
 };
 
@@ -62,6 +66,9 @@ struct t_machine {
   char ulogpfx[256];
   char tlogdevice[256];
   long blocktime;
+  // TMTRACE set through tpadmcall, processes check the revision
+  char tmtrace[64];
+  std::atomic<uint32_t> tmtrace_revision;
 };
 
 struct group {
@@ -86,6 +93,86 @@ enum class state_t : uint8_t {
   undefined
 };
 
+// Updated by dispatch threads of all servers without locks, each set in its
+// own cache line
+struct alignas(64) request_counters {
+  std::atomic<uint64_t> done;
+  // Requests done weighted by LOAD of the service
+  std::atomic<uint64_t> load;
+  std::atomic<uint64_t> failed;
+  std::atomic<int64_t> inflight;
+};
+
+// Typed buffers of a server by type, kept up to date by the server itself
+struct buffer_counters {
+  char type[8];
+  char subtype[16];
+  std::atomic<int64_t> outstanding;
+  std::atomic<int64_t> peak;
+};
+// Types registered later than that are not published
+constexpr size_t max_buftypes = 16;
+
+// Log-linear histogram of microseconds with 4 buckets per power of two, the
+// error of a percentile is below 25%
+struct alignas(64) histogram {
+  static constexpr size_t buckets = 160;
+  std::atomic<uint64_t> counts[buckets];
+
+  static size_t bucket(uint64_t v) {
+    if (v < 4) {
+      return v;
+    }
+    size_t e = 63 - __builtin_clzll(v);
+    return std::min(buckets - 1, (e - 1) * 4 + ((v >> (e - 2)) & 3));
+  }
+  // Largest value that falls into bucket b
+  static uint64_t upper(size_t b) {
+    if (b < 4) {
+      return b;
+    }
+    size_t e = b / 4 + 1;
+    return ((4 + b % 4 + 1) << (e - 2)) - 1;
+  }
+
+  void record(uint64_t v) {
+    counts[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+  }
+  // Upper bound of the p-th percentile (0 < p <= 1), 0 without values
+  uint64_t percentile(double p) const {
+    uint64_t total = 0;
+    for (auto &c : counts) {
+      total += c.load(std::memory_order_relaxed);
+    }
+    uint64_t rank = std::max<uint64_t>(1, std::ceil(p * total)), seen = 0;
+    for (size_t b = 0; b < buckets && total > 0; b++) {
+      seen += counts[b].load(std::memory_order_relaxed);
+      if (seen >= rank) {
+        return upper(b);
+      }
+    }
+    return 0;
+  }
+  void reset() {
+    for (auto &c : counts) {
+      c.store(0, std::memory_order_relaxed);
+    }
+  }
+};
+
+// Time requests waited in the queue, spent in the service and on CPU
+struct latencies {
+  histogram wait;
+  histogram service;
+  histogram cpu;
+
+  void reset() {
+    wait.reset();
+    service.reset();
+    cpu.reset();
+  }
+};
+
 struct server {
   uint16_t group_idx;
   uint16_t srvid;
@@ -115,6 +202,9 @@ struct server {
   uint16_t maxgen;
   long threadstacksize;
   bool conv;
+  request_counters counters;
+  latencies latency;
+  buffer_counters buffers[max_buftypes];
 
   void suspend() { state = state_t::SUSpended; }
 
@@ -124,6 +214,8 @@ struct server {
 struct queue {
   char rqaddr[32];
   int msqid;
+  bool shm;  // RQTRANSPORT=SHM
+  uint16_t shards;  // RQSHARDS
   long mtype;
   long servercnt;
 
@@ -146,6 +238,12 @@ struct service {
   char buftypeconv[10];  // XML2FML, XML2FML32, NOCONVERT
   char cachingname[32];
   uint64_t revision;
+  // Requests carry it along with the index of the entry
+  uint32_t generation;
+  // First advertisement of the service, the rest are linked through next
+  size_t advertisements;
+  request_counters counters;
+  latencies latency;
 
   void modified() { revision++; }
 };
@@ -155,4 +253,6 @@ struct advertisement {
   size_t queue;
   size_t server;
   state_t state;
+  // Next advertisement of the same service or next free one
+  size_t next;
 };
@@ -123,6 +123,11 @@ std::string join(const T &container, const std::string &sep) {
 size_t base64encode(const void *ibuf, size_t ilen, char *obuf, size_t olen);
 size_t base64decode(const char *ibuf, size_t ilen, void *obuf, size_t olen);
 
+// Instruction set used by base64encode/base64decode, the best one supported by
+// CPU is selected at startup. Switching is meant for tests and benchmarks.
+enum class base64isa { scalar, sse41, avx2 };
+bool base64use(base64isa isa);
+
 constexpr size_t base64chars(size_t ilen) {
   auto blocks = ilen / 3;
   auto needed = blocks * 4;
@@ -138,10 +143,47 @@ struct cmp_cstr {
   }
 };
 
+struct buffer_counters;
+
 namespace fux {
 namespace mem {
 void setowner(char *ptr, char **owner);
 long bufsize(char *ptr, long used = -1);
+
+// Typed buffers have room for the IPC message header right before their
+// exported image. Returns the start of the message when the buffer can be
+// sent in place (nullptr for types that need encoding), sets size to the
+// size of the image and shared if the buffer is in shared memory.
+char *msgout(char *ptr, long used, long *size, bool *shared);
+// Makes room for an image of size bytes, *ptr may move. Returns the start of
+// the message.
+char *msgin(char **ptr, long size);
+// Turns an image received in place into buffer contents, returns the length
+// of data or -1.
+long msgimport(char **ptr, long size);
+
+// Shared memory buffers are handed over to other processes as they are.
+// Copy of the buffer in shared memory for the caller that keeps ptr
+char *msgdup(char *ptr, long used);
+// Buffer no longer belongs to this process
+void handover(char *ptr);
+// Takes over a buffer handed over by another process given the start and
+// size of the message in it. Returns the buffer and sets len to the length
+// of data.
+char *adopt(char *start, long size, long *len);
+// Frees *ptr and replaces it with buffer with, the owner of *ptr moves along
+void replace(char **ptr, char *with);
+
+struct tpstats {
+  std::string type;
+  std::string subtype;
+  long outstanding;
+  long peak;
+};
+// Counters of this process
+std::vector<tpstats> stats();
+// Keeps counters of the first n types in slots too, for others to read
+void publish(buffer_counters *slots, size_t n);
 }  // namespace mem
 }  // namespace fux
 
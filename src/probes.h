@@ -0,0 +1,24 @@
+#pragma once
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+// USDT probes of provider "fuxedo" for perf, bpftrace and SystemTap. They cost
+// a nop when nobody is attached and compile to nothing without <sys/sdt.h>.
+//
+// tpacall          service, cd, message size, gttid
+// dequeue          service, cd, data length, gttid
+// service__entry   service, cd, data length, gttid
+// service__return  service, cd, rval, gttid
+// tpreturn         service, cd, message size, gttid
+// tpgetrply        cd, message size, rval
+// qsend__spill     file name, cd, message size, gttid
+// xa_open ... xa_rollback   rmid, flags, return code
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define FUXPROBE(name, args...) STAP_PROBEV(fuxedo, name, ##args)
+#else
+#define FUXPROBE(name, args...) \
+  do {                          \
+  } while (0)
+#endif
@@ -7,21 +7,30 @@
 #include <xa.h>
 #include <xatmi.h>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <clara.hpp>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <iostream>
 #include <limits>
 #include <map>
 #include <memory>
+#include <set>
+#include <string>
 #include <thread>
 #include <vector>
 
+#include "flight.h"
 #include "fux.h"
 #include "ipc.h"
 #include "mib.h"
 #include "misc.h"
+#include "probes.h"
+#include "slowlog.h"
+#include "trace.h"
 #include "trx.h"
 
 #if defined(__cplusplus)
@@ -64,9 +73,34 @@ void tpsvrthrdone() {
 
 void ubb2mib(ubbconfig &u, mib &m);
 
-int get_queue(const char *svc);
+int get_queue(const char *svc, fux::ipc::msg &req);
+
+// Request received ahead and waiting in the run queue of a dispatch thread
+struct request {
+  fux::ipc::msg hdr;
+  char *data;
+  long len;
+
+  request() : data(nullptr), len(0) {}
+  request(request &&other) : hdr(std::move(other.hdr)), len(other.len) {
+    data = other.data;
+    other.data = nullptr;
+  }
+  ~request() {
+    if (data != nullptr) {
+      tpfree(data);
+    }
+  }
+  request(const request &) = delete;
+  request &operator=(const request &) = delete;
+};
+
+struct server_thread;
 
 struct server_main {
+  // Requests a dispatch thread takes per wakeup
+  static constexpr size_t max_batch = 8;
+
   uint16_t srvid;
   uint16_t grpno;
 
@@ -78,19 +112,56 @@ struct server_main {
   int argc;
   char **argv;
   struct tmsvrargs_t *tmsvrargs;
+  // Dispatch threads running now
+  std::atomic<size_t> threads;
+
+  // Dispatch threads of multithreaded servers by index. Pool grows when all
+  // threads were busy or requests waited for pool_grow ticks in a row. A
+  // thread idle for pool_idle retires while there are more than the minimum.
+  static constexpr auto pool_tick = std::chrono::milliseconds(100);
+  static constexpr int pool_grow = 3;
+  static constexpr auto pool_idle = std::chrono::seconds(30);
+  std::map<size_t, std::thread> pool;
+  // Indices of threads that have left, protected by mutex
+  std::vector<size_t> exited;
+  int pressure;
+
+  struct dispatch_entry {
+    uint32_t generation;
+    const char *name;
+    void (*func)(TPSVCINFO *);
+  };
 
   std::mutex mutex;
   std::map<const char *, void (*)(TPSVCINFO *), cmp_cstr> advertisements;
+  // Advertised services by MIB service index, sized for all services at start
+  // so that dispatch threads do not need the mutex. Entries are published
+  // whole and, like the service names, kept for the life of the process
+  // because dispatch threads may still use one that was replaced.
+  std::vector<std::atomic<const dispatch_entry *>> dispatch_table;
+  // Protected by mutex
+  std::deque<dispatch_entry> dispatch_entries;
+  std::set<std::string, std::less<>> names;
+  // Threads in dispatch(), protected by mutex
+  std::vector<server_thread *> dispatchers;
 
   mib &m_;
   std::atomic<bool> stop;
 
-  server_main(mib &m) : m_(m), stop(false), req_counter_(0) {
-    mtype_ = std::numeric_limits<long>::min();
-  }
+  server_main(mib &m)
+      : threads(1),
+        pressure(0),
+        dispatch_table(m.services().size()),
+        m_(m),
+        stop(false),
+        mtype_(std::numeric_limits<long>::min()) {}
 
   void active() { m_.servers().at(mib_server).state = state_t::ACTive; }
-  void inactive() { m_.servers().at(mib_server).state = state_t::INActive; }
+  void inactive() {
+    auto &server = m_.servers().at(mib_server);
+    server.state = state_t::INActive;
+    server.curdispatchthreads = 0;
+  }
 
   int tpadvertisex(const char *svcname, void (*func)(TPSVCINFO *), long flags) {
     // TODO: flags
@@ -122,14 +193,21 @@ struct server_main {
         return -1;
       }
     } else {
+      size_t service;
       try {
         auto lock = m_.data_lock();
         m_.advertise(svcname, mib_queue, mib_server);
+        service = m_.find_service(svcname);
       } catch (const std::out_of_range &e) {
         TPERROR(TPELIMIT, "%s", e.what());
         return -1;
       }
-      advertisements.insert(std::make_pair(strdup(svcname), func));
+      auto name = names.emplace(svcname).first->c_str();
+      advertisements.insert(std::make_pair(name, func));
+      dispatch_entries.push_back(
+          {m_.services().at(service).generation, name, func});
+      dispatch_table.at(service).store(&dispatch_entries.back(),
+                                       std::memory_order_release);
     }
     return 0;
   }
@@ -143,9 +221,14 @@ struct server_main {
     auto it = advertisements.find(svcname);
 
     if (it != advertisements.end()) {
-      auto freeme = it->first;
+      for (auto &slot : dispatch_table) {
+        auto e = slot.load(std::memory_order_relaxed);
+        if (e != nullptr && e->name == it->first) {
+          slot.store(nullptr, std::memory_order_release);
+        }
+      }
       advertisements.erase(it);
-      free(const_cast<char *>(freeme));
+      auto lock = m_.data_lock();
       m_.unadvertise(svcname, mib_queue, mib_server);
     } else {
       TPERROR(TPENOENT, "svcname not advertised");
@@ -154,10 +237,105 @@ struct server_main {
     return 0;
   }
 
+  // Service a request is addressed to, func is null if not advertised
+  dispatch_entry lookup(fux::ipc::msg &req) {
+    auto &hdr = req.as_msgmem();
+    if (hdr.service < dispatch_table.size()) {
+      auto e = dispatch_table[hdr.service].load(std::memory_order_acquire);
+      if (e != nullptr && e->generation == hdr.generation) {
+        return *e;
+      }
+    }
+    // Stale index, fall back to the name of the service
+    fux::scoped_fuxlock lock(mutex);
+    if (hdr.service < m_.services()->len) {
+      auto it = advertisements.find(m_.services().at(hdr.service).servicename);
+      if (it != advertisements.end()) {
+        return {hdr.generation, it->first, it->second};
+      }
+    }
+    return {0, nullptr, nullptr};
+  }
+
+  // Microseconds of a request for the latency histograms
+  struct timing {
+    uint64_t wait;
+    uint64_t start;
+    uint64_t cpu;
+    // Filled by finished()
+    uint64_t elapsed;
+    uint64_t cpu_used;
+  };
+
+  static uint64_t cpu_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  timing started(uint32_t service, uint64_t enqueued) {
+    m_.servers().at(mib_server).counters.inflight++;
+    m_.services().at(service).counters.inflight++;
+    auto now = fux::ipc::now_us();
+    return {enqueued != 0 && enqueued < now ? now - enqueued : 0, now,
+            cpu_us(), 0, 0};
+  }
+  void finished(uint32_t service, bool failed, timing &t) {
+    auto elapsed = t.elapsed = fux::ipc::now_us() - t.start;
+    auto cpu = t.cpu_used = cpu_us() - t.cpu;
+    auto &s = m_.services().at(service);
+    for (auto c : {&m_.servers().at(mib_server).counters, &s.counters}) {
+      c->inflight--;
+      c->done++;
+      c->load += s.load;
+      if (failed) {
+        c->failed++;
+      }
+    }
+    for (auto l : {&m_.servers().at(mib_server).latency, &s.latency}) {
+      l->wait.record(t.wait);
+      l->service.record(elapsed);
+      l->cpu.record(cpu);
+    }
+  }
+
+  // Service time in microseconds above which requests go to the slow log,
+  // 0 if the service has no SVCTIMEOUT
+  uint64_t slow_threshold(uint32_t service) {
+    auto svctimeout = m_.services().at(service).svctimeout;
+    return svctimeout > 0 ? svctimeout * 1000000 : 0;
+  }
+
+  void slow(const TPSVCINFO &svcinfo, fux::ipc::msg &req, int rval,
+            const timing &t, std::vector<char> &&snapshot) {
+    if (!fux::slowlog::admit()) {
+      return;
+    }
+    fux::slowlog::record r;
+    r.service = svcinfo.name;
+    r.cd = req->cd;
+    r.gttid = req->flags & TPTRAN ? req->gttid : fux::bad_gttid;
+    r.caller = 0;
+    if (req->replyq != -1) {
+      auto accessers = m_.accessers();
+      for (size_t i = 0; i < accessers.length(); i++) {
+        if (accessers.at(i).valid() && accessers.at(i).rpid == req->replyq) {
+          r.caller = accessers.at(i).pid;
+          break;
+        }
+      }
+    }
+    r.rval = rval;
+    r.wait = t.wait;
+    r.elapsed = t.elapsed;
+    r.cpu = t.cpu_used;
+    r.data = std::move(snapshot);
+    fux::slowlog::submit(std::move(r));
+  }
+
   bool handle(long mtype, fux::fml32buf &buf) {
     // Do not want to see this message again
     mtype_ = -(mtype - 1);
-    req_counter_ = 0;
 
     if (buf.get<long>(TA_SRVID, 0) == srvid &&
         buf.get<long>(TA_GRPNO, 0) == grpno) {
@@ -167,18 +345,39 @@ struct server_main {
     return false;
   }
 
-  long mtype() {
-    req_counter_ = (req_counter_ + 1) % 8;
-    if (req_counter_ == 0) {
+  // Servers configured before MAXDISPATCHTHREADS ran MINDISPATCHTHREADS
+  size_t max_threads() {
+    auto &server = m_.servers().at(mib_server);
+    return std::max(server.mindispatchthreads, server.maxdispatchthreads);
+  }
+
+  // Number of waiting requests a dispatch thread may take ahead. Threads and
+  // servers of an MSSQ set split them so that idle ones are not starved.
+  size_t batch_size() {
+    auto consumers = m_.queues().at(mib_queue).servercnt * threads;
+    if (consumers <= 1) {
+      return max_batch - 1;
+    }
+    return std::min(max_batch - 1,
+                    fux::ipc::qdepth(request_queue) / consumers);
+  }
+
+  // Message type to receive, counter is kept by each dispatch thread
+  long mtype(int &req_counter) {
+    req_counter = (req_counter + 1) % 8;
+    if (req_counter == 0) {
       // every nth message screw priorities and read first message from queue
       return 0;
     }
     return mtype_;
   }
 
+  void wakeup(server_thread *self);
+  void spawn();
+  void manage_pool();
+
  private:
-  long mtype_;
-  int req_counter_;
+  std::atomic<long> mtype_;
 };
 
 static std::unique_ptr<server_main> main_ptr;
@@ -192,8 +391,23 @@ int _tmrunserver(int) {
   return 0;
 }
 
+static bool is_stop(fux::ipc::msg &req) {
+  return req->cat == fux::ipc::admin;
+}
+
 struct server_thread {
-  server_thread() : atmibuf(nullptr), reply_to_shutdown(false) {}
+  server_thread()
+      : atmibuf(nullptr),
+        reply_to_shutdown(false),
+        rval(TPMINVAL),
+        name(""),
+        req_counter(0),
+        self(pthread_self()),
+        waiting(false),
+        retire(false),
+        active(std::chrono::steady_clock::now()),
+        burst(false),
+        wakeups(0) {}
 
   void prepare() {
     if (atmibuf == nullptr) {
@@ -207,42 +421,106 @@ struct server_thread {
   char *atmibuf;
   bool reply_to_shutdown;
   jmp_buf tpreturn_env;
+  // Outcome of the current request
+  int rval;
+  // Service of the current request
+  const char *name;
+  int req_counter;
+
+  pthread_t self;
+  // Blocked in qrecv() and may need a wakeup
+  std::atomic<bool> waiting;
+  // Leave the pool when nothing is taken ahead
+  std::atomic<bool> retire;
+  // When the last request was received
+  std::atomic<std::chrono::steady_clock::time_point> active;
+
+  std::deque<request> runq;
+  // Previous drain got requests, otherwise probe only now and then to not
+  // pay for an empty receive on every wakeup
+  bool burst;
+  unsigned wakeups;
+
+  // Takes waiting requests without blocking so that a burst costs one
+  // wakeup
+  void drain() {
+    if (!burst && ++wakeups % main_ptr->max_batch != 0) {
+      return;
+    }
+    burst = false;
+    for (auto n = main_ptr->batch_size(); n > 0; n--) {
+      request r;
+      r.data = tpalloc(const_cast<char *>("STRING"), nullptr, 4 * 1024);
+      if (r.data == nullptr) {
+        break;
+      }
+      r.len = fux::ipc::qrecv(main_ptr->request_queue, r.hdr, &r.data,
+                              main_ptr->mtype(req_counter), IPC_NOWAIT);
+      if (r.len == -1) {
+        break;
+      }
+      burst = true;
+      bool stop = is_stop(r.hdr);
+      runq.push_back(std::move(r));
+      if (stop) {
+        break;
+      }
+    }
+  }
+
+  // Makes the first request of run queue the current one
+  long next() {
+    auto &r = runq.front();
+    req = std::move(r.hdr);
+    fux::mem::replace(&atmibuf, r.data);
+    fux::mem::setowner(atmibuf, &atmibuf);
+    r.data = nullptr;
+    auto len = r.len;
+    runq.pop_front();
+    return len;
+  }
 
   void tpforward(char *svc, char *data, long len, long flags) {
+    rval = TPMINVAL;
     auto gttid = fux::tx::gttid();
     if (fux::tx::transactional()) {
       fux::tx_end(true);
     }
 
-    int msqid = get_queue(svc);
-    res.set_data(data, len);
-
-    if (data != nullptr && data != atmibuf) {
-      tpfree(data);
-    }
+    int msqid = get_queue(svc, res);
+    auto service = res->service;
+    auto generation = res->generation;
+    res.set_data(data, len, true);
 
     if (flags != 0) {
       userlog("tpforward with flags!=0");
     }
-    checked_copy(svc, res->servicename);
+    res->service = service;
+    res->generation = generation;
+    res->enqueued = fux::ipc::now_us();
+    res->cat = fux::ipc::application;
     res->flags = flags;
     res->replyq = req->replyq;
+    res->replybox = req->replybox;
     res->mtype = req->cd;
     res->cd = req->cd;
+    res->corrid = req->corrid;
     res->gttid = gttid;
+    FUXFLIGHT(tpforward, svc, req->cd, res.size_data());
 
     fux::ipc::qsend(msqid, res, 0, fux::ipc::flags::notime);
 
+    // Message may have been sent straight from data
+    if (data != nullptr && data != atmibuf && !res.given()) {
+      tpfree(data);
+    }
+
     longjmp(tpreturn_env, 1);
   }
 
   void reply(int rval, long rcode, char *data, long len, long flags) {
     if (req->replyq != -1) {
-      res.set_data(data, len);
-
-      if (data != nullptr && data != atmibuf) {
-        tpfree(data);
-      }
+      res.set_data(data, len, true);
 
       if (flags != 0) {
         userlog("tpreturn with flags!=0");
@@ -254,15 +532,29 @@ struct server_thread {
       res->flags = flags;
       res->mtype = req->cd;
       res->cd = req->cd;
+      res->corrid = req->corrid;
+      FUXPROBE(tpreturn, name, res->cd, res.size(), req->gttid);
+
+      if (req->replybox == -1 || !fux::ipc::mbsend(req->replybox, res)) {
+        fux::ipc::qsend(req->replyq, res, 0, fux::ipc::flags::notime);
+        if (req->replybox != -1) {
+          fux::ipc::mbnotify(req->replybox);
+        }
+      }
 
-      fux::ipc::qsend(req->replyq, res, 0, fux::ipc::flags::notime);
+      // Message may have been sent straight from data
+      if (data != nullptr && data != atmibuf && !res.given()) {
+        tpfree(data);
+      }
     }
   }
 
   void tpreturn(int rval, long rcode, char *data, long len, long flags) {
+    this->rval = rval;
     if (fux::tx::transactional()) {
       fux::tx_end(rval == TPSUCCESS);
     }
+    FUXFLIGHT(tpreturn, name, req->cd, rval);
     reply(rval, rcode, data, len, flags);
     longjmp(tpreturn_env, 1);
   }
@@ -271,71 +563,245 @@ struct server_thread {
 static thread_local std::unique_ptr<server_thread> thread_ptr;
 static server_thread *main_thread_ptr;
 
-static void dispatch() {
+// Siblings blocked in qrecv() do not notice stop. Interrupt signal sent just
+// before one starts to wait is lost, so repeat until all of them have left.
+void server_main::wakeup(server_thread *self) {
   while (true) {
-    if (main_ptr->stop) {
-      break;
+    {
+      fux::scoped_fuxlock lock(mutex);
+      if (dispatchers.size() <= 1) {
+        break;
+      }
+      for (auto t : dispatchers) {
+        if (t != self && t->waiting) {
+          fux::ipc::qinterrupt(t->self);
+        }
+      }
     }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+static void dispatch() {
+  {
+    fux::scoped_fuxlock lock(main_ptr->mutex);
+    main_ptr->dispatchers.push_back(thread_ptr.get());
+  }
 
+  while (true) {
     TPSVCINFO tpsvcinfo;
-    {
-      userlog("Dispatch loop");
-      fux::scoped_fuxlock lock(main_ptr->mutex);
-      if (main_ptr->stop) {
+    if (!thread_ptr->runq.empty()) {
+      tpsvcinfo.len = thread_ptr->next();
+    } else {
+      // Requests taken ahead are served even after stop
+      if (main_ptr->stop || thread_ptr->retire) {
         break;
       }
+      FUXTRACE(atmi, "Dispatch loop");
 
-      fux::ipc::qrecv(main_ptr->request_queue, thread_ptr->req,
-                      main_ptr->mtype(), 0);
-
+      // All threads wait for requests at the same time. Request data is
+      // received straight into the buffer of the service.
       thread_ptr->prepare();
-      thread_ptr->req.get_data(&thread_ptr->atmibuf);
-      tpsvcinfo.data = thread_ptr->atmibuf;
-      if (strcmp(thread_ptr->req->servicename, ".stop") == 0) {
+      thread_ptr->waiting = true;
+      tpsvcinfo.len = fux::ipc::qrecv(
+          main_ptr->request_queue, thread_ptr->req, &thread_ptr->atmibuf,
+          main_ptr->mtype(thread_ptr->req_counter), 0);
+      thread_ptr->waiting = false;
+      if (tpsvcinfo.len == -1) {
+        // Woken up by wakeup() or to retire
+        continue;
+      }
+      thread_ptr->active = std::chrono::steady_clock::now();
+      if (!is_stop(thread_ptr->req)) {
+        thread_ptr->drain();
+      }
+    }
+
+    tpsvcinfo.data = thread_ptr->atmibuf;
+    if (is_stop(thread_ptr->req)) {
+      bool stopped;
+      {
+        fux::scoped_fuxlock lock(main_ptr->mutex);
         fux::fml32buf buf(&tpsvcinfo);
 
-        userlog("Received admin message");
-        if (main_ptr->handle(thread_ptr->req->mtype, buf)) {
+        FUXTRACE(atmi, "Received admin message");
+        stopped = main_ptr->handle(thread_ptr->req->mtype, buf);
+        thread_ptr->req_counter = 0;
+        if (stopped) {
           if (thread_ptr.get() != main_thread_ptr) {
             main_thread_ptr->req = thread_ptr->req;
+            main_thread_ptr->req.set_data(thread_ptr->atmibuf, tpsvcinfo.len);
             main_thread_ptr->req.get_data(&main_thread_ptr->atmibuf);
           }
           main_thread_ptr->reply_to_shutdown = true;
-          continue;
         } else {
           // return for processing by other MSSQ servers
-          userlog("Not the target receiver of message, put back in queue");
+          FUXTRACE(atmi,
+                   "Not the target receiver of message, put back in queue");
+          thread_ptr->req.set_data(thread_ptr->atmibuf, tpsvcinfo.len);
           fux::ipc::qsend(main_ptr->request_queue, thread_ptr->req, 0,
                           fux::ipc::flags::notime);
         }
+      }  // lock
+      if (stopped) {
+        main_ptr->wakeup(thread_ptr.get());
       }
-    }  // lock
+      continue;
+    }
 
-    checked_copy(thread_ptr->req->servicename, tpsvcinfo.name);
+    auto svc = main_ptr->lookup(thread_ptr->req);
+    if (svc.func == nullptr) {
+      userlog("Service %u is not advertised", thread_ptr->req->service);
+      thread_ptr->reply(TPESVCERR, 0, nullptr, 0, 0);
+      continue;
+    }
+    fux::trace::poll(main_ptr->m_);
+    checked_copy(svc.name, tpsvcinfo.name);
     tpsvcinfo.flags = thread_ptr->req->flags;
-    tpsvcinfo.len = thread_ptr->req.size_data();
     tpsvcinfo.cd = thread_ptr->req->cd;
 
+    thread_ptr->name = tpsvcinfo.name;
+    fux::flight::corrid = thread_ptr->req->corrid;
+    FUXFLIGHT(dequeue, tpsvcinfo.name, tpsvcinfo.cd, tpsvcinfo.len);
+    FUXPROBE(dequeue, tpsvcinfo.name, tpsvcinfo.cd, tpsvcinfo.len,
+             thread_ptr->req->gttid);
+
     if (thread_ptr->req->flags & TPTRAN) {
       fux::tx_join(thread_ptr->req->gttid);
     }
 
+    // Returning without tpreturn() is an error
+    auto service = thread_ptr->req->service;
+    thread_ptr->rval = TPESVCERR;
+    auto timing = main_ptr->started(service, thread_ptr->req->enqueued);
+    // Request buffer is copied before the service changes or frees it
+    std::vector<char> snapshot;
+    if (fux::slowlog::mode() != fux::slowlog::snapshot::none &&
+        main_ptr->slow_threshold(service) != 0) {
+      char type[8];
+      if (tpsvcinfo.data != nullptr &&
+          tptypes(tpsvcinfo.data, type, nullptr) != -1 &&
+          strcmp(type, "FML32") == 0) {
+        snapshot =
+            fux::slowlog::copy(reinterpret_cast<FBFR32 *>(tpsvcinfo.data));
+      }
+    }
+    FUXPROBE(service__entry, tpsvcinfo.name, tpsvcinfo.cd, tpsvcinfo.len,
+             thread_ptr->req->gttid);
     if (setjmp(thread_ptr->tpreturn_env) == 0) {
-      auto it = main_ptr->advertisements.find(tpsvcinfo.name);
-      it->second(&tpsvcinfo);
+      svc.func(&tpsvcinfo);
+    }
+    FUXPROBE(service__return, tpsvcinfo.name, tpsvcinfo.cd, thread_ptr->rval,
+             thread_ptr->req->gttid);
+    main_ptr->finished(service, thread_ptr->rval != TPMINVAL, timing);
+    if (auto slow = main_ptr->slow_threshold(service);
+        slow != 0 && timing.elapsed >= slow) {
+      main_ptr->slow(tpsvcinfo, thread_ptr->req, thread_ptr->rval, timing,
+                     std::move(snapshot));
     }
+    fux::flight::corrid = 0;
+    thread_ptr->name = "";
   }
+
+  fux::scoped_fuxlock lock(main_ptr->mutex);
+  auto &d = main_ptr->dispatchers;
+  d.erase(std::find(d.begin(), d.end(), thread_ptr.get()));
 }
 
-static void thread_dispatch(tmsvrargs_t *tmsvrargs, int argc, char *argv[]) {
+static void thread_dispatch(tmsvrargs_t *tmsvrargs, int argc, char *argv[],
+                            size_t n) {
   thread_ptr = std::make_unique<server_thread>();
-  if (int n = tmsvrargs->svrthrinit(argc, argv); n != 0) {
-    userlog("tpsvrthrinit() = %d", n);
-    return;
+  fux::ipc::qinterruptible();
+  // Each thread has its own shard of a sharded request queue
+  fux::ipc::qshard(n);
+  if (int rc = tmsvrargs->svrthrinit(argc, argv); rc != 0) {
+    userlog("tpsvrthrinit() = %d", rc);
+  } else {
+    dispatch();
+    tmsvrargs->svrthrdone();
   }
-  dispatch();
-  tmsvrargs->svrthrdone();
   thread_ptr.reset();
+
+  fux::scoped_fuxlock lock(main_ptr->mutex);
+  main_ptr->exited.push_back(n);
+}
+
+// Starts a dispatch thread with the lowest free index
+void server_main::spawn() {
+  size_t n = 0;
+  while (pool.count(n) != 0) {
+    n++;
+  }
+  pool.emplace(n, std::thread(thread_dispatch, tmsvrargs, argc, argv, n));
+  threads = pool.size();
+
+  auto &server = m_.servers().at(mib_server);
+  server.curdispatchthreads = pool.size();
+  server.hwdispatchthreads =
+      std::max<size_t>(server.hwdispatchthreads, pool.size());
+  server.numdispatchthreads++;
+}
+
+// Called by the main thread every pool_tick
+void server_main::manage_pool() {
+  std::vector<size_t> done;
+  {
+    fux::scoped_fuxlock lock(mutex);
+    done.swap(exited);
+  }
+  for (auto n : done) {
+    pool.at(n).join();
+    pool.erase(n);
+  }
+  if (!done.empty()) {
+    threads = pool.size();
+    m_.servers().at(mib_server).curdispatchthreads = pool.size();
+  }
+
+  auto &server = m_.servers().at(mib_server);
+  auto now = std::chrono::steady_clock::now();
+  size_t live = 0, busy = 0;
+  {
+    fux::scoped_fuxlock lock(mutex);
+    server_thread *idlest = nullptr;
+    bool retiring = false;
+    for (auto t : dispatchers) {
+      if (t->retire) {
+        // Signal may have been lost, repeat until it leaves
+        retiring = true;
+        if (t->waiting) {
+          fux::ipc::qinterrupt(t->self);
+        }
+        continue;
+      }
+      live++;
+      if (!t->waiting) {
+        busy++;
+      } else if (now - t->active.load() > pool_idle &&
+                 (idlest == nullptr ||
+                  t->active.load() < idlest->active.load())) {
+        idlest = t;
+      }
+    }
+    if (idlest != nullptr && !retiring && live > server.mindispatchthreads) {
+      idlest->retire = true;
+      fux::ipc::qinterrupt(idlest->self);
+    }
+  }
+
+  // Servers of an MSSQ set share the backlog of the queue
+  auto servers = std::max<size_t>(1, m_.queues().at(mib_queue).servercnt);
+  if (live > 0 && (busy * 4 >= live * 3 ||
+                   fux::ipc::qdepth(request_queue) / servers >= live)) {
+    pressure++;
+  } else {
+    pressure = 0;
+  }
+  if (pressure >= pool_grow && pool.size() < max_threads()) {
+    FUXTRACE(atmi, "Adding dispatch thread, %zu busy of %zu", busy, live);
+    spawn();
+    pressure = 0;
+  }
 }
 
 namespace fux::glob {
@@ -401,7 +867,9 @@ int _tmstartserver(int argc, char **argv, struct tmsvrargs_t *tmsvrargs) {
   main_ptr->grpno = grpno;
   fux::tx::grpno = grpno;
 
-  auto thread_count = m.servers().at(main_ptr->mib_server).mindispatchthreads;
+  auto &server = m.servers().at(main_ptr->mib_server);
+  server.curdispatchthreads = server.hwdispatchthreads = 0;
+  fux::mem::publish(server.buffers, max_buftypes);
   main_ptr->request_queue = m.make_service_rqaddr(main_ptr->mib_server);
   main_ptr->mib_queue = m.servers().at(main_ptr->mib_server).rqaddr;
   main_ptr->argc = argc;
@@ -432,16 +900,22 @@ int _tmstartserver(int argc, char **argv, struct tmsvrargs_t *tmsvrargs) {
 
   main_ptr->active();
 
-  if (_tmbuilt_with_thread_option && thread_count > 1) {
-    std::vector<std::thread> threads;
-    for (int i = 0; i < thread_count; i++) {
-      threads.emplace_back(std::thread(thread_dispatch, tmsvrargs, argc, argv));
+  if (_tmbuilt_with_thread_option && main_ptr->max_threads() > 1) {
+    for (int i = 0; i < server.mindispatchthreads; i++) {
+      main_ptr->spawn();
     }
-
-    for (auto &t : threads) {
-      t.join();
+    // Ends when stopped or when all threads failed to start
+    while (!main_ptr->stop && !main_ptr->pool.empty()) {
+      std::this_thread::sleep_for(main_ptr->pool_tick);
+      main_ptr->manage_pool();
     }
+    for (auto &t : main_ptr->pool) {
+      t.second.join();
+    }
+    main_ptr->pool.clear();
   } else {
+    server.curdispatchthreads = server.hwdispatchthreads = 1;
+    server.numdispatchthreads++;
     dispatch();
   }
 
@@ -478,7 +952,7 @@ int tpunadvertise(char *svcname) {
 
 void tpreturn(int rval, long rcode, char *data, long len, long flags) try {
   if (!main_ptr) {
-    TPERROR(TPEPROTO, "%s can't be called from client", __func__);
+    userlog_sync("%s can't be called from client", __func__);
     abort();
   }
   if (rval == TPSUCCESS) {
@@ -498,7 +972,7 @@ void tpreturn(int rval, long rcode, char *data, long len, long flags) try {
 
 void tpforward(char *svc, char *data, long len, long flags) try {
   if (!main_ptr) {
-    TPERROR(TPEPROTO, "%s can't be called from client", __func__);
+    userlog_sync("%s can't be called from client", __func__);
     abort();
   }
   return thread_ptr->tpforward(svc, data, len, flags);
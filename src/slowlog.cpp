@@ -0,0 +1,217 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include "slowlog.h"
+
+#include <fcntl.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <userlog.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+
+#include "background.h"
+#include "misc.h"
+
+extern char *proc_name;
+
+namespace fux::slowlog {
+
+namespace {
+
+constexpr long max_snapshot = 64 * 1024;
+
+snapshot parse_mode(const std::string &s) {
+  if (s == "text") {
+    return snapshot::text;
+  } else if (s == "binary") {
+    return snapshot::binary;
+  }
+  return snapshot::none;
+}
+
+class writer : public fux::background_thread {
+ public:
+  // Records waiting for the background thread, more are suppressed
+  static constexpr size_t max_pending = 64;
+
+  writer()
+      : mode(parse_mode(fux::util::getenv("SLOWLOGDATA", "n"))),
+        rate_(std::max(
+            1L, std::atol(fux::util::getenv("SLOWLOGRATE", "10").c_str()))),
+        tokens_(rate_),
+        refilled_(std::chrono::steady_clock::now()),
+        suppressed_(0),
+        busy_(false) {}
+
+  // Token bucket refilled with rate_ tokens per second, up to rate_ tokens
+  bool admit() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> passed = now - refilled_;
+    tokens_ = std::min<double>(rate_, tokens_ + rate_ * passed.count());
+    refilled_ = now;
+    if (tokens_ < 1) {
+      suppressed_++;
+      return false;
+    }
+    tokens_ -= 1;
+    return true;
+  }
+
+  void submit(record &&r) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stopped_ || pending_.size() >= max_pending) {
+        suppressed_++;
+        return;
+      }
+      pending_.push_back(std::move(r));
+      if (!start()) {
+        pending_.clear();
+      }
+    }
+    cv_.notify_one();
+  }
+
+  void flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this] { return pending_.empty() && !busy_; });
+  }
+
+  const snapshot mode;
+
+ private:
+  void run(std::unique_lock<std::mutex> &lock) override {
+    while (true) {
+      cv_.wait(lock, [this] { return stopped_ || !pending_.empty(); });
+      if (pending_.empty()) {
+        break;
+      }
+      std::deque<record> batch;
+      batch.swap(pending_);
+      auto suppressed = suppressed_;
+      suppressed_ = 0;
+      busy_ = true;
+      lock.unlock();
+      write(batch, suppressed);
+      lock.lock();
+      busy_ = false;
+      done_.notify_all();
+    }
+    done_.notify_all();
+  }
+
+  // Records of the parent are dropped
+  void forked() override {
+    new (&done_) std::condition_variable();
+    busy_ = false;
+    pending_.clear();
+  }
+
+  void write(std::deque<record> &batch, unsigned long suppressed) {
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    struct tm tm;
+    localtime_r(&tv.tv_sec, &tm);
+
+    std::string out;
+    for (auto &r : batch) {
+      out += format(r, tm, tv.tv_usec / 1000, suppressed);
+      // Reported once per batch
+      suppressed = 0;
+    }
+
+    char logfile[FILENAME_MAX + 1];
+    snprintf(logfile, sizeof(logfile), "%s.%02d%02d%02d",
+             fux::util::getenv("SLOWLOGPFX", "SLOWLOG").c_str(), tm.tm_mon + 1,
+             tm.tm_mday, tm.tm_year % 100);
+    int fd = ::open(logfile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (fd == -1) {
+      userlog("Failed to open %s: %s", logfile, strerror(errno));
+      return;
+    }
+    if (::write(fd, out.data(), out.size()) != ssize_t(out.size())) {
+      userlog("Failed to write %s: %s", logfile, strerror(errno));
+    }
+    ::close(fd);
+  }
+
+  std::string format(record &r, const struct tm &tm, int millisec,
+                     unsigned long suppressed) {
+    auto line = string_format(
+        "%02d%02d%02d.%03d.%s.%d: %s cd=%d gttid=%d caller=%d wait=%llu "
+        "svc=%llu cpu=%llu rval=%d",
+        tm.tm_hour, tm.tm_min, tm.tm_sec, millisec, proc_name, getpid(),
+        r.service.c_str(), r.cd, r.gttid == fux::bad_gttid ? -1 : r.gttid,
+        r.caller, (unsigned long long)r.wait, (unsigned long long)r.elapsed,
+        (unsigned long long)r.cpu, r.rval);
+    if (suppressed != 0) {
+      line += " suppressed=" + std::to_string(suppressed);
+    }
+
+    auto fbfr = reinterpret_cast<FBFR32 *>(r.data.data());
+    if (r.data.empty()) {
+      line += "\n";
+    } else if (mode == snapshot::binary) {
+      std::string encoded(base64chars(r.data.size()), '\0');
+      encoded.resize(base64encode(r.data.data(), r.data.size(), &encoded[0],
+                                  encoded.size()));
+      line += " data=" + encoded + "\n";
+    } else {
+      char *text = nullptr;
+      size_t len = 0;
+      auto f = open_memstream(&text, &len);
+      if (f != nullptr) {
+        Ffprint32(fbfr, f);
+        fclose(f);
+        line += "\n" + std::string(text, len);
+        free(text);
+      }
+    }
+    return line;
+  }
+
+  const long rate_;
+  double tokens_;
+  std::chrono::steady_clock::time_point refilled_;
+  unsigned long suppressed_;
+
+  std::deque<record> pending_;
+  std::condition_variable done_;
+  bool busy_;
+};
+
+writer &getwriter() { return fux::background_instance<writer>(); }
+
+}  // namespace
+
+snapshot mode() { return getwriter().mode; }
+
+std::vector<char> copy(FBFR32 *fbfr) {
+  std::vector<char> data;
+  auto used = Fused32(fbfr);
+  if (used <= 0 || used > max_snapshot) {
+    return data;
+  }
+  data.resize(used);
+  auto dst = reinterpret_cast<FBFR32 *>(data.data());
+  if (Finit32(dst, used) == -1 || Fcpy32(dst, fbfr) == -1) {
+    data.clear();
+  }
+  return data;
+}
+
+bool admit() { return getwriter().admit(); }
+
+void submit(record &&r) { getwriter().submit(std::move(r)); }
+
+void flush() { getwriter().flush(); }
+
+}  // namespace fux::slowlog
@@ -0,0 +1,49 @@
+#pragma once
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <fml32.h>
+#include <sys/types.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "defs.h"
+
+// Requests that took longer than SVCTIMEOUT of their service are written to
+// a daily SLOWLOG.mmddyy file by a background thread. At most SLOWLOGRATE
+// records per second are written, the rest are counted as suppressed.
+// SLOWLOGDATA=text or binary adds the request FML32 buffer in Fprint32 format
+// or as base64.
+namespace fux::slowlog {
+
+enum class snapshot { none, text, binary };
+
+struct record {
+  std::string service;
+  int cd;
+  fux::gttid gttid;
+  // Process that waits for the reply, 0 if unknown or not waiting
+  pid_t caller;
+  int rval;
+  // Microseconds
+  uint64_t wait;
+  uint64_t elapsed;
+  uint64_t cpu;
+  // Copy of the request buffer
+  std::vector<char> data;
+};
+
+// Kind of request snapshots taken, from SLOWLOGDATA
+snapshot mode();
+// Copies an FML32 buffer up to 64 KB in size for the snapshot
+std::vector<char> copy(FBFR32 *fbfr);
+// Takes a token of the rate limit, false means the record is suppressed
+bool admit();
+// Queues the record for the background thread
+void submit(record &&r);
+// Waits until everything queued so far is written
+void flush();
+
+}  // namespace fux::slowlog
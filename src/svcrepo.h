@@ -16,6 +16,7 @@ struct service_entry {
   uint64_t cached_revision;
   uint64_t *mib_revision;
   size_t mib_service;
+  uint32_t generation;
 
   service_entry() : current_queue(0) {}
 };
@@ -23,9 +24,12 @@ struct service_entry {
 class service_repository {
  public:
   service_repository(mib &m) : m_(m) {}
-  int get_queue(int grpno, const char *svc) {
+  // Queue for a request to svc, request is addressed to the service entry
+  int get_queue(int grpno, const char *svc, fux::ipc::msg &req) {
     auto &entry = get_entry(svc);
     refresh(entry);
+    req->service = entry.mib_service;
+    req->generation = entry.generation;
     return load_balance(entry, grpno);
   }
 
@@ -40,6 +44,7 @@ class service_repository {
         throw std::out_of_range(service_name);
       }
       entry.mib_revision = &(m_.services().at(entry.mib_service).revision);
+      entry.generation = m_.services().at(entry.mib_service).generation;
       entry.cached_revision = 0;
       it = services_.insert(std::make_pair(service_name, entry)).first;
     }
@@ -51,13 +56,12 @@ class service_repository {
       entry.queues.clear();
       auto lock = m_.data_lock();
       auto adv = m_.advertisements();
-      for (size_t i = 0; i < adv->len; i++) {
+      for (auto i = m_.services().at(entry.mib_service).advertisements;
+           i != m_.badoff; i = adv.at(i).next) {
         auto &a = adv.at(i);
-        if (a.service == entry.mib_service) {
-          auto msqid = m_.queues().at(a.queue).msqid;
-          auto grpno = m_.servers().at(a.server).grpno;
-          entry.queues.push_back({grpno, msqid});
-        }
+        auto msqid = m_.queues().at(a.queue).msqid;
+        auto grpno = m_.servers().at(a.server).grpno;
+        entry.queues.push_back({grpno, msqid});
       }
       entry.cached_revision = *(entry.mib_revision);
     }
@@ -21,11 +21,17 @@
 #include "mib.h"
 
 static void do_help() {
+  std::cout << "changetrace (chtr) newspec" << std::endl;
   std::cout << "help (h) [{command | all}]" << std::endl;
+  std::cout << "printlatency (plat)" << std::endl;
   std::cout << "printqueue (pq) [qaddress]" << std::endl;
   std::cout << "printserver (psr) [-m machine] [-g groupname [-R rmid]] [-i "
                "srvid] [-q qaddress]"
             << std::endl;
+  std::cout << "printservice (psc) [-m machine] [-g groupname] [-i srvid] "
+               "[-a {0|1|2}] [-q qaddress] [-s service]"
+            << std::endl;
+  std::cout << "resetlatency (rlat) [service]" << std::endl;
 }
 
 /*
@@ -79,6 +85,123 @@ static void do_printqueue() {
   }
 }
 
+static void do_printserver() {
+  fux::fml32buf in, out;
+  in.put(TA_CLASS, 0, "T_SERVER");
+  in.put(TA_OPERATION, 0, "GET");
+
+  tpadmcall(in.ptr(), out.ptrptr(), 0);
+
+  std::cout << "Prog Name      Queue Name  Grp Name      ID State      Pid "
+               "Threads RqDone Load Done"
+            << std::endl;
+  std::cout << "---------      ----------  --------      -- -----      --- "
+               "------- ------ ---------"
+            << std::endl;
+
+  for (FLDOCC32 oc = 0, max = out.get<long>(TA_OCCURS, 0); oc < max; oc++) {
+    std::cout << std::left << std::setw(14)
+              << out.get<std::string>(TA_SERVERNAME, oc) << " " << std::left
+              << std::setw(11) << out.get<std::string>(TA_RQADDR, oc) << " "
+              << std::left << std::setw(10)
+              << out.get<std::string>(TA_SRVGRP, oc) << " " << std::right
+              << std::setw(5) << out.get<long>(TA_SRVID, oc) << " "
+              << std::left << std::setw(5) << out.get<std::string>(TA_STATE, oc)
+              << " " << std::right << std::setw(8) << out.get<long>(TA_PID, oc)
+              << " " << std::right << std::setw(7)
+              << out.get<long>(TA_CURDISPATCHTHREADS, oc) << " " << std::right
+              << std::setw(6) << out.get<long>(TA_TOTREQC, oc) << " "
+              << std::right << std::setw(9) << out.get<long>(TA_TOTWORKL, oc)
+              << std::endl;
+  }
+}
+
+static void do_printservice() {
+  fux::fml32buf in, out;
+  in.put(TA_CLASS, 0, "T_SERVICE");
+  in.put(TA_OPERATION, 0, "GET");
+
+  tpadmcall(in.ptr(), out.ptrptr(), 0);
+
+  std::cout << "Service Name    # Done  Load Done  # Failed  Current Status"
+            << std::endl;
+  std::cout << "------------    ------  ---------  --------  ------- ------"
+            << std::endl;
+
+  for (FLDOCC32 oc = 0, max = out.get<long>(TA_OCCURS, 0); oc < max; oc++) {
+    std::cout << std::left << std::setw(15)
+              << out.get<std::string>(TA_SERVICENAME, oc) << " " << std::right
+              << std::setw(6) << out.get<long>(TA_NCOMPLETED, oc) << " "
+              << std::right << std::setw(10) << out.get<long>(TA_TOTWORKL, oc)
+              << " " << std::right << std::setw(9)
+              << out.get<long>(TA_NFAILED, oc) << " " << std::right
+              << std::setw(8) << out.get<long>(TA_CURREQ, oc) << " "
+              << std::left << out.get<std::string>(TA_STATE, oc) << std::endl;
+  }
+}
+
+// Percentiles of queue wait, service and CPU time in microseconds
+static void do_printlatency() {
+  fux::fml32buf in, out;
+  in.put(TA_CLASS, 0, "T_SERVICE");
+  in.put(TA_OPERATION, 0, "GET");
+
+  tpadmcall(in.ptr(), out.ptrptr(), 0);
+
+  std::cout << "Service Name    # Done";
+  for (auto h : {"Wait p50", "p99", "p999", "Svc p50", "p99", "p999",
+                 "CPU p50", "p99", "p999"}) {
+    std::cout << " " << std::right << std::setw(8) << h;
+  }
+  std::cout << std::endl;
+  std::cout << "------------    ------";
+  for (int i = 0; i < 9; i++) {
+    std::cout << " --------";
+  }
+  std::cout << std::endl;
+
+  for (FLDOCC32 oc = 0, max = out.get<long>(TA_OCCURS, 0); oc < max; oc++) {
+    std::cout << std::left << std::setw(15)
+              << out.get<std::string>(TA_SERVICENAME, oc) << " " << std::right
+              << std::setw(6) << out.get<long>(TA_NCOMPLETED, oc);
+    for (auto f : {TA_WAITP50, TA_WAITP99, TA_WAITP999, TA_SVCP50, TA_SVCP99,
+                   TA_SVCP999, TA_CPUP50, TA_CPUP99, TA_CPUP999}) {
+      std::cout << " " << std::right << std::setw(8) << out.get<long>(f, oc);
+    }
+    std::cout << std::endl;
+  }
+}
+
+static void do_resetlatency(const std::string &service) {
+  fux::fml32buf in, out;
+  in.put(TA_CLASS, 0, "T_SERVICE");
+  in.put(TA_OPERATION, 0, "SET");
+  in.put(TA_RESET, 0, 1);
+  if (!service.empty()) {
+    in.put(TA_SERVICENAME, 0, service);
+  }
+
+  tpadmcall(in.ptr(), out.ptrptr(), 0);
+
+  if (out.get<long>(TA_ERROR, 0) < 0) {
+    std::cout << "Unknown service " << service << std::endl;
+  }
+}
+
+// Trace specification of all processes like TMTRACE
+static void do_changetrace(const std::string &spec) {
+  fux::fml32buf in, out;
+  in.put(TA_CLASS, 0, "T_MACHINE");
+  in.put(TA_OPERATION, 0, "SET");
+  in.put(TA_TMTRACE, 0, spec);
+
+  tpadmcall(in.ptr(), out.ptrptr(), 0);
+
+  if (out.get<long>(TA_ERROR, 0) < 0) {
+    std::cout << "Invalid trace specification " << spec << std::endl;
+  }
+}
+
 int main(int argc, char *argv[]) {
   bool show_help = false;
   bool version = false;
@@ -109,6 +232,20 @@ int main(int argc, char *argv[]) {
         do_help();
       } else if (line == "printqueue" || line == "pq") {
         do_printqueue();
+      } else if (line == "printserver" || line == "psr") {
+        do_printserver();
+      } else if (line == "printservice" || line == "psc") {
+        do_printservice();
+      } else if (line == "printlatency" || line == "plat") {
+        do_printlatency();
+      } else if (line == "resetlatency" || line == "rlat") {
+        do_resetlatency("");
+      } else if (line.rfind("resetlatency ", 0) == 0 ||
+                 line.rfind("rlat ", 0) == 0) {
+        do_resetlatency(line.substr(line.find(' ') + 1));
+      } else if (line.rfind("changetrace ", 0) == 0 ||
+                 line.rfind("chtr ", 0) == 0) {
+        do_changetrace(line.substr(line.find(' ') + 1));
       }
       std::cout << "> " << std::flush;
     }
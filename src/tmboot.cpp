@@ -15,19 +15,9 @@
 #include "mib.h"
 #include "misc.h"
 
-static void start(server &srv, bool no, bool d1) {
-  std::vector<const char *> argv;
-  argv.push_back(srv.servername);
-  argv.push_back("-g");
-  auto grpno = std::to_string(srv.grpno);
-  argv.push_back(grpno.c_str());
-  argv.push_back("-i");
-  auto srvid = std::to_string(srv.srvid);
-  argv.push_back(srvid.c_str());
-  argv.push_back("-A");
-
+static void start(mib &m, server &srv, bool no, bool d1) {
   if (d1) {
-    std::cout << "exec " << join(argv, " ") << " :" << std::endl;
+    std::cout << "exec " << join(server_argv(srv), " ") << " :" << std::endl;
   } else {
     std::cout << "exec " << srv.servername << " " << srv.clopt << " :"
               << std::endl;
@@ -40,22 +30,8 @@ static void start(server &srv, bool no, bool d1) {
     return;
   }
 
-  srv.state = state_t::INActive;
-  auto pid = fork();
-  if (pid == 0) {
-    argv.push_back(nullptr);
-
-    if (freopen("/dev/null", "r", stdin) == nullptr ||
-        freopen("stdout", "a", stdout) == nullptr ||
-        freopen("stderr", "a", stderr) == nullptr) {
-      exit(-1);
-    }
-
-    if (execvp(srv.servername, (char *const *)&argv[0]) == -1) {
-      exit(-1);
-    }
-  } else if (pid > 0) {
-    srv.pid = pid;
+  auto pid = start_server(m, srv);
+  if (pid > 0) {
     for (;;) {
       if (srv.state == state_t::ACTive) {
         break;
@@ -69,12 +45,15 @@ static void start(server &srv, bool no, bool d1) {
         throw std::system_error(errno, std::system_category());
       }
     }
-    if (alive(pid)) {
-      std::cout << "\tprocess id=" << srv.pid << " ... Started." << std::endl;
-    } else {
+  }
+  if (pid > 0 && alive(pid)) {
+    std::cout << "\tprocess id=" << srv.pid << " ... Started." << std::endl;
+  } else {
+    if (pid > 0) {
+      auto lock = m.data_lock();
       srv.pid = 0;
-      std::cout << "\tFailed." << std::endl;
     }
+    std::cout << "\tFailed." << std::endl;
   }
 }
 
@@ -126,7 +105,7 @@ int main(int argc, char *argv[]) {
     for (size_t i = 0; i < servers->len; i++) {
       auto &srv = servers[i];
       if (srv.autostart) {
-        start(srv, no, d1);
+        start(m, srv, no, d1);
       }
     }
   } catch (const std::exception &e) {
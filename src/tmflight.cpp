@@ -0,0 +1,70 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+// Merges flight recorder rings of all processes into a single timeline
+
+#include <signal.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <clara.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "flight.h"
+
+namespace flight = fux::flight;
+
+int main(int argc, char *argv[]) {
+  bool show_help = false;
+  bool remove = false;
+  std::string corrid;
+
+  auto parser =
+      clara::Help(show_help) |
+      clara::Opt(corrid, "corrid")["-c"]("show events of one request chain") |
+      clara::Opt(remove)["-r"]("remove rings of exited processes");
+
+  auto result = parser.parse(clara::Args(argc, argv));
+  if (!result || show_help) {
+    std::cerr << parser;
+    return -1;
+  }
+  uint64_t only = corrid.empty() ? 0 : std::strtoull(corrid.c_str(), nullptr,
+                                                     16);
+
+  std::vector<flight::entry> timeline;
+  for (auto &name : flight::rings()) {
+    try {
+      auto entries = flight::read(name);
+      pid_t pid = std::atoi(name.substr(name.rfind('.') + 1).c_str());
+      if (remove && kill(pid, 0) == -1 && errno == ESRCH) {
+        shm_unlink(name.c_str());
+      }
+      for (auto &e : entries) {
+        if (only == 0 || e.corrid == only) {
+          timeline.push_back(std::move(e));
+        }
+      }
+    } catch (const std::exception &e) {
+      std::cerr << name << ": " << e.what() << std::endl;
+    }
+  }
+
+  std::stable_sort(timeline.begin(), timeline.end(),
+                   [](const flight::entry &a, const flight::entry &b) {
+                     return a.time < b.time;
+                   });
+
+  for (auto &e : timeline) {
+    printf("%llu.%06llu %016llx %s.%d.%u %-9s %-16s cd=%d %d\n",
+           (unsigned long long)(e.time / 1000000),
+           (unsigned long long)(e.time % 1000000),
+           (unsigned long long)e.corrid, e.progname.c_str(), e.pid, e.tid,
+           flight::to_string(e.type), e.name.c_str(), e.cd, e.value);
+  }
+  return 0;
+}
@@ -82,6 +82,9 @@ int main(int argc, char *argv[]) {
     tuxcfg.maxqueues = require(config.resources, "MAXQUEUES", 1, 8192, 50);
     tuxcfg.maxaccessers =
         require(config.resources, "MAXACCESSERS", 1, 32768, 100);
+    tuxcfg.blobsize = require(config.resources, "BLOBSIZE", 0, 4096, 32);
+    tuxcfg.maxadvertisements =
+        require(config.resources, "MAXADVERTISEMENTS", 1, 16777215, 0);
 
     std::ofstream fout(outfile, std::ios::binary);
     fout.write(reinterpret_cast<char *>(&tuxcfg), sizeof(tuxcfg));
@@ -6,6 +6,7 @@
 
 #include "fux.h"
 #include "mib.h"
+#include "trace.h"
 
 using fux::fml32buf;
 
@@ -36,11 +37,49 @@ static void t_machine_get(fml32buf &in, fml32buf &out) {
   out.put(TA_ULOGPFX, 0, machine.ulogpfx);
   out.put(TA_TLOGDEVICE, 0, machine.tlogdevice);
   out.put(TA_BLOCKTIME, 0, machine.blocktime);
+  out.put(TA_TMTRACE, 0, machine.tmtrace);
 
   out.put(TA_ERROR, 0, TAOK);
   out.put(TA_OCCURS, 0, 1);
 }
 
+// TMTRACE of all processes, they pick it up with the next request
+static void t_machine_set(fml32buf &in, fml32buf &out) {
+  auto &m = getmib();
+  auto &machine = m.mach();
+
+  if (Fpres32(in.ptr(), TA_TMTRACE, 0)) {
+    auto spec = in.get<std::string>(TA_TMTRACE, 0);
+    try {
+      // Unknown categories or too long
+      fux::trace::parse(spec);
+      auto lock = m.data_lock();
+      checked_copy(spec.c_str(), machine.tmtrace);
+      machine.tmtrace_revision++;
+    } catch (const std::logic_error &e) {
+      out.put(TA_ERROR, 0, TAEINVAL);
+      return;
+    }
+    fux::trace::poll(m);
+  }
+
+  out.put(TA_ERROR, 0, TAUPDATED);
+  out.put(TA_OCCURS, 0, 1);
+}
+
+// Percentiles in microseconds
+static void put_latencies(fml32buf &out, FLDOCC32 oc, const latencies &l) {
+  out.put(TA_WAITP50, oc, long(l.wait.percentile(0.5)));
+  out.put(TA_WAITP99, oc, long(l.wait.percentile(0.99)));
+  out.put(TA_WAITP999, oc, long(l.wait.percentile(0.999)));
+  out.put(TA_SVCP50, oc, long(l.service.percentile(0.5)));
+  out.put(TA_SVCP99, oc, long(l.service.percentile(0.99)));
+  out.put(TA_SVCP999, oc, long(l.service.percentile(0.999)));
+  out.put(TA_CPUP50, oc, long(l.cpu.percentile(0.5)));
+  out.put(TA_CPUP99, oc, long(l.cpu.percentile(0.99)));
+  out.put(TA_CPUP999, oc, long(l.cpu.percentile(0.999)));
+}
+
 static void t_service_get(fml32buf &in, fml32buf &out) {
   auto services = getmib().services();
   FLDOCC32 oc = 0;
@@ -64,6 +103,11 @@ static void t_service_get(fml32buf &in, fml32buf &out) {
     out.put(TA_ENCRYPTION_REQUIRED, oc, service.encryption_required);
     out.put(TA_BUFTYPECONV, oc, service.buftypeconv);
     out.put(TA_CACHINGNAME, oc, service.cachingname);
+    out.put(TA_NCOMPLETED, oc, long(service.counters.done));
+    out.put(TA_TOTWORKL, oc, long(service.counters.load));
+    out.put(TA_NFAILED, oc, long(service.counters.failed));
+    out.put(TA_CURREQ, oc, long(service.counters.inflight));
+    put_latencies(out, oc, service.latency);
     oc++;
   }
 
@@ -71,6 +115,43 @@ static void t_service_get(fml32buf &in, fml32buf &out) {
   out.put(TA_OCCURS, 0, oc);
 }
 
+// TA_RESET clears latency histograms of TA_SERVICENAME or of all services and
+// servers, TA_SVCTIMEOUT changes the slow log threshold of TA_SERVICENAME
+static void t_service_set(fml32buf &in, fml32buf &out) {
+  auto &m = getmib();
+  auto lock = m.data_lock();
+  if (Fpres32(in.ptr(), TA_SVCTIMEOUT, 0)) {
+    auto service = m.find_service(in.get(TA_SERVICENAME, 0, ""));
+    auto svctimeout = in.get<long>(TA_SVCTIMEOUT, 0);
+    if (service == mib::badoff || svctimeout < 0) {
+      out.put(TA_ERROR, 0, TAEINVAL);
+      return;
+    }
+    m.services().at(service).svctimeout = svctimeout;
+  }
+  if (in.get(TA_RESET, 0, 0L) != 0) {
+    auto name = in.get(TA_SERVICENAME, 0, "");
+    if (name.empty()) {
+      for (size_t i = 0; i < m.services().length(); i++) {
+        m.services().at(i).latency.reset();
+      }
+      for (size_t i = 0; i < m.servers().length(); i++) {
+        m.servers().at(i).latency.reset();
+      }
+    } else {
+      auto service = m.find_service(name);
+      if (service == mib::badoff) {
+        out.put(TA_ERROR, 0, TAEINVAL);
+        return;
+      }
+      m.services().at(service).latency.reset();
+    }
+  }
+
+  out.put(TA_ERROR, 0, TAUPDATED);
+  out.put(TA_OCCURS, 0, 1);
+}
+
 static void t_server_set(fml32buf &in, fml32buf &out) {
   FLDOCC32 oc = 0;
   auto srvgrp = in.get<std::string>(TA_SRVGRP, oc);
@@ -78,7 +159,11 @@ static void t_server_set(fml32buf &in, fml32buf &out) {
   auto state = to_state(in.get<std::string>(TA_STATE, oc));
   auto rqaddr = "a";
 
+  auto servername = in.get<std::string>(TA_SERVERNAME, oc);
+  auto clopt = in.get(TA_CLOPT, oc, "-A");
+
   auto &m = getmib();
+  auto lock = m.data_lock();
 
   auto group_idx = m.group_index(srvgrp);
   if (group_idx == mib::badoff) {
@@ -91,21 +176,16 @@ static void t_server_set(fml32buf &in, fml32buf &out) {
       throw std::logic_error("Server already exists");
     }
   } else {
-    server_idx = m.servers()->len++;
+    // Indexed and counted by its queue
+    server_idx = m.make_server(srvid, m.groups().at(group_idx).grpno,
+                               servername, clopt, rqaddr);
   }
   auto &server = m.servers().at(server_idx);
 
-  server.rqaddr_idx = m.find_queue(rqaddr);
-  if (server.rqaddr_idx == mib::badoff) {
-    server.rqaddr_idx = m.make_queue(rqaddr);
-  }
-
-  server.group_idx = group_idx;
-  server.srvid = srvid;
-  checked_copy(in.get<std::string>(TA_SERVERNAME, oc), server.servername);
+  checked_copy(servername, server.servername);
   server.state = state;
   server.basesrvid = in.get(TA_BASESRVID, oc, 0);
-  checked_copy(in.get(TA_CLOPT, oc, "-A"), server.clopt);
+  checked_copy(clopt, server.clopt);
   checked_copy(in.get(TA_ENVFILE, oc, ""), server.envfile);
   checked_copy(in.get(TA_DEPENDSON, oc, ""), server.dependson);
   server.grace = in.get(TA_GRACE, oc, 86400);
@@ -122,9 +202,6 @@ static void t_server_set(fml32buf &in, fml32buf &out) {
   server.restart = to_bool(in.get(TA_RESTART, oc, "N"));
   server.autostart = true;
 
-  m.queues().at(server.rqaddr).servercnt++;
-  m.queues().at(server.rqaddr).server_idx = server_idx;
-
   out.put(TA_ERROR, 0, TAOK);
   out.put(TA_OCCURS, 0, oc);
 }
@@ -158,6 +235,13 @@ static void t_server_get(fml32buf &in, fml32buf &out) {
     out.put(TA_NUMDISPATCHTHREADS, oc, server.numdispatchthreads);
     out.put(TA_RCMD, oc, server.rcmd);
     out.put(TA_RESTART, oc, server.restart);
+    out.put(TA_RQADDR, oc, m.queues().at(server.rqaddr).rqaddr);
+    out.put(TA_PID, oc, server.pid);
+    out.put(TA_TOTREQC, oc, long(server.counters.done));
+    out.put(TA_TOTWORKL, oc, long(server.counters.load));
+    out.put(TA_NFAILED, oc, long(server.counters.failed));
+    out.put(TA_CURREQ, oc, long(server.counters.inflight));
+    put_latencies(out, oc, server.latency);
 
     out.put(TA_LMID, oc, m.mach().lmid);
     oc++;
@@ -176,6 +260,9 @@ static void t_svcgrp_get(fml32buf &in, fml32buf &out) {
   FLDOCC32 oc = 0;
   for (size_t i = 0; i < svcgrp.length(); i++) {
     auto &adv = svcgrp.at(i);
+    if (adv.state == state_t::INValid) {
+      continue;
+    }
     auto &service = m.services().at(adv.service);
     out.put(TA_SERVICENAME, oc, service.servicename);
     //    out.put(TA_SRVGRP, oc,
@@ -223,11 +310,41 @@ static void t_queue_get(fml32buf &in, fml32buf &out) {
     out.put(TA_RQID, oc, q.msqid);
     out.put(TA_SERVERCNT, oc, q.servercnt);
 
-    out.put(TA_TOTNQUEUED, oc, 0);
-    out.put(TA_TOTWKQUEUED, oc, 0);
+    fux::ipc::queue_stats stats = {0, q.shards, 0};
+    if (q.msqid != -1) {
+      try {
+        stats = fux::ipc::qstats(q.msqid);
+      } catch (const std::system_error &) {
+        // Queue of a server that is not running
+      }
+    }
+
+    // Waiting requests are weighted by the average LOAD of services on the
+    // queue, totals are what servers have taken so far and what waits
+    long load = 0, services = 0;
+    auto adv = m.advertisements();
+    for (size_t j = 0; j < adv.length(); j++) {
+      if (adv.at(j).queue == i) {
+        load += m.services().at(adv.at(j).service).load;
+        services++;
+      }
+    }
+    long wkqueued = services > 0 ? stats.queued * load / services : 0;
+    long totnqueued = stats.queued, totwkqueued = wkqueued;
+    for (size_t j = 0; j < m.servers().length(); j++) {
+      auto &c = m.servers().at(j).counters;
+      if (m.servers().at(j).rqaddr == i) {
+        totnqueued += c.done + c.inflight;
+        totwkqueued += c.load;
+      }
+    }
+    out.put(TA_TOTNQUEUED, oc, totnqueued);
+    out.put(TA_TOTWKQUEUED, oc, totwkqueued);
     out.put(TA_SOURCE, oc, m.mach().lmid);
-    out.put(TA_NQUEUED, oc, 0);
-    out.put(TA_WKQUEUED, oc, 0);
+    out.put(TA_NQUEUED, oc, long(stats.queued));
+    out.put(TA_WKQUEUED, oc, wkqueued);
+    out.put(TA_RQSHARDS, oc, long(stats.shards));
+    out.put(TA_NSTOLEN, oc, long(stats.stolen));
     oc++;
   }
 
@@ -235,6 +352,39 @@ static void t_queue_get(fml32buf &in, fml32buf &out) {
   out.put(TA_OCCURS, 0, oc);
 }
 
+// Typed buffers of running servers, one occurrence per server and type
+static void t_buftype_get(fml32buf &in, fml32buf &out) {
+  auto &m = getmib();
+  auto servers = m.servers();
+  FLDOCC32 oc = 0;
+  for (size_t i = 0; i < servers.length(); i++) {
+    auto &server = servers.at(i);
+    if (server.pid == 0) {
+      continue;
+    }
+    for (auto &slot : server.buffers) {
+      if (slot.type[0] == '\0') {
+        continue;
+      }
+      out.put(TA_SRVGRP, oc, m.groups().at(server.group_idx).srvgrp);
+      out.put(TA_SRVID, oc, server.srvid);
+      out.put(TA_GRPNO, oc, server.grpno);
+      out.put(TA_PID, oc, server.pid);
+      out.put(TA_BUFTYPE, oc,
+              std::string(slot.type, strnlen(slot.type, sizeof(slot.type))));
+      out.put(TA_BUFSUBTYPE, oc,
+              std::string(slot.subtype,
+                          strnlen(slot.subtype, sizeof(slot.subtype))));
+      out.put(TA_CURBUFFERS, oc, long(slot.outstanding));
+      out.put(TA_HWBUFFERS, oc, long(slot.peak));
+      oc++;
+    }
+  }
+
+  out.put(TA_ERROR, 0, TAOK);
+  out.put(TA_OCCURS, 0, oc);
+}
+
 static void t_group_get(fml32buf &in, fml32buf &out) {
   tuxconfig tuxcfg;
   tuxcfg.size = 0;
@@ -252,12 +402,15 @@ static std::map<std::tuple<std::string, std::string>,
                 std::function<void(fml32buf &in, fml32buf &out)>>
     implemented = {{{"T_DOMAIN", "GET"}, t_domain_get},
                    {{"T_MACHINE", "GET"}, t_machine_get},
+                   {{"T_MACHINE", "SET"}, t_machine_set},
                    {{"T_SERVICE", "GET"}, t_service_get},
+                   {{"T_SERVICE", "SET"}, t_service_set},
                    {{"T_SVCGRP", "GET"}, t_svcgrp_get},
                    {{"T_SERVER", "SET"}, t_server_set},
                    {{"T_SERVER", "GET"}, t_server_get},
                    {{"T_GROUP", "GET"}, t_group_get},
-                   {{"T_QUEUE", "GET"}, t_queue_get}};
+                   {{"T_QUEUE", "GET"}, t_queue_get},
+                   {{"T_BUFTYPE", "GET"}, t_buftype_get}};
 
 int tpadmcall(FBFR32 *inbuf, FBFR32 **outbuf, long flags) {
   fml32buf in(&inbuf);
@@ -266,6 +419,7 @@ int tpadmcall(FBFR32 *inbuf, FBFR32 **outbuf, long flags) {
   auto klass = in.get<std::string>(TA_CLASS, 0);
   auto operation = in.get<std::string>(TA_OPERATION, 0);
 
+  FUXTRACE(mib, "tpadmcall(%s, %s)", klass.c_str(), operation.c_str());
   auto func = implemented.find({klass, operation});
   if (func == implemented.end()) {
   } else {
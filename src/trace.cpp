@@ -0,0 +1,99 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include "trace.h"
+
+#include <cstdlib>
+#include <stdexcept>
+
+#include "mib.h"
+
+namespace fux::trace {
+
+static unsigned from_env() {
+  auto spec = std::getenv("TMTRACE");
+  if (spec == nullptr) {
+    return 0;
+  }
+  try {
+    return parse(spec);
+  } catch (const std::invalid_argument &e) {
+    userlog("Ignoring TMTRACE=%s: %s", spec, e.what());
+    return 0;
+  }
+}
+
+std::atomic<unsigned> enabled(from_env());
+
+static unsigned category(const std::string &name) {
+  if (name == "ipc") {
+    return ipc;
+  } else if (name == "atmi") {
+    return atmi;
+  } else if (name == "xa") {
+    return xa;
+  } else if (name == "trace") {
+    return trace;
+  } else if (name == "mib") {
+    return mib;
+  } else if (name == "*") {
+    return ipc | atmi | xa | trace | mib;
+  }
+  throw std::invalid_argument("Unknown trace category " + name);
+}
+
+unsigned parse(const std::string &spec) {
+  // Only the ULOG receiver is supported
+  auto pattern = spec.substr(0, spec.find(':'));
+  if (pattern == "on") {
+    return category("*");
+  } else if (pattern == "off" || pattern.empty()) {
+    return 0;
+  }
+
+  unsigned mask = 0;
+  char op = '+';
+  size_t pos = 0;
+  while (pos <= pattern.size()) {
+    auto end = pattern.find_first_of("+-", pos);
+    if (end == std::string::npos) {
+      end = pattern.size();
+    }
+    auto c = category(pattern.substr(pos, end - pos));
+    mask = op == '+' ? (mask | c) : (mask & ~c);
+    if (end < pattern.size()) {
+      op = pattern[end];
+    }
+    pos = end + 1;
+  }
+  return mask;
+}
+
+void set(const std::string &spec) {
+  enabled = parse(spec);
+  FUXTRACE(trace, "TMTRACE=%s", spec.c_str());
+}
+
+void poll(::mib &m) {
+  static std::atomic<uint32_t> revision(0);
+  auto &mach = m.mach();
+  auto current = mach.tmtrace_revision.load(std::memory_order_acquire);
+  if (current == revision.load(std::memory_order_relaxed)) {
+    return;
+  }
+  // Changes are rare, only then the specification is copied under the lock
+  // tpadmcall writes it with
+  std::string spec;
+  {
+    auto lock = m.data_lock();
+    revision = mach.tmtrace_revision.load(std::memory_order_relaxed);
+    spec = mach.tmtrace;
+  }
+  try {
+    set(spec);
+  } catch (const std::invalid_argument &e) {
+    userlog("Ignoring TMTRACE=%s: %s", spec.c_str(), e.what());
+  }
+}
+
+}  // namespace fux::trace
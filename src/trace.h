@@ -0,0 +1,44 @@
+#pragma once
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <userlog.h>
+
+#include <atomic>
+#include <string>
+
+class mib;
+
+namespace fux::trace {
+
+enum category : unsigned {
+  ipc = 1 << 0,
+  atmi = 1 << 1,
+  xa = 1 << 2,
+  trace = 1 << 3,
+  mib = 1 << 4,
+};
+
+// Categories enabled in this process
+extern std::atomic<unsigned> enabled;
+
+// Parses a TMTRACE specification like "atmi+xa:ulog", "*-ipc", "on" or "off".
+// Throws std::invalid_argument for unknown categories.
+unsigned parse(const std::string &spec);
+// Changes trace categories of this process
+void set(const std::string &spec);
+// Picks up the specification changed through tpadmcall for all processes
+void poll(::mib &m);
+
+}  // namespace fux::trace
+
+// Costs a single branch when the category is disabled
+#define FUXTRACE(cat, fmt, args...)                                        \
+  do {                                                                     \
+    if (__builtin_expect(                                                  \
+            fux::trace::enabled.load(std::memory_order_relaxed) &          \
+                fux::trace::cat,                                           \
+            0)) {                                                          \
+      userlog(fmt, ##args);                                                \
+    }                                                                      \
+  } while (0)
@@ -14,8 +14,11 @@
 
 #include <algorithm>
 
+#include "flight.h"
 #include "fux.h"
 #include "mib.h"
+#include "probes.h"
+#include "trace.h"
 #include "trx.h"
 
 extern "C" {
@@ -103,6 +106,8 @@ int tx_open() {
   }
 
   auto xarc = xasw->xa_open_entry(info + len + 1, fux::tx::grpno, TMNOFLAGS);
+  FUXFLIGHT(xa, "xa_open", fux::tx::grpno, xarc);
+  FUXPROBE(xa_open, fux::tx::grpno, TMNOFLAGS, xarc);
   if (xarc == XA_OK) {
     if (getctxt().state == tx_state::s0) {
       getctxt().notrx();
@@ -121,6 +126,8 @@ int tx_close() {
   }
   auto xarc = xasw->xa_close_entry(getctxt().grpcfg->closeinfo, fux::tx::grpno,
                                    TMNOFLAGS);
+  FUXFLIGHT(xa, "xa_close", fux::tx::grpno, xarc);
+  FUXPROBE(xa_close, fux::tx::grpno, TMNOFLAGS, xarc);
   if (xarc == XA_OK) {
     getctxt().state = tx_state::s0;
     return TX_OK;
@@ -283,12 +290,14 @@ static int _tx_end(TXINFO *info, long flags) {
     return TX_PROTOCOL_ERROR;
   }
 
-  userlog("xa_end(%s, %d, 0x%0lx) ...",
-          fux::to_string(&getctxt().info.xid).c_str(), fux::tx::grpno, flags);
+  FUXTRACE(xa, "xa_end(%s, %d, 0x%0lx) ...",
+           fux::to_string(&getctxt().info.xid).c_str(), fux::tx::grpno, flags);
   auto xarc = xasw->xa_end_entry(&getctxt().info.xid, fux::tx::grpno, flags);
-  userlog("xa_end(%s, %d, 0x%0lx) = %d",
-          fux::to_string(&getctxt().info.xid).c_str(), fux::tx::grpno, flags,
-          xarc);
+  FUXFLIGHT(xa, "xa_end", fux::tx::grpno, xarc);
+  FUXPROBE(xa_end, fux::tx::grpno, flags, xarc);
+  FUXTRACE(xa, "xa_end(%s, %d, 0x%0lx) = %d",
+           fux::to_string(&getctxt().info.xid).c_str(), fux::tx::grpno, flags,
+           xarc);
   if (info != nullptr) {
     *info = getctxt().info;
     getctxt().notrx();
@@ -345,12 +354,14 @@ static int _tx_start(TXINFO *info, long flags) {
     getctxt().info.xid = info->xid;
   }
 
-  userlog("xa_start(%s, %d, 0x%08lx) ...",
-          fux::to_string(&getctxt().info.xid).c_str(), fux::tx::grpno, flags);
+  FUXTRACE(xa, "xa_start(%s, %d, 0x%08lx) ...",
+           fux::to_string(&getctxt().info.xid).c_str(), fux::tx::grpno, flags);
   auto xarc = xasw->xa_start_entry(&getctxt().info.xid, fux::tx::grpno, flags);
-  userlog("xa_start(%s, %d, 0x%08lx) = %d",
-          fux::to_string(&getctxt().info.xid).c_str(), fux::tx::grpno, flags,
-          xarc);
+  FUXFLIGHT(xa, "xa_start", fux::tx::grpno, xarc);
+  FUXPROBE(xa_start, fux::tx::grpno, flags, xarc);
+  FUXTRACE(xa, "xa_start(%s, %d, 0x%08lx) = %d",
+           fux::to_string(&getctxt().info.xid).c_str(), fux::tx::grpno, flags,
+           xarc);
   if (xarc == XA_OK) {
     if (getctxt().state == tx_state::s1) {
       getctxt().state = tx_state::s3;
@@ -458,8 +469,8 @@ void command(std::vector<branch> &branches, XID *xid, int command) {
     buf.put(TA_XID, 0, fux::to_string(xid));
     buf.put(TA_RMID, 0, p.grpno);
     buf.put(TA_FLAGS, 0, 0);
-    userlog("Calling TM in group %d for %s", p.grpno,
-            fux::to_string(xid).c_str());
+    FUXTRACE(xa, "Calling TM in group %d for %s", p.grpno,
+             fux::to_string(xid).c_str());
     p.cd = tpacall_group(p.grpno, const_cast<char *>(".TM"),
                          reinterpret_cast<char *>(*buf.ptrptr()), 0,
                          TPNOTIME | TPNOTRAN);
@@ -500,21 +511,31 @@ static void tm(fux::fml32buf &buf) {
   int ret;
   switch (func) {
     case fux::tm::prepare:
-      userlog("xa_prepare(%s, %d, 0x%0lx) ...", xids.c_str(), rmid, flags);
+      FUXTRACE(xa, "xa_prepare(%s, %d, 0x%0lx) ...", xids.c_str(), rmid,
+               flags);
       ret = xasw->xa_prepare_entry(&xid, rmid, flags);
-      userlog("xa_prepare(%s, %d, 0x%0lx) = %d", xids.c_str(), rmid, flags,
-              ret);
+      FUXFLIGHT(xa, "xa_prepare", rmid, ret);
+      FUXPROBE(xa_prepare, rmid, flags, ret);
+      FUXTRACE(xa, "xa_prepare(%s, %d, 0x%0lx) = %d", xids.c_str(), rmid,
+               flags, ret);
       break;
     case fux::tm::commit:
-      userlog("xa_commit(%s, %d, 0x%0lx) ...", xids.c_str(), rmid, flags);
+      FUXTRACE(xa, "xa_commit(%s, %d, 0x%0lx) ...", xids.c_str(), rmid,
+               flags);
       ret = xasw->xa_commit_entry(&xid, rmid, flags);
-      userlog("xa_commit(%s, %d, 0x%0lx) = %d", xids.c_str(), rmid, flags, ret);
+      FUXFLIGHT(xa, "xa_commit", rmid, ret);
+      FUXPROBE(xa_commit, rmid, flags, ret);
+      FUXTRACE(xa, "xa_commit(%s, %d, 0x%0lx) = %d", xids.c_str(), rmid,
+               flags, ret);
       break;
     case fux::tm::rollback:
-      userlog("xa_rollback(%s, %d, 0x%0lx) ...", xids.c_str(), rmid, flags);
+      FUXTRACE(xa, "xa_rollback(%s, %d, 0x%0lx) ...", xids.c_str(), rmid,
+               flags);
       ret = xasw->xa_rollback_entry(&xid, rmid, flags);
-      userlog("xa_rollback(%s, %d, 0x%0lx) = %d", xids.c_str(), rmid, flags,
-              ret);
+      FUXFLIGHT(xa, "xa_rollback", rmid, ret);
+      FUXPROBE(xa_rollback, rmid, flags, ret);
+      FUXTRACE(xa, "xa_rollback(%s, %d, 0x%0lx) = %d", xids.c_str(), rmid,
+               flags, ret);
       break;
     default:
       ret = XAER_INVAL;
@@ -37,5 +37,8 @@ struct tuxconfig {
   uint16_t maxqueues;
   uint16_t maxgroups;
   uint16_t maxaccessers;
+  uint16_t blobsize;  // MB of shared memory for large messages
+  // Services advertised by all servers, 0 for MAXSERVICES + 16 * MAXSERVERS
+  uint32_t maxadvertisements = 0;
   //  char ubb[];
 };
@@ -77,6 +77,18 @@ void ubb2mib(ubbconfig &u, mib &m) {
 
   m.mach().blocktime = std::stol(blocktime) * std::stol(scanunit);
 
+  auto rqtransport = [&](std::string transport) {
+    if (transport.empty()) {
+      transport = u.resources["RQTRANSPORT"];
+    }
+    if (transport.empty() || transport == "MSGQ") {
+      return false;
+    } else if (transport == "SHM") {
+      return true;
+    }
+    throw std::logic_error("RQTRANSPORT must be MSGQ or SHM");
+  };
+
   auto &domain = m.domain();
   domain.ipckey = m.conf().ipckey;
   domain.maxservers = m.conf().maxservers;
@@ -124,8 +136,12 @@ void ubb2mib(ubbconfig &u, mib &m) {
     auto max = checked_get(srvconf.second, "MAX", 1, 1000, 1);
     auto minthreads =
         checked_get(srvconf.second, "MINDISPATCHTHREADS", 1, 1000, 1);
-    auto maxthreads =
-        checked_get(srvconf.second, "MAXDISPATCHTHREADS", 1, 1000, 1);
+    auto maxthreads = checked_get(srvconf.second, "MAXDISPATCHTHREADS", 1,
+                                  1000, minthreads);
+    if (minthreads > maxthreads) {
+      throw std::logic_error(
+          "MINDISPATCHTHREADS must not be greater than MAXDISPATCHTHREADS");
+    }
     auto grpno = group_ids.at(srvconf.second.at("SRVGRP"));
     for (auto n = 0; n < max; n++) {
       auto srvid = basesrvid + n;
@@ -136,9 +152,38 @@ void ubb2mib(ubbconfig &u, mib &m) {
 
       auto &server = servers.at(m.make_server(srvid, grpno, srvconf.first,
                                               srvconf.second["CLOPT"], rqaddr));
+      auto &queue = m.queues().at(server.rqaddr);
+      auto shm = rqtransport(srvconf.second["RQTRANSPORT"]);
+      if (queue.servercnt > 1 && queue.shm != shm) {
+        throw std::logic_error("Servers sharing RQADDR=" + rqaddr +
+                               " must use the same RQTRANSPORT");
+      }
+      queue.shm = shm;
+      auto shards = checked_get(srvconf.second, "RQSHARDS", 1, 16, 1);
+      if (shards > 1 && !shm) {
+        throw std::logic_error("RQSHARDS requires RQTRANSPORT=SHM");
+      }
+      if (queue.servercnt > 1 && queue.shards != shards) {
+        throw std::logic_error("Servers sharing RQADDR=" + rqaddr +
+                               " must use the same RQSHARDS");
+      }
+      queue.shards = shards;
       server.autostart = n < min;
+      server.basesrvid = basesrvid;
+      server.min = min;
+      server.max = max;
       server.mindispatchthreads = minthreads;
       server.maxdispatchthreads = maxthreads;
     }
   }
+
+  // Entries are shared with servers that advertise the service later
+  for (auto &svcconf : u.services) {
+    auto service = m.find_service(svcconf.first);
+    if (service == mib::badoff) {
+      service = m.make_service(svcconf.first);
+    }
+    m.services().at(service).svctimeout =
+        checked_get(svcconf.second, "SVCTIMEOUT", 0, 2147483647, 0);
+  }
 }
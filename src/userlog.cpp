@@ -3,20 +3,25 @@
 
 #include <userlog.h>
 
+#include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/utsname.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-
+#include <mutex>
 #include <string>
 
-#include <gsl/gsl_util>
-
+#include "background.h"
 #include "misc.h"
 
 // FIXME: Linux only
@@ -31,48 +36,249 @@ static std::string getname() {
   return buf.nodename;
 }
 
-int userlog(const char *fmt, ...) {
-  static std::string nodename = getname();
+// Local time of the current second, localtime_r() is called once per second
+static const struct tm &localtime_cached(time_t t) {
+  thread_local time_t cached = -1;
+  thread_local struct tm timeinfo;
+  if (t != cached) {
+    localtime_r(&t, &timeinfo);
+    cached = t;
+  }
+  return timeinfo;
+}
 
-  auto ULOGPFX = fux::util::getenv("ULOGPFX", "ULOG");
-  bool millisec = fux::util::getenv("ULOGMILLISEC", "n") == "y";
+namespace {
 
-  struct timeval tv;
-  struct tm timeinfo;
+// Formatted lines go to a ring buffer and a background thread appends them to
+// the daily file. Producers claim slots without locks, like in a bounded MPMC
+// queue with sequence numbers per slot. Lines that do not fit into a slot or
+// into the ring are written synchronously.
+class logger : public fux::background_thread {
+ public:
+  static constexpr size_t slots = 256;
+  static constexpr size_t slot_size = 1024;
+  static constexpr auto flush_interval = std::chrono::milliseconds(50);
 
-  gettimeofday(&tv, nullptr);
-  localtime_r(&tv.tv_sec, &timeinfo);
+  logger()
+      : sync(fux::util::getenv("ULOGSYNC", "n") == "y"),
+        millisec(fux::util::getenv("ULOGMILLISEC", "n") == "y"),
+        nodename(getname()),
+        fd_(-1),
+        day_(-1),
+        prefix_(fux::util::getenv("ULOGPFX", "ULOG")),
+        forked_(false) {
+    reset();
+  }
+
+  bool push(const char *line, size_t len) {
+    if (sync || len > slot_size) {
+      return false;
+    }
+    auto pos = head_.load(std::memory_order_relaxed);
+    slot *s;
+    while (true) {
+      s = &ring_[pos % slots];
+      auto seq = s->seq.load(std::memory_order_acquire);
+      auto dif = static_cast<ssize_t>(seq - pos);
+      if (dif == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (dif < 0) {
+        // Full
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+    memcpy(s->text, line, len);
+    s->len = len;
+    s->seq.store(pos + 1, std::memory_order_release);
+
+    if (!started_.load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!start()) {
+        sync = true;
+      }
+    }
+    if (pos - tail_.load(std::memory_order_relaxed) >= slots / 2) {
+      cv_.notify_one();
+    }
+    return true;
+  }
+
+  // Writes a line after everything buffered so far
+  int write(const char *line, size_t len) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    drain();
+    if (!open()) {
+      return -1;
+    }
+    return ::write(fd_, line, len) == ssize_t(len) ? 0 : -1;
+  }
+
+  void stop() override {
+    // Whatever comes later is written synchronously
+    sync = true;
+    background_thread::stop();
+    std::lock_guard<std::mutex> lock(mutex_);
+    drain();
+  }
+
+  std::atomic<bool> sync;
+  const bool millisec;
+  const std::string nodename;
+
+ private:
+  struct slot {
+    std::atomic<size_t> seq;
+    size_t len;
+    char text[slot_size];
+  };
+
+  void reset() {
+    for (size_t i = 0; i < slots; i++) {
+      ring_[i].seq.store(i, std::memory_order_relaxed);
+    }
+    head_ = 0;
+    tail_ = 0;
+  }
+
+  void run(std::unique_lock<std::mutex> &lock) override {
+    while (!stopped_) {
+      cv_.wait_for(lock, flush_interval);
+      drain();
+    }
+  }
+
+  // Buffered lines are flushed by the parent, the child starts from scratch
+  void prepare_fork() override { drain(); }
+  void forked() override {
+    forked_ = true;
+    reset();
+  }
+
+  // Writes ready slots with one writev() per batch, mutex_ must be held
+  void drain() {
+    while (true) {
+      struct iovec iov[IOV_MAX < slots ? IOV_MAX : slots];
+      size_t n = 0;
+      auto pos = tail_.load(std::memory_order_relaxed);
+      while (n < sizeof(iov) / sizeof(iov[0])) {
+        auto &s = ring_[(pos + n) % slots];
+        if (s.seq.load(std::memory_order_acquire) != pos + n + 1) {
+          break;
+        }
+        iov[n].iov_base = s.text;
+        iov[n].iov_len = s.len;
+        n++;
+      }
+      if (n == 0) {
+        return;
+      }
+      if (open()) {
+        (void)::writev(fd_, iov, n);
+      }
+      for (size_t i = 0; i < n; i++) {
+        ring_[(pos + i) % slots].seq.store(pos + i + slots,
+                                           std::memory_order_release);
+      }
+      tail_.store(pos + n, std::memory_order_relaxed);
+    }
+  }
+
+  // Daily file stays open until the date changes. ULOGPFX is read when the
+  // logger is created and again by the first write of a forked child.
+  bool open() {
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    auto &timeinfo = localtime_cached(tv.tv_sec);
+    auto day = timeinfo.tm_year * 1000 + timeinfo.tm_yday;
 
-  char logfile[FILENAME_MAX + 1];
-  snprintf(logfile, sizeof(logfile), "%s.%02d%02d%02d", ULOGPFX.c_str(),
-           timeinfo.tm_mon + 1, timeinfo.tm_mday, timeinfo.tm_year % 100);
+    if (forked_) {
+      forked_ = false;
+      auto prefix = fux::util::getenv("ULOGPFX", "ULOG");
+      if (prefix != prefix_) {
+        prefix_ = prefix;
+        day_ = -1;
+      }
+    }
+    if (fd_ != -1 && day == day_) {
+      return true;
+    }
+    if (fd_ != -1) {
+      ::close(fd_);
+    }
 
-  FILE *fout = fopen(logfile, "a");
-  if (fout == nullptr) {
-    return -1;
+    char logfile[FILENAME_MAX + 1];
+    snprintf(logfile, sizeof(logfile), "%s.%02d%02d%02d", prefix_.c_str(),
+             timeinfo.tm_mon + 1, timeinfo.tm_mday, timeinfo.tm_year % 100);
+    fd_ = ::open(logfile, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    day_ = day;
+    return fd_ != -1;
   }
-  auto _ = gsl::finally([&] { fclose(fout); });
+
+  slot ring_[slots];
+  std::atomic<size_t> head_;
+  std::atomic<size_t> tail_;
+
+  int fd_;
+  int day_;
+  std::string prefix_;
+  bool forked_;
+};
+
+logger &getlogger() { return fux::background_instance<logger>(); }
+
+int vuserlog(bool sync, const char *fmt, va_list ap) {
+  auto &l = getlogger();
+
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  auto &timeinfo = localtime_cached(tv.tv_sec);
 
   char buf[BUFSIZ];
   ssize_t n;
-  if (millisec) {
+  if (l.millisec) {
     n = snprintf(buf, sizeof(buf),
                  "%02d%02d%02d.%03d.%s:%s.%d: ", timeinfo.tm_hour,
                  timeinfo.tm_min, timeinfo.tm_sec, int(tv.tv_usec / 1000),
-                 nodename.c_str(), proc_name, getpid());
+                 l.nodename.c_str(), proc_name, getpid());
   } else {
     n = snprintf(buf, sizeof(buf), "%02d%02d%02d.%s:%s.%d: ", timeinfo.tm_hour,
-                 timeinfo.tm_min, timeinfo.tm_sec, nodename.c_str(), proc_name,
-                 getpid());
+                 timeinfo.tm_min, timeinfo.tm_sec, l.nodename.c_str(),
+                 proc_name, getpid());
+  }
+
+  auto m = vsnprintf(buf + n, sizeof(buf) - n - 1, fmt, ap);
+  if (m > 0) {
+    // Long messages are truncated
+    n += std::min<ssize_t>(m, sizeof(buf) - n - 2);
+  }
+  buf[n++] = '\n';
+  buf[n] = 0;
+
+  if (!sync && l.push(buf, n)) {
+    return 0;
   }
+  return l.write(buf, n);
+}
+
+}  // namespace
 
+int userlog(const char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  n += vsnprintf(buf + n, sizeof(buf) - n - 1, fmt, ap);
+  auto rc = vuserlog(false, fmt, ap);
   va_end(ap);
-  buf[n++] = '\n';
-  buf[n] = 0;
-  fwrite(buf, n, 1, fout);
+  return rc;
+}
 
-  return 0;
+int userlog_sync(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  auto rc = vuserlog(true, fmt, ap);
+  va_end(ap);
+  return rc;
 }
@@ -2,6 +2,9 @@
 // Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
 
 #include <catch.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
 #include <string>
 
 // for base64 prototypes
@@ -69,3 +72,78 @@ TEST_CASE("decode strings", "[base64]") {
   REQUIRE_THROWS_AS(b64decode("123"), std::logic_error);
   REQUIRE_THROWS_AS(b64decode("===="), std::logic_error);
 }
+
+static std::string random_bytes(size_t n) {
+  std::string s;
+  for (size_t i = 0; i < n; i++) {
+    s.push_back(static_cast<char>(rand() % 256));
+  }
+  return s;
+}
+
+TEST_CASE("vectorized code matches scalar", "[base64]") {
+  for (auto isa : {base64isa::sse41, base64isa::avx2}) {
+    if (!base64use(isa)) {
+      continue;
+    }
+    for (size_t n = 0; n < 300; n++) {
+      auto input = random_bytes(n);
+      auto encoded = b64encode(input);
+      REQUIRE(b64decode(encoded) == input);
+
+      base64use(base64isa::scalar);
+      REQUIRE(b64encode(input) == encoded);
+      base64use(isa);
+
+      // Invalid characters anywhere are treated the same way
+      if (!encoded.empty()) {
+        auto invalid = encoded;
+        invalid[rand() % invalid.size()] = "*\n\x80="[n % 4];
+        auto decode = [&] {
+          try {
+            return b64decode(invalid);
+          } catch (const std::logic_error &) {
+            return std::string("error");
+          }
+        };
+        auto result = decode();
+        base64use(base64isa::scalar);
+        REQUIRE(decode() == result);
+        base64use(isa);
+      }
+    }
+  }
+  base64use(base64isa::avx2) || base64use(base64isa::sse41);
+}
+
+TEST_CASE("base64 throughput", "[.][benchmark]") {
+  auto input = random_bytes(1 << 20);
+  auto encoded = b64encode(input);
+  std::string output;
+  output.resize(input.size() + 3);
+
+  for (auto isa : {base64isa::scalar, base64isa::sse41, base64isa::avx2}) {
+    if (!base64use(isa)) {
+      continue;
+    }
+    constexpr int rounds = 200;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+      base64encode(input.data(), input.size(), &encoded[0], encoded.size());
+    }
+    auto middle = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+      base64decode(encoded.data(), encoded.size(), &output[0], output.size());
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    auto mbps = [&](auto elapsed) {
+      return rounds * input.size() /
+             std::chrono::duration<double>(elapsed).count() / (1 << 20);
+    };
+    std::cout << "isa " << static_cast<int>(isa)
+              << ": encode MB/s " << mbps(middle - start) << ", decode MB/s "
+              << mbps(end - middle) << std::endl;
+  }
+  base64use(base64isa::avx2) || base64use(base64isa::sse41);
+}
@@ -0,0 +1,82 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <catch.hpp>
+#include <string>
+
+#include "../src/flight.h"
+
+namespace flight = fux::flight;
+
+static bool has_ring(pid_t pid) {
+  auto rings = flight::rings();
+  return std::find(rings.begin(), rings.end(), flight::ring_name(pid)) !=
+         rings.end();
+}
+
+TEST_CASE("flight recorder keeps the latest events", "[flight]") {
+  flight::start(8);
+  REQUIRE(flight::current != nullptr);
+  auto id = flight::next_corrid();
+  REQUIRE(id >> 32 == uint64_t(getpid()));
+  for (int i = 0; i < 10; i++) {
+    FUXFLIGHT(enqueue, "A_VERY_LONG_SERVICE_NAME_THAT_IS_CUT", i, i * 10, id);
+  }
+  REQUIRE(has_ring(getpid()));
+
+  auto entries = flight::read(flight::ring_name(getpid()));
+  REQUIRE(entries.size() == 8);
+  for (int i = 0; i < 8; i++) {
+    REQUIRE(entries[i].cd == i + 2);
+    REQUIRE(entries[i].value == (i + 2) * 10);
+    REQUIRE(entries[i].corrid == id);
+    REQUIRE(entries[i].type == flight::enqueue);
+    REQUIRE(entries[i].name == "A_VERY_LONG_SERVICE_NAM");
+    REQUIRE(entries[i].pid == getpid());
+  }
+  REQUIRE(entries.front().time <= entries.back().time);
+  flight::stop();
+}
+
+TEST_CASE("forked child records into its own ring", "[flight]") {
+  flight::start(8);
+  FUXFLIGHT(enqueue, "PARENT", 1, 0, 0);
+
+  auto pid = fork();
+  REQUIRE(pid != -1);
+  if (pid == 0) {
+    auto id = flight::next_corrid();
+    FUXFLIGHT(enqueue, "CHILD", 2, 0, id);
+    _exit(id >> 32 == uint64_t(getpid()) ? 0 : 1);
+  }
+  int status;
+  REQUIRE(waitpid(pid, &status, 0) == pid);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE(WEXITSTATUS(status) == 0);
+
+  auto name = flight::ring_name(pid);
+  auto child = flight::read(name);
+  shm_unlink(name.c_str());
+  REQUIRE(child.size() == 1);
+  REQUIRE(child[0].name == "CHILD");
+  REQUIRE(child[0].pid == pid);
+
+  auto parent = flight::read(flight::ring_name(getpid()));
+  REQUIRE(!parent.empty());
+  REQUIRE(parent.back().name == "PARENT");
+  flight::stop();
+}
+
+TEST_CASE("stopped flight recorder removes its ring", "[flight]") {
+  flight::start(8);
+  REQUIRE(has_ring(getpid()));
+  flight::stop();
+  REQUIRE(flight::current == nullptr);
+  REQUIRE_FALSE(has_ring(getpid()));
+  FUXFLIGHT(enqueue, "STOPPED", 1, 0, 0);
+  REQUIRE_FALSE(has_ring(getpid()));
+}
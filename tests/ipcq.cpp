@@ -2,9 +2,19 @@
 // Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
 
 #include <algorithm>
+#include <atomic>
 #include <catch.hpp>
+#include <chrono>
+#include <cstring>
 #include <iostream>
+#include <limits>
 #include <stdexcept>
+#include <thread>
+
+#include <signal.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <atmi.h>
 
 #include "../src/ipc.h"
 
@@ -19,7 +29,8 @@ TEST_CASE_METHOD(queue_fixture, "send and receive ipc message", "[ipc]") {
   rq.resize(1024);
 
   rq->mtype = 1;
-  std::copy_n("ServiceName", sizeof("ServiceName"), rq->servicename);
+  rq->service = 7;
+  rq->generation = 3;
   rq->flags = 1;
   rq->cd = 2;
 
@@ -30,6 +41,8 @@ TEST_CASE_METHOD(queue_fixture, "send and receive ipc message", "[ipc]") {
   REQUIRE(rs.size() == rq.size());
   REQUIRE(rs->mtype == 1);
   REQUIRE(rs->ttype == fux::ipc::queue);
+  REQUIRE(rs->service == 7);
+  REQUIRE(rs->generation == 3);
   REQUIRE(rs->flags == 1);
   REQUIRE(rs->cd == 2);
 }
@@ -59,7 +72,8 @@ TEST_CASE_METHOD(queue_fixture, "send multiple and receive by id", "[ipc]") {
 TEST_CASE_METHOD(queue_fixture, "send and receive file message", "[ipc]") {
   rq.resize(10240);
   rq->mtype = 1;
-  std::copy_n("ServiceName", sizeof("ServiceName"), rq->servicename);
+  rq->service = 7;
+  rq->generation = 3;
   rq->flags = 1;
   rq->cd = 2;
 
@@ -73,3 +87,493 @@ TEST_CASE_METHOD(queue_fixture, "send and receive file message", "[ipc]") {
   REQUIRE(rs->flags == 1);
   REQUIRE(rs->cd == 2);
 }
+
+static std::atomic<int> app_signals(0);
+
+// Runs before the first timed send of the process claims a signal
+TEST_CASE_METHOD(queue_fixture, "timed send keeps application signal handler",
+                 "[ipc]") {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = [](int) { app_signals++; };
+  sigemptyset(&sa.sa_mask);
+  REQUIRE(sigaction(SIGRTMIN, &sa, nullptr) == 0);
+
+  rq.resize(512);
+  while (fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noblock)) {
+  }
+  REQUIRE(!fux::ipc::qsend(msqid, rq, 20, fux::ipc::flags::noflags));
+
+  struct sigaction now;
+  REQUIRE(sigaction(SIGRTMIN, nullptr, &now) == 0);
+  REQUIRE(now.sa_handler == sa.sa_handler);
+  REQUIRE(app_signals == 0);
+}
+
+TEST_CASE_METHOD(queue_fixture, "send to full queue times out", "[ipc]") {
+  rq.resize(512);
+  while (fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noblock)) {
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  REQUIRE(!fux::ipc::qsend(msqid, rq, 50, fux::ipc::flags::noflags));
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  REQUIRE(elapsed >= std::chrono::milliseconds(50));
+  REQUIRE(elapsed < std::chrono::milliseconds(100));
+}
+
+TEST_CASE_METHOD(queue_fixture, "send to full queue resumes when space frees",
+                 "[ipc]") {
+  rq.resize(512);
+  while (fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noblock)) {
+  }
+
+  std::thread t([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    fux::ipc::qrecv(msqid, rs, 0, 0);
+  });
+  auto start = std::chrono::steady_clock::now();
+  REQUIRE(fux::ipc::qsend(msqid, rq, 5000, fux::ipc::flags::noflags));
+  REQUIRE(std::chrono::steady_clock::now() - start <
+          std::chrono::milliseconds(100));
+  t.join();
+}
+
+TEST_CASE_METHOD(queue_fixture, "receive into typed buffer", "[ipc]") {
+  for (long size : {100, 10000}) {
+    auto data = tpalloc(const_cast<char *>("STRING"), nullptr, size);
+    std::fill_n(data, size - 1, 'x');
+    data[size - 1] = '\0';
+
+    rq.set_data(data, 0);
+    rq->cd = 3;
+    fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+    tpfree(data);
+
+    // Buffer of another type is turned into STRING and grows as needed
+    auto buf = tpalloc(const_cast<char *>("CARRAY"), nullptr, 10);
+    auto len = fux::ipc::qrecv(msqid, rs, &buf, 0, 0);
+    REQUIRE(len == size);
+    REQUIRE(rs->cd == 3);
+    char type[8];
+    REQUIRE(tptypes(buf, type, nullptr) != -1);
+    REQUIRE(std::string(type, 6) == "STRING");
+    REQUIRE(strlen(buf) == size_t(size - 1));
+    tpfree(buf);
+  }
+}
+
+TEST_CASE_METHOD(queue_fixture, "queue depth and non-blocking receive",
+                 "[ipc]") {
+  auto buf = tpalloc(const_cast<char *>("STRING"), nullptr, 10);
+  rq.set_data(buf, 0);
+  rq->mtype = 1;
+  REQUIRE(fux::ipc::qdepth(msqid) == 0);
+  for (int i = 0; i < 3; i++) {
+    fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+  }
+  REQUIRE(fux::ipc::qdepth(msqid) == 3);
+
+  for (int i = 0; i < 3; i++) {
+    REQUIRE(fux::ipc::qrecv(msqid, rs, &buf, 0, IPC_NOWAIT) != -1);
+  }
+  REQUIRE(fux::ipc::qdepth(msqid) == 0);
+  REQUIRE(fux::ipc::qrecv(msqid, rs, &buf, 0, IPC_NOWAIT) == -1);
+  tpfree(buf);
+}
+
+TEST_CASE_METHOD(queue_fixture, "blocking receive is interrupted", "[ipc]") {
+  std::atomic<bool> ready(false), done(false);
+  long len = 0;
+  std::thread t([&] {
+    fux::ipc::qinterruptible();
+    ready = true;
+    auto buf = tpalloc(const_cast<char *>("STRING"), nullptr, 10);
+    len = fux::ipc::qrecv(msqid, rs, &buf, 0, 0);
+    tpfree(buf);
+    done = true;
+  });
+  while (!ready) {
+    std::this_thread::yield();
+  }
+  // Signal is lost if it arrives before the receiver starts to wait
+  while (!done) {
+    fux::ipc::qinterrupt(t.native_handle());
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  t.join();
+  REQUIRE(len == -1);
+  // Neither wakeup went through the handler of the application
+  REQUIRE(app_signals == 0);
+}
+
+struct shm_queue_fixture {
+  int msqid;
+  fux::ipc::msg rq, rs;
+  shm_queue_fixture() { msqid = fux::ipc::qcreate(true); }
+  ~shm_queue_fixture() { fux::ipc::qdelete(msqid); }
+};
+
+TEST_CASE_METHOD(shm_queue_fixture, "send and receive shm message", "[ipc]") {
+  REQUIRE(msqid < -1);
+  rq.resize(1024);
+
+  rq->mtype = 1;
+  rq->service = 7;
+  rq->generation = 3;
+  rq->flags = 1;
+  rq->cd = 2;
+
+  fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+
+  fux::ipc::qrecv(msqid, rs, 0, 0);
+
+  REQUIRE(rs.size() == rq.size());
+  REQUIRE(rs->mtype == 1);
+  REQUIRE(rs->ttype == fux::ipc::queue);
+  REQUIRE(rs->flags == 1);
+  REQUIRE(rs->cd == 2);
+}
+
+TEST_CASE_METHOD(shm_queue_fixture, "shm queue keeps mtype priorities",
+                 "[ipc]") {
+  rq.resize(512);
+
+  int i = 1;
+  while (true) {
+    rq->mtype = 4 - i % 4;
+    if (!fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noblock)) {
+      i--;
+      break;
+    }
+    i++;
+  }
+  REQUIRE(i > 2);
+  REQUIRE(fux::ipc::qdepth(msqid) == size_t(i));
+
+  fux::ipc::qrecv(msqid, rs, 3, 0);
+  REQUIRE(rs->mtype == 3);
+
+  long last = 0;
+  while (i > 1) {
+    fux::ipc::qrecv(msqid, rs, std::numeric_limits<long>::min(), 0);
+    REQUIRE(rs->mtype >= last);
+    last = rs->mtype;
+    i--;
+  }
+  REQUIRE_THROWS_AS(fux::ipc::qrecv(msqid, rs, 0, IPC_NOWAIT),
+                    std::system_error);
+}
+
+TEST_CASE_METHOD(shm_queue_fixture, "send to full shm queue times out",
+                 "[ipc]") {
+  rq.resize(512);
+  while (fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noblock)) {
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  REQUIRE(!fux::ipc::qsend(msqid, rq, 50, fux::ipc::flags::noflags));
+  REQUIRE(std::chrono::steady_clock::now() - start >=
+          std::chrono::milliseconds(50));
+}
+
+TEST_CASE_METHOD(shm_queue_fixture, "send and receive shm file message",
+                 "[ipc]") {
+  rq.resize(10240);
+  rq->mtype = 1;
+  rq->cd = 2;
+
+  fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+  fux::ipc::qrecv(msqid, rs, 0, 0);
+
+  REQUIRE(rs.size() == rq.size());
+  REQUIRE(rs->ttype == fux::ipc::file);
+  REQUIRE(rs->cd == 2);
+}
+
+// Each consumer thread stops at one of the cd=-1 messages sent at the end
+static long produce_consume(int msqid, int threads, int messages) {
+  std::atomic<long> sum(0);
+
+  std::vector<std::thread> consumers;
+  for (int t = 0; t < threads; t++) {
+    consumers.emplace_back([&, t] {
+      fux::ipc::qshard(t);
+      fux::ipc::msg m;
+      while (true) {
+        fux::ipc::qrecv(msqid, m, 0, 0);
+        if (m->cd == -1) {
+          break;
+        }
+        sum += m->cd;
+      }
+    });
+  }
+  std::vector<std::thread> producers;
+  for (int t = 0; t < threads; t++) {
+    producers.emplace_back([&] {
+      fux::ipc::msg m;
+      for (int i = 1; i <= messages; i++) {
+        m->cd = i;
+        fux::ipc::qsend(msqid, m, 0, fux::ipc::flags::notime);
+      }
+    });
+  }
+  for (auto &t : producers) {
+    t.join();
+  }
+  fux::ipc::msg rq;
+  for (int t = 0; t < threads; t++) {
+    rq->cd = -1;
+    fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::notime);
+  }
+  for (auto &t : consumers) {
+    t.join();
+  }
+  return sum;
+}
+
+TEST_CASE_METHOD(shm_queue_fixture, "many producers and consumers", "[ipc]") {
+  constexpr int threads = 4;
+  constexpr int messages = 10000;
+  REQUIRE(produce_consume(msqid, threads, messages) ==
+          long(threads) * messages * (messages + 1) / 2);
+}
+
+struct sharded_queue_fixture {
+  int msqid;
+  fux::ipc::msg rq, rs;
+  sharded_queue_fixture() { msqid = fux::ipc::qcreate(true, 4); }
+  ~sharded_queue_fixture() {
+    fux::ipc::qdelete(msqid);
+    fux::ipc::qshard(0);
+  }
+};
+
+TEST_CASE_METHOD(sharded_queue_fixture, "idle receiver steals from shards",
+                 "[ipc]") {
+  rq.resize(512);
+  for (int i = 0; i < 16; i++) {
+    rq->cd = i;
+    fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+  }
+  auto stats = fux::ipc::qstats(msqid);
+  REQUIRE(stats.shards == 4);
+  REQUIRE(stats.queued == 16);
+  REQUIRE(stats.stolen == 0);
+
+  // Senders spread messages evenly, 4 are in the shard of this thread
+  fux::ipc::qshard(1);
+  long sum = 0;
+  for (int i = 0; i < 16; i++) {
+    fux::ipc::qrecv(msqid, rs, 0, IPC_NOWAIT);
+    sum += rs->cd;
+  }
+  REQUIRE(sum == 15 * 16 / 2);
+  REQUIRE_THROWS_AS(fux::ipc::qrecv(msqid, rs, 0, IPC_NOWAIT),
+                    std::system_error);
+
+  stats = fux::ipc::qstats(msqid);
+  REQUIRE(stats.queued == 0);
+  REQUIRE(stats.stolen == 12);
+}
+
+TEST_CASE_METHOD(sharded_queue_fixture,
+                 "many producers and consumers on shards", "[ipc]") {
+  constexpr int threads = 4;
+  constexpr int messages = 10000;
+  REQUIRE(produce_consume(msqid, threads, messages) ==
+          long(threads) * messages * (messages + 1) / 2);
+}
+
+struct mailbox_fixture {
+  int mbid;
+  fux::ipc::msg rq, rs;
+  mailbox_fixture() { mbid = fux::ipc::mbcreate(); }
+  ~mailbox_fixture() { fux::ipc::mbdelete(mbid); }
+};
+
+TEST_CASE_METHOD(mailbox_fixture, "replies through mailbox", "[ipc]") {
+  uint32_t queued = 0;
+  rq.resize(1024);
+  rq->mtype = 5;
+  rq->cd = 5;
+  rq->rcode = 42;
+
+  REQUIRE(fux::ipc::mbsend(mbid, rq));
+  SECTION("slot of cd is busy until received") {
+    REQUIRE(!fux::ipc::mbsend(mbid, rq));
+  }
+  SECTION("large replies do not fit") {
+    rq.resize(10240);
+    rq->cd = 6;
+    REQUIRE(!fux::ipc::mbsend(mbid, rq));
+  }
+
+  REQUIRE(fux::ipc::mbrecv(mbid, rs, queued));
+  REQUIRE(rs.size() == 1024);
+  REQUIRE(rs->cd == 5);
+  REQUIRE(rs->rcode == 42);
+  REQUIRE(queued == 0);
+
+  fux::ipc::mbnotify(mbid);
+  REQUIRE(!fux::ipc::mbrecv(mbid, rs, queued));
+  REQUIRE(queued == 1);
+}
+
+TEST_CASE_METHOD(mailbox_fixture, "mailbox wakes waiting receiver", "[ipc]") {
+  std::thread t([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    rq->cd = 7;
+    fux::ipc::mbsend(mbid, rq);
+  });
+  uint32_t queued = 0;
+  REQUIRE(fux::ipc::mbrecv(mbid, rs, queued));
+  REQUIRE(rs->cd == 7);
+  t.join();
+}
+
+struct blob_fixture {
+  int shmid, msqid;
+  fux::ipc::msg rq, rs;
+  blob_fixture() {
+    shmid = fux::ipc::blobcreate(64 * 1024);
+    fux::ipc::blobattach(shmid);
+    msqid = fux::ipc::qcreate();
+  }
+  ~blob_fixture() {
+    fux::ipc::blobattach(-1);
+    shmctl(shmid, IPC_RMID, nullptr);
+    fux::ipc::qdelete(msqid);
+  }
+};
+
+TEST_CASE_METHOD(blob_fixture, "large messages go through arena", "[ipc]") {
+  rq.resize(10240);
+  rq->mtype = 1;
+  rq->cd = 2;
+  rq.buf()[10239] = 'x';
+
+  fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+  fux::ipc::qrecv(msqid, rs, 0, 0);
+
+  REQUIRE(rs.size() == rq.size());
+  REQUIRE(rs->ttype == fux::ipc::blob);
+  REQUIRE(rs->cd == 2);
+  REQUIRE(rs.buf()[10239] == 'x');
+}
+
+TEST_CASE_METHOD(blob_fixture, "files are used when arena is full", "[ipc]") {
+  rq.resize(40000);
+  fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+  fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+
+  fux::ipc::qrecv(msqid, rs, 0, 0);
+  REQUIRE(rs->ttype == fux::ipc::blob);
+  fux::ipc::qrecv(msqid, rs, 0, 0);
+  REQUIRE(rs->ttype == fux::ipc::file);
+  REQUIRE(rs.size() == rq.size());
+}
+
+TEST_CASE_METHOD(blob_fixture, "messages to removed queues are reclaimed",
+                 "[ipc]") {
+  rq.resize(40000);
+  fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+  fux::ipc::qdelete(msqid);
+  msqid = fux::ipc::qcreate();
+
+  fux::ipc::blobreclaim();
+  fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+  fux::ipc::qrecv(msqid, rs, 0, 0);
+  REQUIRE(rs->ttype == fux::ipc::blob);
+}
+
+TEST_CASE_METHOD(blob_fixture, "shared buffers are handed over", "[ipc]") {
+  auto data =
+      tpallocx(const_cast<char *>("STRING"), nullptr, 10000, TPSHAREDMEM);
+  strcpy(data, "hello");
+
+  SECTION("buffer itself goes to the receiver") {
+    rq.set_data(data, 0, true);
+    REQUIRE(rq.handle() != -1);
+    REQUIRE(fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags));
+    REQUIRE(rq.given());
+
+    auto buf = tpalloc(const_cast<char *>("CARRAY"), nullptr, 10);
+    REQUIRE(fux::ipc::qrecv(msqid, rs, &buf, 0, 0) == 6);
+    REQUIRE(buf == data);
+    REQUIRE(strcmp(buf, "hello") == 0);
+    tpfree(buf);
+  }
+
+  SECTION("sender keeps its buffer and a copy is handed over") {
+    rq.set_data(data, 0);
+    REQUIRE(rq.handle() != -1);
+    REQUIRE(fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags));
+    REQUIRE(!rq.given());
+
+    fux::ipc::qrecv(msqid, rs, 0, 0);
+    auto buf = tpalloc(const_cast<char *>("CARRAY"), nullptr, 10);
+    rs.get_data(&buf);
+    REQUIRE(buf != data);
+    REQUIRE(strcmp(buf, "hello") == 0);
+    tpfree(buf);
+    tpfree(data);
+  }
+
+  // All of the arena is free again
+  auto big =
+      tpallocx(const_cast<char *>("CARRAY"), nullptr, 40 * 1024, TPSHAREDMEM);
+  rq.set_data(big, 10, true);
+  REQUIRE(rq.handle() != -1);
+  fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+  auto buf = tpalloc(const_cast<char *>("CARRAY"), nullptr, 10);
+  REQUIRE(fux::ipc::qrecv(msqid, rs, &buf, 0, 0) == 10);
+  REQUIRE(buf == big);
+  tpfree(buf);
+}
+
+TEST_CASE_METHOD(blob_fixture, "failed hand over keeps the buffer", "[ipc]") {
+  auto data =
+      tpallocx(const_cast<char *>("CARRAY"), nullptr, 40 * 1024, TPSHAREDMEM);
+  rq.set_data(data, 10, true);
+  REQUIRE(rq.handle() != -1);
+  fux::ipc::qdelete(msqid);
+  REQUIRE_THROWS(fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags));
+  msqid = fux::ipc::qcreate();
+
+  // Arena has room for one such buffer only
+  fux::ipc::blobreclaim();
+  auto other =
+      tpallocx(const_cast<char *>("CARRAY"), nullptr, 40 * 1024, TPSHAREDMEM);
+  rq.set_data(other, 10, true);
+  REQUIRE(rq.handle() == -1);
+  tpfree(other);
+  tpfree(data);
+}
+
+TEST_CASE_METHOD(blob_fixture, "buffers of dead owners are reclaimed",
+                 "[ipc]") {
+  pid_t pid = fork();
+  if (pid == 0) {
+    tpallocx(const_cast<char *>("CARRAY"), nullptr, 40 * 1024, TPSHAREDMEM);
+    _exit(0);
+  }
+  waitpid(pid, nullptr, 0);
+
+  auto data =
+      tpallocx(const_cast<char *>("CARRAY"), nullptr, 40 * 1024, TPSHAREDMEM);
+  rq.set_data(data, 10, true);
+  REQUIRE(rq.handle() == -1);
+  tpfree(data);
+
+  fux::ipc::blobreclaim();
+  data =
+      tpallocx(const_cast<char *>("CARRAY"), nullptr, 40 * 1024, TPSHAREDMEM);
+  rq.set_data(data, 10, true);
+  REQUIRE(rq.handle() != -1);
+  fux::ipc::qsend(msqid, rq, 0, fux::ipc::flags::noflags);
+  auto buf = tpalloc(const_cast<char *>("CARRAY"), nullptr, 10);
+  REQUIRE(fux::ipc::qrecv(msqid, rs, &buf, 0, 0) == 10);
+  tpfree(buf);
+}
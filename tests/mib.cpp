@@ -2,8 +2,11 @@
 // Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
 
 #include <catch.hpp>
+#include <memory>
 #include <stdexcept>
+#include <vector>
 
+#include "../src/metrics.h"
 #include "../src/mib.h"
 #include "../src/ubbreader.h"
 
@@ -24,6 +27,11 @@ TEST_CASE("services can be advertised", "[mib]") {
   REQUIRE_THROWS_AS(m.advertise("service", q, srv), std::logic_error);
   m.unadvertise("service", q, srv);
   REQUIRE_THROWS_AS(m.unadvertise("service", q, srv), std::logic_error);
+
+  m.advertise("other", q, srv);
+  auto &service = m.services().at(m.find_service("service"));
+  auto &other = m.services().at(m.find_service("other"));
+  REQUIRE(service.generation != other.generation);
 }
 
 SCENARIO("servers can be added", "[mib]") {
@@ -60,3 +68,156 @@ SCENARIO("servers can be added", "[mib]") {
     }
   }
 }
+
+TEST_CASE("latency histogram percentiles", "[mib]") {
+  auto h = std::make_unique<histogram>();
+  REQUIRE(h->percentile(0.5) == 0);
+
+  for (uint64_t v = 0; v < 64; v++) {
+    REQUIRE(histogram::upper(histogram::bucket(v)) >= v);
+    REQUIRE(histogram::upper(histogram::bucket(v)) < v * 1.25 + 1);
+  }
+
+  for (int i = 0; i < 990; i++) {
+    h->record(100);
+  }
+  for (int i = 0; i < 10; i++) {
+    h->record(10000);
+  }
+  REQUIRE(h->percentile(0.5) >= 100);
+  REQUIRE(h->percentile(0.5) < 125);
+  REQUIRE(h->percentile(0.99) < 125);
+  REQUIRE(h->percentile(0.999) >= 10000);
+  REQUIRE(h->percentile(0.999) < 12500);
+
+  h->reset();
+  REQUIRE(h->percentile(0.999) == 0);
+}
+
+TEST_CASE("metrics snapshot copies counters", "[mib]") {
+  tuxconfig tuxcfg;
+  tuxcfg.size = 0;
+  tuxcfg.ipckey = 0;
+  tuxcfg.maxservers = 5;
+  tuxcfg.maxservices = 5;
+  tuxcfg.maxgroups = 5;
+  tuxcfg.maxqueues = 5;
+
+  mib m(tuxcfg, fux::mib::in_heap());
+  auto srv = m.make_server(2, 1, "server", "clopt", "rqaddr");
+  m.advertise("service", m.servers().at(srv).rqaddr, srv);
+  auto &service = m.services().at(m.find_service("service"));
+  service.counters.done = 3;
+  service.latency.service.record(100);
+  m.servers().at(srv).counters.failed = 1;
+
+  std::vector<char> buf(sizeof(fux::metrics::header));
+  auto needed = fux::metrics::snapshot(m, buf.data(), buf.size());
+  REQUIRE(needed > ssize_t(buf.size()));
+  buf.resize(needed);
+
+  // Data lock held by someone else
+  m->seq = 5;
+  REQUIRE(fux::metrics::snapshot(m, buf.data(), buf.size()) == -1);
+  m->seq = 6;
+  REQUIRE(fux::metrics::snapshot(m, buf.data(), buf.size()) == needed);
+
+  auto h = reinterpret_cast<fux::metrics::header *>(buf.data());
+  REQUIRE(h->version == fux::metrics::version);
+  REQUIRE(h->seq == 6);
+  REQUIRE(h->servers == 1);
+  REQUIRE(h->services == 1);
+  auto &s = fux::metrics::servers(h)[0];
+  REQUIRE(std::string(s.name) == "server");
+  REQUIRE(std::string(s.rqaddr) == "rqaddr");
+  REQUIRE(s.srvid == 2);
+  REQUIRE(s.c.failed == 1);
+  auto &v = fux::metrics::services(h)[0];
+  REQUIRE(std::string(v.name) == "service");
+  REQUIRE(v.c.done == 3);
+  REQUIRE(v.c.service[0] >= 100);
+
+  auto text = fux::metrics::format(h);
+  REQUIRE(text.find("server.1.2.failed=1\n") != std::string::npos);
+  REQUIRE(text.find("service.service.done=3\n") != std::string::npos);
+}
+
+TEST_CASE("lookups use hash indexes", "[mib]") {
+  tuxconfig tuxcfg;
+  tuxcfg.size = 0;
+  tuxcfg.ipckey = 0;
+  tuxcfg.maxservers = 100;
+  tuxcfg.maxservices = 1000;
+  tuxcfg.maxgroups = 10;
+  tuxcfg.maxqueues = 100;
+
+  mib m(tuxcfg, fux::mib::in_heap());
+  for (int i = 0; i < 10; i++) {
+    m.make_group(i + 1, "GROUP" + std::to_string(i), "", "", "");
+  }
+  for (int i = 0; i < 100; i++) {
+    m.make_server(i / 10 + 1, i % 10 + 1, "server", "", std::to_string(i));
+  }
+  for (int i = 0; i < 1000; i++) {
+    m.make_service("SVC" + std::to_string(i));
+  }
+
+  REQUIRE(m.find_group(5) == 4);
+  REQUIRE(m.find_group(11) == mib::badoff);
+  REQUIRE(m.find_server(3, 2) == 21);
+  REQUIRE(m.find_server(11, 1) == mib::badoff);
+  REQUIRE(m.group_index("GROUP4") == 4);
+  REQUIRE(m.group_index("GROUP10") == mib::badoff);
+  REQUIRE(m.server_index(3, 1) == 21);
+  REQUIRE(m.server_index(11, 0) == mib::badoff);
+  REQUIRE(m.servers().at(21).group_idx == 1);
+  REQUIRE(m.find_queue("42") == 42);
+  REQUIRE(m.find_queue("100") == mib::badoff);
+  for (int i = 0; i < 1000; i++) {
+    REQUIRE(m.find_service("SVC" + std::to_string(i)) == size_t(i));
+  }
+  REQUIRE(m.find_service("SVC1000") == mib::badoff);
+  REQUIRE_THROWS_AS(m.make_service("SVC7"), std::logic_error);
+  REQUIRE_THROWS_AS(m.make_service("SVC1000"), std::out_of_range);
+}
+
+TEST_CASE("advertisements are listed per service", "[mib]") {
+  tuxconfig tuxcfg;
+  tuxcfg.size = 0;
+  tuxcfg.ipckey = 0;
+  tuxcfg.maxservers = 3;
+  tuxcfg.maxservices = 2;
+  tuxcfg.maxgroups = 1;
+  tuxcfg.maxqueues = 3;
+  tuxcfg.maxadvertisements = 4;
+
+  mib m(tuxcfg, fux::mib::in_heap());
+  size_t srv[3];
+  for (int i = 0; i < 3; i++) {
+    srv[i] = m.make_server(i + 1, 1, "server", "", std::to_string(i));
+  }
+  auto q = [&](int i) { return m.servers().at(srv[i]).rqaddr; };
+  auto listed = [&](const char *name) {
+    std::vector<size_t> servers;
+    auto adv = m.advertisements();
+    for (auto i = m.services().at(m.find_service(name)).advertisements;
+         i != mib::badoff; i = adv.at(i).next) {
+      servers.push_back(adv.at(i).server);
+    }
+    return servers;
+  };
+
+  m.advertise("A", q(0), srv[0]);
+  m.advertise("B", q(0), srv[0]);
+  m.advertise("A", q(1), srv[1]);
+  m.advertise("A", q(2), srv[2]);
+  REQUIRE(listed("A") == std::vector<size_t>({srv[2], srv[1], srv[0]}));
+  REQUIRE(listed("B") == std::vector<size_t>({srv[0]}));
+  REQUIRE_THROWS_AS(m.advertise("B", q(1), srv[1]), std::out_of_range);
+
+  m.unadvertise("A", q(1), srv[1]);
+  REQUIRE(listed("A") == std::vector<size_t>({srv[2], srv[0]}));
+  m.advertise("B", q(1), srv[1]);
+  REQUIRE(listed("B") == std::vector<size_t>({srv[1], srv[0]}));
+  REQUIRE(m.advertisements().length() == 4);
+}
@@ -0,0 +1,107 @@
+// This file is part of Fuxedo
+// Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
+
+#include <fml32.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <catch.hpp>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#include "../src/slowlog.h"
+
+namespace slowlog = fux::slowlog;
+
+static std::string logfile() {
+  time_t t = time(nullptr);
+  struct tm timeinfo;
+  localtime_r(&t, &timeinfo);
+  char name[64];
+  snprintf(name, sizeof(name), "slowlog_test.%02d%02d%02d",
+           timeinfo.tm_mon + 1, timeinfo.tm_mday, timeinfo.tm_year % 100);
+  return name;
+}
+
+static std::string contents(const std::string &name) {
+  std::ifstream in(name);
+  return std::string((std::istreambuf_iterator<char>(in)),
+                     std::istreambuf_iterator<char>());
+}
+
+static slowlog::record make_record(const char *service, int cd) {
+  slowlog::record r;
+  r.service = service;
+  r.cd = cd;
+  r.gttid = fux::bad_gttid;
+  r.caller = getpid();
+  r.rval = 0;
+  r.wait = 10;
+  r.elapsed = 2000000;
+  r.cpu = 5;
+  return r;
+}
+
+TEST_CASE("slow log is rate limited", "[slowlog]") {
+  setenv("SLOWLOGPFX", "slowlog_test", 1);
+  setenv("SLOWLOGDATA", "text", 1);
+  setenv("SLOWLOGRATE", "2", 1);
+  unlink(logfile().c_str());
+
+  REQUIRE(slowlog::mode() == slowlog::snapshot::text);
+  REQUIRE(slowlog::admit());
+  REQUIRE(slowlog::admit());
+  REQUIRE_FALSE(slowlog::admit());
+
+  auto fbfr = Falloc32(1, 64);
+  REQUIRE(Fchg32(fbfr, Fmkfldid32(FLD_STRING, 10), 0,
+                 const_cast<char *>("input that was slow"), 0) != -1);
+  for (int i = 1; i <= 2; i++) {
+    auto r = make_record("SLOWSVC", i);
+    if (i == 2) {
+      r.data = slowlog::copy(fbfr);
+      REQUIRE(!r.data.empty());
+    }
+    slowlog::submit(std::move(r));
+  }
+  Ffree32(fbfr);
+  slowlog::flush();
+
+  auto text = contents(logfile());
+  REQUIRE(text.find("SLOWSVC cd=1 gttid=-1 caller=" +
+                    std::to_string(getpid()) +
+                    " wait=10 svc=2000000 cpu=5 rval=0 suppressed=1\n") !=
+          std::string::npos);
+  REQUIRE(text.find("SLOWSVC cd=2") != std::string::npos);
+  REQUIRE(text.find("\tinput that was slow\n") != std::string::npos);
+  unlink(logfile().c_str());
+}
+
+TEST_CASE("slow log is written after fork", "[slowlog]") {
+  setenv("SLOWLOGPFX", "slowlog_test", 1);
+  unlink(logfile().c_str());
+  // Starts the writer thread of the parent
+  slowlog::submit(make_record("PARENTSVC", 1));
+  slowlog::flush();
+
+  auto pid = fork();
+  REQUIRE(pid != -1);
+  if (pid == 0) {
+    // A child waiting for a thread it does not have is killed
+    alarm(10);
+    slowlog::submit(make_record("CHILDSVC", 2));
+    slowlog::flush();
+    _exit(0);
+  }
+  int status;
+  REQUIRE(waitpid(pid, &status, 0) == pid);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE(WEXITSTATUS(status) == 0);
+
+  auto text = contents(logfile());
+  REQUIRE(text.find("PARENTSVC cd=1") != std::string::npos);
+  REQUIRE(text.find("CHILDSVC cd=2") != std::string::npos);
+  unlink(logfile().c_str());
+}
@@ -2,8 +2,17 @@
 // Copyright (C) 2017 Aivars Kalvans <aivars.kalvans@gmail.com>
 
 #include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 #include <userlog.h>
 #include <catch.hpp>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+#include "../src/trace.h"
 
 TEST_CASE("test", "[userlog]") { userlog("Hello %s", "world"); }
 TEST_CASE("test millisec", "[userlog]") {
@@ -14,3 +23,55 @@ TEST_CASE("test prefix", "[userlog]") {
   setenv("ULOGPFX", "/root/no_permission", 1);
   userlog("Hello %s", " no permission to root");
 }
+TEST_CASE("buffered lines are written in order", "[userlog]") {
+  // Read by the logger of this process already, a forked child reads it again
+  setenv("ULOGPFX", "userlog_order", 1);
+  time_t t = time(nullptr);
+  struct tm timeinfo;
+  localtime_r(&t, &timeinfo);
+  char logfile[64];
+  snprintf(logfile, sizeof(logfile), "userlog_order.%02d%02d%02d",
+           timeinfo.tm_mon + 1, timeinfo.tm_mday, timeinfo.tm_year % 100);
+  unlink(logfile);
+
+  auto pid = fork();
+  REQUIRE(pid != -1);
+  if (pid == 0) {
+    // More than fits into the ring buffer
+    for (int i = 0; i < 1000; i++) {
+      userlog("line %d", i);
+    }
+    userlog_sync("done");
+    _exit(0);
+  }
+  int status;
+  REQUIRE(waitpid(pid, &status, 0) == pid);
+  REQUIRE(WIFEXITED(status));
+  userlog_sync("Hello %s", "world of the parent");
+
+  std::ifstream in(logfile);
+  std::string line;
+  int i = 0;
+  while (std::getline(in, line)) {
+    if (i < 1000) {
+      REQUIRE(line.substr(line.find(": ") + 2) ==
+              "line " + std::to_string(i));
+    } else {
+      REQUIRE(line.substr(line.find(": ") + 2) == "done");
+    }
+    i++;
+  }
+  REQUIRE(i == 1001);
+  unlink(logfile);
+}
+TEST_CASE("trace specification", "[userlog]") {
+  namespace trace = fux::trace;
+  REQUIRE(trace::parse("") == 0);
+  REQUIRE(trace::parse("off") == 0);
+  REQUIRE(trace::parse("atmi") == trace::atmi);
+  REQUIRE(trace::parse("atmi+xa:ulog") == (trace::atmi | trace::xa));
+  REQUIRE(trace::parse("*-ipc") ==
+          (trace::atmi | trace::xa | trace::trace | trace::mib));
+  REQUIRE(trace::parse("on") == trace::parse("*"));
+  REQUIRE_THROWS_AS(trace::parse("atmi+bogus"), std::invalid_argument);
+}
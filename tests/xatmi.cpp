@@ -3,8 +3,13 @@
 
 #include <catch.hpp>
 
+#include <fml32.h>
+#include <tmtypes.h>
+#include <tpadm.h>
 #include <xatmi.h>
 #include <cstring>
+
+#include "../src/mibtypes.h"
 #define DECONST(x) const_cast<char *>(x)
 
 TEST_CASE("tpstrerror", "[xatmi]") {
@@ -138,3 +143,169 @@ TEST_CASE("tprealloc inputs", "[tp-memory]") {
     }
   }
 }
+
+TEST_CASE("tprealloc keeps contents", "[tp-memory]") {
+  char *ptr = tpalloc(DECONST("CARRAY"), DECONST("*"), 100);
+  REQUIRE(ptr != nullptr);
+  for (int i = 0; i < 100; i++) {
+    ptr[i] = i;
+  }
+
+  // Within the same size class and beyond the largest one
+  for (long size : {150, 1000, 100000, 200}) {
+    ptr = tprealloc(ptr, size);
+    REQUIRE(ptr != nullptr);
+    for (int i = 0; i < 100; i++) {
+      REQUIRE(ptr[i] == i);
+    }
+    char type[8];
+    REQUIRE(tptypes(ptr, type, nullptr) != -1);
+    REQUIRE(strcmp(type, "CARRAY") == 0);
+  }
+  tpfree(ptr);
+}
+
+static long outstanding(const char *type) {
+  long result = -1;
+  for (auto &stats : fux::mem::stats()) {
+    if (stats.type == type) {
+      result = stats.outstanding;
+      REQUIRE(stats.peak >= result);
+    }
+  }
+  return result;
+}
+
+TEST_CASE("buffers are counted per type", "[tp-memory]") {
+  auto before = outstanding("STRING");
+  char *ptr = tpalloc(DECONST("STRING"), nullptr, 100);
+  REQUIRE(outstanding("STRING") == before + 1);
+
+  // Importing an image of another type changes the type of buffer
+  char *fml = tpalloc(DECONST("FML32"), DECONST("*"), 1024);
+  char image[2048];
+  long len = sizeof(image);
+  REQUIRE(tpexport(fml, 0, image, &len, 0) != -1);
+  REQUIRE(tpimport(image, len, &ptr, nullptr, 0) != -1);
+  REQUIRE(outstanding("STRING") == before);
+
+  tpfree(ptr);
+  tpfree(fml);
+  REQUIRE(outstanding("STRING") == before);
+}
+
+TEST_CASE("buffer counters are published", "[tp-memory]") {
+  static buffer_counters slots[max_buftypes];
+  fux::mem::publish(slots, max_buftypes);
+  // Builtin types come first
+  auto &string = slots[2];
+  REQUIRE(strcmp(string.type, "STRING") == 0);
+  REQUIRE(string.outstanding == outstanding("STRING"));
+
+  char *ptr = tpalloc(DECONST("STRING"), nullptr, 100);
+  REQUIRE(string.outstanding == outstanding("STRING"));
+  REQUIRE(string.peak >= string.outstanding);
+  tpfree(ptr);
+  REQUIRE(string.outstanding == outstanding("STRING"));
+}
+
+// Run-length encoded buffer of fixed size
+static long rleencdec(int op, char *encobj, long elen, char *obj, long olen) {
+  long n = 0;
+  if (op == TMENCODE) {
+    for (long i = 0; i < olen; n += 2) {
+      long j = i;
+      while (j < olen && j - i < 255 && obj[j] == obj[i]) {
+        j++;
+      }
+      if (n + 2 <= elen) {
+        encobj[n] = j - i;
+        encobj[n + 1] = obj[i];
+      }
+      i = j;
+    }
+  } else {
+    if (elen % 2 != 0) {
+      return -1;
+    }
+    for (long i = 0; i + 1 < elen; i += 2) {
+      for (int j = 0; j < static_cast<unsigned char>(encobj[i]); j++, n++) {
+        if (n < olen) {
+          obj[n] = encobj[i + 1];
+        }
+      }
+    }
+  }
+  return n;
+}
+
+TEST_CASE("tpregistertype", "[tp-memory]") {
+  static tmtype_sw_t rle = {};
+  strcpy(rle.type, "RLE");
+  strcpy(rle.subtype, "*");
+  rle.dfltsize = 1024;
+  rle.encdec = rleencdec;
+  static bool registered = false;
+  if (!registered) {
+    REQUIRE(tpregistertype(&rle) == 0);
+    registered = true;
+  }
+
+  SECTION("duplicate type is rejected") {
+    REQUIRE(tpregistertype(&rle) == -1);
+    REQUIRE(tperrno == TPEMATCH);
+  }
+
+  char *ptr = tpalloc(DECONST("RLE"), nullptr, 0);
+  REQUIRE(ptr != nullptr);
+  memset(ptr, 'x', 1024);
+  ptr[42] = 'y';
+
+  SECTION("encoded image is used") {
+    char image[64];
+    long len = sizeof(image);
+    REQUIRE(tpexport(ptr, 1024, image, &len, 0) != -1);
+    REQUIRE(len < 64);
+
+    char *copy = tpalloc(DECONST("STRING"), nullptr, 0);
+    REQUIRE(tpimport(image, len, &copy, nullptr, 0) != -1);
+    char type[8];
+    REQUIRE(tptypes(copy, type, nullptr) != -1);
+    REQUIRE(strcmp(type, "RLE") == 0);
+    REQUIRE(memcmp(copy, ptr, 1024) == 0);
+    tpfree(copy);
+  }
+
+  SECTION("failed decode keeps the type") {
+    char image[64];
+    long len = sizeof(image);
+    REQUIRE(tpexport(ptr, 1024, image, &len, 0) != -1);
+
+    char *copy = tpalloc(DECONST("STRING"), nullptr, 0);
+    REQUIRE(tpimport(image, len - 1, &copy, nullptr, 0) == -1);
+    char type[8];
+    REQUIRE(tptypes(copy, type, nullptr) != -1);
+    REQUIRE(strcmp(type, "STRING") == 0);
+    tpfree(copy);
+  }
+
+  SECTION("base64 string roundtrip") {
+    char image[128];
+    long len = sizeof(image);
+    REQUIRE(tpexport(ptr, 1024, image, &len, TPEX_STRING) != -1);
+
+    char *copy = tpalloc(DECONST("RLE"), nullptr, 0);
+    REQUIRE(tpimport(image, 0, &copy, nullptr, TPEX_STRING) != -1);
+    REQUIRE(memcmp(copy, ptr, 1024) == 0);
+    tpfree(copy);
+  }
+
+  SECTION("too small output buffer") {
+    char image[8];
+    long len = sizeof(image);
+    REQUIRE(tpexport(ptr, 1024, image, &len, 0) == -1);
+    REQUIRE(tperrno == TPELIMIT);
+    REQUIRE(len > 8);
+  }
+  tpfree(ptr);
+}